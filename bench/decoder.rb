@@ -0,0 +1,44 @@
+# Schema-compiled decoder benchmark: documents/s and objects allocated per
+# document of Jsonista::Decoder#decode, against Jsonista.parse followed by
+# building the same Struct and Data objects from the Hash.
+#
+#   rake bench:decoder            # N=documents (100000)
+#   ruby -Ilib bench/decoder.rb [N]
+require "jsonista"
+
+Address = Struct.new(:city, :zip)
+User = Data.define(:id, :name, :email, :score, :active, :tags, :address)
+
+ADDRESS = Jsonista.compile(Address, city: String, zip: String)
+USER = Jsonista.compile(User, id: Integer, name: String, email: String, score: Float,
+                              active: :boolean, tags: [String], address: ADDRESS)
+
+def from_hash(h)
+  a = h["address"]
+  User.new(id: h["id"], name: h["name"], email: h["email"], score: h["score"], active: h["active"],
+           tags: h["tags"], address: a && Address.new(a["city"], a["zip"]))
+end
+
+def measure(docs)
+  GC.start
+  objects = GC.stat(:total_allocated_objects)
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  docs.each { |d| yield d }
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+  [docs.size / t, (GC.stat(:total_allocated_objects) - objects).fdiv(docs.size)]
+end
+
+n = (ARGV[0] || 100_000).to_i
+docs = Array.new(n) do |i|
+  %Q({"id":#{i},"name":"user #{i}","email":"user#{i}@example.com","score":#{i % 100}.5,) +
+    %Q("active":#{i.odd?},"tags":["a","b"],"created_at":"2024-01-01T00:00:00Z",) +
+    %Q("address":{"city":"Tokyo","zip":"100-0001","country":"JP"},"meta":{"v":[1,2,3]}})
+end.each(&:freeze)
+
+puts format("%-24s %12s %12s", "", "docs/s", "objects/doc")
+[["parse + Data.new", ->(d) { from_hash(Jsonista.parse(d)) }],
+ ["Decoder#decode", ->(d) { USER.decode(d) }]].each do |name, f|
+  f.call(docs[0])
+  rate, objects = measure(docs, &f)
+  puts format("%-24s %12.0f %12.1f", name, rate, objects)
+end
@@ -0,0 +1,108 @@
+/*
+ * Two-stage mode benchmark: MB/s of stage 1 (structural indexing) and of
+ * stage 2 (validating walk of the index) on 1, 2, 4, 8 and 16 threads,
+ * against the single-pass validator.
+ *
+ *   cc -O2 -DHAVE_PTHREAD_H -Iext/jsonista -o tmp/index_bench bench/index_bench.c \
+ *      ext/jsonista/index.c ext/jsonista/parser.c ext/jsonista/number.c \
+ *      ext/jsonista/filter.c ext/jsonista/scan.c -lpthread -lm
+ *   tmp/index_bench [size in MB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "parser.h"
+#include "index.h"
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* an array of API-response-like records */
+static char *
+make_corpus(size_t size, size_t *lenp) {
+    static const char *const names[] = {
+	"alice", "bob", "caf\xC3\xA9", "\xE6\x97\xA5\xE6\x9C\xAC", "line\\nbreak",
+	"quote \\\"q\\\"", "emoji \xF0\x9F\x98\x80",
+    };
+    char *buf = malloc(size + 1024);
+    size_t len = 0;
+    unsigned int i = 0;
+    if (!buf) abort();
+    buf[len++] = '[';
+    while (len < size) {
+	len += sprintf(buf + len,
+	    "%s{\"id\": %u, \"name\": \"%s\", \"score\": %u.%02u, \"active\": %s,"
+	    " \"tags\": [\"a\", \"b\", \"c\"], \"geo\": {\"lat\": -%u.5, \"lng\": %u.25}}",
+	    i ? ",\n  " : "\n  ", i, names[i % 7], i % 1000, i % 100,
+	    i % 3 ? "true" : "false", i % 90, i % 180);
+	i++;
+    }
+    buf[len++] = ']';
+    *lenp = len;
+    return buf;
+}
+
+int
+main(int argc, char **argv) {
+    static const int threads[] = {1, 2, 4, 8, 16};
+    size_t size = (argc > 1 ? atoi(argv[1]) : 256) * (size_t)1024 * 1024, len;
+    char *buf = make_corpus(size, &len);
+    double mb = len / 1e6, t, best, base1 = 0, base = 0;
+    parser_t *parser = parser_new();
+    int i, r;
+
+    printf("%.0f MB, %ld online CPUs\n", mb, sysconf(_SC_NPROCESSORS_ONLN));
+    best = 1e9;
+    for (r = 0; r < 3; r++) {
+	const char *p = buf;
+	parser_init(parser);
+	t = now();
+	if (parser_validate_end(parser, &p, buf + len) != ERR_SUCCESS) {
+	    fprintf(stderr, "single pass: invalid at %ld\n", (long)(p - buf));
+	    return 1;
+	}
+	t = now() - t;
+	if (t < best) best = t;
+    }
+    printf("single pass: %8.1f MB/s\n\n", mb / best);
+
+    printf("%7s %14s %14s %14s %8s\n", "threads", "stage 1 MB/s", "stage 2 MB/s", "total MB/s", "speedup");
+    for (i = 0; i < (int)(sizeof(threads) / sizeof(threads[0])); i++) {
+	double best1 = 1e9, best2 = 1e9;
+	for (r = 0; r < 3; r++) {
+	    index_t idx;
+	    const char *p = buf;
+	    double t1, t2;
+	    t1 = now();
+	    if (index_build(&idx, buf, buf + len, threads[i])) {
+		fprintf(stderr, "stage 1 error\n");
+		return 1;
+	    }
+	    t2 = now();
+	    if (parser_validate_index(parser, &idx, &p, buf + len) != ERR_SUCCESS) {
+		fprintf(stderr, "stage 2: invalid at %ld\n", (long)(p - buf));
+		return 1;
+	    }
+	    t = now();
+	    index_free(&idx);
+	    if (t2 - t1 < best1) best1 = t2 - t1;
+	    if (t - t2 < best2) best2 = t - t2;
+	}
+	if (i == 0) {
+	    base1 = best1;
+	    base = best1 + best2;
+	}
+	printf("%7d %14.1f %14.1f %14.1f %7.2fx (stage 1 %.2fx)\n", threads[i],
+	       mb / best1, mb / best2, mb / (best1 + best2),
+	       base / (best1 + best2), base1 / best1);
+    }
+    parser_free(parser);
+    free(buf);
+    return 0;
+}
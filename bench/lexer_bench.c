@@ -0,0 +1,108 @@
+/*
+ * Lexer microbenchmark: MB/s and ns per token of the streaming parser,
+ * validating and with events off, over inputs that each keep it in a few
+ * states: the separators of arrays and objects, numbers, literals, ASCII
+ * and UTF-8 strings, deep nesting and indented whitespace.
+ *
+ *   cc -O3 -Iext/jsonista -o tmp/lexer_bench bench/lexer_bench.c \
+ *      ext/jsonista/parser.c ext/jsonista/number.c ext/jsonista/filter.c \
+ *      ext/jsonista/scan.c -lm
+ *   tmp/lexer_bench [size in MB]
+ *
+ * Add -DJSONISTA_NO_COMPUTED_GOTO to the cc line for the switch dispatch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "parser.h"
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct corpus_st {
+    const char *name;
+    const char *open, *item, *sep, *close;
+    int tokens; /* per item, with its separator */
+} corpus_t;
+
+static const corpus_t corpora[] = {
+    {"array of ints",     "[", "12345", ",", "]", 2},
+    {"array of floats",   "[", "-1.25e-3", ",", "]", 2},
+    {"array of literals", "[", "true,false,null", ",", "]", 6},
+    {"ascii strings",     "[", "\"hello, world\"", ",", "]", 2},
+    {"utf-8 strings",     "[", "\"caf\xC3\xA9 \xE6\x97\xA5\xE6\x9C\xAC \xF0\x9F\x98\x80\"", ",", "]", 2},
+    {"escaped strings",   "[", "\"a\\nb\\u00e9\\\"c\\\"\"", ",", "]", 2},
+    {"object members",    "{", "\"k\":1", ",", "}", 4},
+    {"records",           "[", "{\"id\":1,\"ok\":true,\"tags\":[\"a\",\"b\"]}", ",", "]", 20},
+    {"nested arrays",     "[", "[[[[[[[[1]]]]]]]]", ",", "]", 18},
+    {"indented",          "[", "\n    {\n        \"id\": 1,\n        \"v\": null\n    }", ",", "\n]", 10},
+};
+
+/* the items of the corpus repeated to about size bytes */
+static char *
+make_corpus(const corpus_t *c, size_t size, size_t *lenp, size_t *tokensp) {
+    size_t item = strlen(c->item), sep = strlen(c->sep), len = 0, n = 0;
+    char *buf = malloc(size + item + sep + 16);
+    if (!buf) abort();
+    len += sprintf(buf, "%s", c->open);
+    while (len < size) {
+	if (n++) {
+	    memcpy(buf + len, c->sep, sep);
+	    len += sep;
+	}
+	memcpy(buf + len, c->item, item);
+	len += item;
+    }
+    len += sprintf(buf + len, "%s", c->close);
+    *lenp = len;
+    *tokensp = n * c->tokens + 1;
+    return buf;
+}
+
+/* the best of 10 runs, in seconds */
+static double
+run(parser_t *parser, const char *buf, size_t len, int validate) {
+    double best = 1e9;
+    int r;
+    for (r = 0; r < 10; r++) {
+	const char *p = buf;
+	enum parse_error err;
+	double t;
+	parser_init(parser);
+	t = now();
+	err = validate ? parser_validate_end(parser, &p, buf + len) :
+	    parser_parse_end(parser, &p, buf + len);
+	t = now() - t;
+	if (err != ERR_SUCCESS) {
+	    fprintf(stderr, "invalid at %ld\n", (long)(p - buf));
+	    exit(1);
+	}
+	if (t < best) best = t;
+    }
+    return best;
+}
+
+int
+main(int argc, char **argv) {
+    size_t size = (argc > 1 ? atoi(argv[1]) : 16) * (size_t)1024 * 1024;
+    parser_t *parser = parser_new();
+    size_t i;
+
+    printf("%-18s %12s %10s %12s %10s\n", "", "validate", "", "parse", "");
+    printf("%-18s %12s %10s %12s %10s\n", "input", "MB/s", "ns/token", "MB/s", "ns/token");
+    for (i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+	size_t len, tokens;
+	char *buf = make_corpus(&corpora[i], size, &len, &tokens);
+	double v = run(parser, buf, len, 1), e = run(parser, buf, len, 0);
+	printf("%-18s %12.1f %10.2f %12.1f %10.2f\n", corpora[i].name,
+	       len / 1e6 / v, v * 1e9 / tokens, len / 1e6 / e, e * 1e9 / tokens);
+	free(buf);
+    }
+    parser_free(parser);
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Native parser benchmark: ns/byte and MB/s of libjsonista, validating
+ * and firing events into counters, over the files given or over
+ * generated records; with the cycles, instructions and branch misses of
+ * the best run when Linux lets us open perf events (perf_event_paranoid).
+ *
+ *   rake lib
+ *   cc -O2 -Itmp/libjsonista/include -o tmp/parse_bench bench/parse_bench.c \
+ *      tmp/libjsonista/libjsonista.a -lpthread -lm
+ *   tmp/parse_bench [-c chunk] [-r runs] [file...]
+ *
+ * Chunks are fed as windows of the file in memory, the way a reader of a
+ * socket would; newline-delimited files are parsed in multi mode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "parser.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* hardware counters; fd[0] < 0 when there are none */
+enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, NCOUNTERS };
+
+typedef struct counters_st {
+    int fd[NCOUNTERS];
+    unsigned long long value[NCOUNTERS];
+} counters_t;
+
+static void
+counters_open(counters_t *c) {
+    int i;
+#ifdef __linux__
+    static const unsigned long long config[NCOUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (i = 0; i < NCOUNTERS; i++) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config[i];
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	c->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (c->fd[i] < 0) {
+	    while (i--) close(c->fd[i]);
+	    c->fd[0] = -1;
+	    return;
+	}
+    }
+#else
+    for (i = 0; i < NCOUNTERS; i++) c->fd[i] = -1;
+#endif
+}
+
+static void
+counters_start(counters_t *c) {
+#ifdef __linux__
+    int i;
+    if (c->fd[0] < 0) return;
+    for (i = 0; i < NCOUNTERS; i++) {
+	ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+	ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void
+counters_stop(counters_t *c) {
+#ifdef __linux__
+    int i;
+    if (c->fd[0] < 0) return;
+    for (i = 0; i < NCOUNTERS; i++) {
+	ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+	if (read(c->fd[i], &c->value[i], sizeof(c->value[i])) != sizeof(c->value[i])) {
+	    c->value[i] = 0;
+	}
+    }
+#endif
+}
+
+/* events that count, so that they are not optimized away */
+static size_t events_seen;
+
+static void count0(void *data) { (void)data; events_seen++; }
+static void count_slice(void *data, const char *p, size_t len) { (void)data; (void)p; events_seen += len; }
+static void count_number(void *data, const parser_number_t *num) { (void)data; events_seen += num->mantissa & 1; }
+
+static const parser_events_t count_events = {
+    count0, count0, count0, count0,
+    count_slice, count_slice, count_number,
+    count0, count0, count0, count0, NULL,
+};
+
+/* one parse of [buf, buf+len) in chunks of `chunk` bytes, 0 for all */
+static enum parse_error
+parse(parser_t *parser, const char *buf, size_t len, size_t chunk, int validate) {
+    const char *p = buf, *e = buf + len, *we = buf;
+    enum parse_error err;
+    parser_init(parser);
+    /* the unconsumed tail of a window starts the next one */
+    while (chunk && (size_t)(e - we) > chunk) {
+	we += chunk;
+	err = validate ? parser_validate_chunk(parser, &p, we) :
+	    parser_parse_chunk(parser, &p, we);
+	/* a stream may end a window between documents */
+	if (err != ERR_NEEDMORE && err != ERR_SUCCESS) return err;
+    }
+    return validate ? parser_validate_end(parser, &p, e) :
+	parser_parse_end(parser, &p, e);
+}
+
+typedef struct result_st {
+    double seconds;
+    counters_t counters;
+} result_t;
+
+/* the best of runs parses */
+static result_t
+run(parser_t *parser, const char *buf, size_t len, size_t chunk, int validate, int runs) {
+    result_t best;
+    counters_t c;
+    int r;
+    counters_open(&c);
+    best.seconds = 1e9;
+    for (r = 0; r < runs; r++) {
+	enum parse_error err;
+	double t = now();
+	counters_start(&c);
+	err = parse(parser, buf, len, chunk, validate);
+	counters_stop(&c);
+	t = now() - t;
+	if (err != ERR_SUCCESS) {
+	    fprintf(stderr, "invalid input (error %d)\n", err);
+	    exit(1);
+	}
+	if (t < best.seconds) {
+	    best.seconds = t;
+	    best.counters = c;
+	}
+    }
+#ifdef __linux__
+    if (c.fd[0] >= 0) {
+	for (r = 0; r < NCOUNTERS; r++) close(c.fd[r]);
+    }
+#endif
+    return best;
+}
+
+static void
+report(const char *name, const char *mode, size_t len, const result_t *r) {
+    const counters_t *c = &r->counters;
+    printf("%-24s %-8s %10.1f %8.3f", name, mode, len / 1e6 / r->seconds, r->seconds * 1e9 / len);
+    if (c->fd[0] >= 0 && c->value[CYCLES]) {
+	printf(" %8.3f %6.2f %10.3f\n", (double)c->value[CYCLES] / len,
+	       (double)c->value[INSTRUCTIONS] / c->value[CYCLES],
+	       c->value[BRANCH_MISSES] * 1024.0 / len);
+    }
+    else {
+	printf(" %8s %6s %10s\n", "-", "-", "-");
+    }
+}
+
+/* an array of API-response-like records, about size bytes */
+static char *
+make_corpus(size_t size, size_t *lenp) {
+    char *buf = malloc(size + 256);
+    size_t len = 0;
+    unsigned int i = 0;
+    if (!buf) abort();
+    buf[len++] = '[';
+    while (len < size) {
+	len += sprintf(buf + len,
+	    "%s{\"id\":%u,\"name\":\"user %u\",\"score\":%u.%02u,\"active\":%s,"
+	    "\"tags\":[\"a\",\"b\"],\"note\":null}",
+	    i ? "," : "", i, i * 7919u % 10007u, i % 100, i % 97,
+	    i % 3 ? "true" : "false");
+	i++;
+    }
+    buf[len++] = ']';
+    *lenp = len;
+    return buf;
+}
+
+static char *
+read_file(const char *path, size_t *lenp) {
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long len;
+    if (!f || fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0) {
+	perror(path);
+	exit(1);
+    }
+    rewind(f);
+    buf = malloc(len ? len : 1);
+    if (!buf) abort();
+    if (fread(buf, 1, len, f) != (size_t)len) {
+	perror(path);
+	exit(1);
+    }
+    fclose(f);
+    *lenp = len;
+    return buf;
+}
+
+static void
+bench(parser_t *parser, const char *name, const char *buf, size_t len, size_t chunk, int runs) {
+    result_t v, e;
+    const char *p = buf;
+    /* several documents: a stream */
+    parser_init(parser);
+    parser->multi = 0;
+    if (parser_validate_end(parser, &p, buf + len) == ERR_EXTRABYTE) parser->multi = 1;
+    v = run(parser, buf, len, chunk, 1, runs);
+    e = run(parser, buf, len, chunk, 0, runs);
+    report(name, "validate", len, &v);
+    report(name, "parse", len, &e);
+}
+
+int
+main(int argc, char **argv) {
+    size_t chunk = 0;
+    int runs = 10, opt;
+    parser_t *parser;
+
+    while ((opt = getopt(argc, argv, "c:r:")) != -1) {
+	switch (opt) {
+	  case 'c':
+	    chunk = strtoul(optarg, NULL, 10);
+	    break;
+	  case 'r':
+	    runs = atoi(optarg);
+	    break;
+	  default:
+	    fprintf(stderr, "usage: %s [-c chunk] [-r runs] [file...]\n", argv[0]);
+	    return 2;
+	}
+    }
+    parser = parser_new();
+    parser->events = &count_events;
+    parser->max_nesting = 0;
+
+    printf("%-24s %-8s %10s %8s %8s %6s %10s\n",
+	   "input", "mode", "MB/s", "ns/byte", "cyc/byte", "IPC", "bmiss/KB");
+    if (optind == argc) {
+	size_t len;
+	char *buf = make_corpus(16 * 1024 * 1024, &len);
+	bench(parser, "records (16MB)", buf, len, chunk, runs);
+	free(buf);
+    }
+    for (; optind < argc; optind++) {
+	size_t len;
+	const char *name = strrchr(argv[optind], '/');
+	char *buf = read_file(argv[optind], &len);
+	bench(parser, name ? name + 1 : argv[optind], buf, len, chunk, runs);
+	free(buf);
+    }
+    parser_free(parser);
+    return 0;
+}
@@ -0,0 +1,66 @@
+# Multi-Ractor benchmark: MB/s of 1, 2, 4 and 8 Ractors each parsing the
+# same generated records, and the speedup over one.
+#
+#   rake bench:ractor             # SIZE=MB parsed by each Ractor (32)
+#   ruby -Ilib bench/ractor.rb [MB]
+#
+# The corpus is made shareable once and every Ractor parses all of it with
+# a parser and a Cache.global of its own, in 1MB documents, with freeze so
+# that the results could be sent back without a copy.
+require "jsonista"
+require "etc"
+
+Warning[:experimental] = false
+
+module RactorBench
+  DOC_SIZE = 1024 * 1024
+  RUNS = 3
+
+  module_function
+
+  # documents of API-response-like records, about size bytes in all
+  def corpus(size)
+    docs = []
+    i = 0
+    while docs.sum(&:bytesize) < size
+      records = []
+      bytes = 0
+      while bytes < DOC_SIZE
+        r = %Q({"id":#{i},"name":"user #{i * 7919 % 10007}","score":#{i % 100}.#{i % 97},) +
+            %Q("active":#{i % 3 == 0},"tags":["a","b"],"note":null})
+        records << r
+        bytes += r.bytesize + 1
+        i += 1
+      end
+      docs << "[#{records.join(",")}]"
+    end
+    Ractor.make_shareable(docs)
+  end
+
+  # seconds for n Ractors to parse docs each, the best of RUNS
+  def run(docs, n)
+    RUNS.times.map do
+      t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      n.times.map do
+        Ractor.new(docs) do |ds|
+          parser = Jsonista::Parser.new(cache: Jsonista::Cache.global, freeze: true)
+          ds.each { |d| parser.reset; parser.parse_chunk(d) }
+          ds.size
+        end
+      end.each(&:take)
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+    end.min
+  end
+end
+
+size = (ARGV[0] || 32).to_f * 1024 * 1024
+docs = RactorBench.corpus(size)
+bytes = docs.sum(&:bytesize)
+puts format("%d documents, %.1f MB per Ractor, %d CPUs", docs.size, bytes / 1e6, Etc.nprocessors)
+puts format("%-8s %10s %8s", "ractors", "MB/s", "speedup")
+base = nil
+[1, 2, 4, 8].each do |n|
+  mbs = bytes * n / 1e6 / RactorBench.run(docs, n)
+  base ||= mbs
+  puts format("%-8d %10.1f %8.2f", n, mbs, mbs / base)
+end
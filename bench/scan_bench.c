@@ -0,0 +1,143 @@
+/*
+ * Scanner microbenchmark: bytes/cycle of each whitespace kernel over
+ * pretty-printed JSON, and of each string kernel over CJK/emoji text.
+ *
+ *   cc -O2 -Iext/jsonista -o tmp/scan_bench bench/scan_bench.c ext/jsonista/scan.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+#ifdef SCAN_X86
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#include <time.h>
+static unsigned long long
+cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* objects nested `depth` levels deep, indented by two spaces per level */
+static char *
+make_corpus(size_t size, size_t *lenp) {
+    char *buf = malloc(size + 64);
+    size_t len = 0;
+    int depth = 0;
+    while (len < size) {
+	int i, indent = 2 * (1 + depth % 12);
+	buf[len++] = '\n';
+	for (i = 0; i < indent; i++) buf[len++] = ' ';
+	len += sprintf(buf + len, "\"key%d\": %d,", depth, depth * 7);
+	depth++;
+    }
+    *lenp = len;
+    return buf;
+}
+
+/* string contents mixing ASCII, CJK and emoji */
+static char *
+make_text(size_t size, size_t *lenp) {
+    static const char *const words[] = {
+	"status ", "\xE3\x81\x82\xE3\x81\x84\xE3\x81\x86", "\xE6\x97\xA5\xE6\x9C\xAC ",
+	"\xF0\x9F\x98\x80", "caf\xC3\xA9 ", "\xED\x9F\xBF",
+    };
+    char *buf = malloc(size + 64);
+    size_t len = 0;
+    unsigned int i = 0;
+    while (len < size) {
+	const char *w = words[(i++ * 7) % 6];
+	memcpy(buf + len, w, strlen(w));
+	len += strlen(w);
+    }
+    *lenp = len;
+    return buf;
+}
+
+/* per-byte lead/trail checks, as the scalar string path does them */
+static const char *
+ladder(const char *s, const char *e) {
+    const unsigned char *p = (const unsigned char *)s;
+    while (p < (const unsigned char *)e) {
+	unsigned char c = *p;
+	int n, i;
+	if (c == '"' || c == '\\' || c < 0x20) break;
+	if (c < 0x80) { p++; continue; }
+	if (c < 0xC2) break;
+	n = c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+	if (!n || (const char *)p + n > e) break;
+	if (c == 0xE0 && p[1] < 0xA0) break;
+	if (c == 0xED && p[1] > 0x9F) break;
+	if (c == 0xF0 && p[1] < 0x90) break;
+	if (c == 0xF4 && p[1] > 0x8F) break;
+	for (i = 1; i < n; i++) if ((p[i] & 0xC0) != 0x80) break;
+	if (i < n) break;
+	p += n;
+    }
+    return (const char *)p;
+}
+
+static void
+run_string(const char *name, scan_func_t scan, const char *buf, size_t len, int iter) {
+    unsigned long long best = ~0ULL;
+    int i;
+    for (i = 0; i < iter; i++) {
+	unsigned long long t0 = cycles(), t;
+	const char *p = scan(buf, buf + len);
+	t = cycles() - t0;
+	if (p < buf + len - 32) printf("%s: stopped at %zd\n", name, p - buf);
+	if (t < best) best = t;
+    }
+    printf("%-8s %8.3f bytes/cycle\n", name, (double)len / best);
+}
+
+static void
+run(const char *name, scan_func_t skip_ws, const char *buf, size_t len, int iter) {
+    unsigned long long best = ~0ULL;
+    size_t sink = 0;
+    int i;
+    for (i = 0; i < iter; i++) {
+	const char *p = buf, *e = buf + len;
+	unsigned long long t0 = cycles(), t;
+	while (p < e) {
+	    p = skip_ws(p, e);
+	    /* skip the token up to the next whitespace */
+	    while (p < e && (unsigned char)*p > ' ') p++;
+	}
+	t = cycles() - t0;
+	sink += p - buf;
+	if (t < best) best = t;
+    }
+    printf("%-8s %8.3f bytes/cycle (%zu)\n", name, (double)len / best, sink / iter);
+}
+
+int
+main(int argc, char **argv) {
+    size_t len;
+    size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : 16 << 20;
+    char *buf = make_corpus(size, &len);
+    scan_init();
+    printf("corpus: %zu bytes, dispatched kernel: %s\n", len, scan_impl_name());
+    run("scalar", scan_skip_ws_scalar, buf, len, 10);
+#ifdef SCAN_X86
+    run("sse2", scan_skip_ws_sse2, buf, len, 10);
+    if (__builtin_cpu_supports("avx2")) {
+	run("avx2", scan_skip_ws_avx2, buf, len, 10);
+    }
+#endif
+    free(buf);
+
+    buf = make_text(size, &len);
+    printf("string: %zu bytes\n", len);
+    run_string("scalar", ladder, buf, len, 10);
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+	run_string("avx2", scan_string_avx2, buf, len, 10);
+    }
+#endif
+    free(buf);
+    return 0;
+}
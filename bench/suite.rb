@@ -0,0 +1,226 @@
+# Benchmark suite: MB/s, objects allocated per document and peak RSS of
+# Jsonista and of the json gem on generated corpora, written as JSON.
+#
+#   rake bench                    # SIZE=MB of each corpus (8), OUT=file
+#   ruby -Ilib bench/suite.rb [MB]
+#
+# The corpora are generated from a fixed seed into tmp/bench once per size.
+# Each case runs in a process of its own, so its peak RSS is its own; the
+# corpus read into it is part of that.  A summary goes to stderr.
+require "json"
+require "jsonista"
+require "fileutils"
+
+module Bench
+  RUNS = 3
+  CHUNKS = [1, 16, 256, 4096, 65536, nil] # nil: the whole document
+  SWEEP_SIZE = 256 * 1024
+
+  # a parse handler that takes no events
+  class NullHandler
+  end
+
+  module Corpus
+    WORDS = %w[alpha beta gamma delta epsilon zeta eta theta iota kappa]
+    CJK = %w[東京 大阪 日本語 文字列 構文解析 高速 データ 検索 서울 한국어 北京 中文]
+
+    module_function
+
+    # [name, text, documents]
+    def all(size)
+      [
+        ["numbers", array(size) { |r| "[#{r.rand(1 << 40)},#{r.rand.round(6)},-#{r.rand(1000)}.5e#{r.rand(20)}]" }, 1],
+        ["strings", array(size) { |r| JSON.generate("text" => sentence(r), "note" => "tab\there \"quoted\"") }, 1],
+        ["cjk", array(size) { |r| JSON.generate("name" => CJK.sample(4, random: r).join, "city" => CJK.sample(random: r)) }, 1],
+        ["nested", array(size) { |r| nested(r, 1000) }, 1],
+        ndjson(size),
+        ["huge", array(size * 4) { |r| record(r) }, 1],
+      ]
+    end
+
+    def sentence(r)
+      Array.new(8) { WORDS.sample(random: r) }.join(" ")
+    end
+
+    def record(r)
+      JSON.generate("id" => r.rand(1 << 31), "name" => sentence(r)[0, 20], "score" => r.rand.round(4),
+                    "active" => r.rand < 0.5, "tags" => WORDS.sample(3, random: r),
+                    "geo" => {"lat" => r.rand(-90.0..90.0).round(5), "lng" => r.rand(-180.0..180.0).round(5)})
+    end
+
+    def nested(r, depth)
+      open, close = +"", +""
+      depth.times do
+        if r.rand < 0.5
+          open << "["
+          close.prepend("]")
+        else
+          open << "{\"k\":"
+          close.prepend("}")
+        end
+      end
+      "#{open}#{r.rand(100)}#{close}"
+    end
+
+    # an array of the items made by the block, about size bytes long
+    def array(size)
+      r = Random.new(42)
+      out = +"["
+      until out.bytesize >= size
+        out << "," if out.bytesize > 1
+        out << yield(r)
+      end
+      out << "]"
+    end
+
+    def ndjson(size)
+      r = Random.new(42)
+      out = +""
+      docs = 0
+      until out.bytesize >= size
+        out << record(r) << "\n"
+        docs += 1
+      end
+      ["ndjson", out, docs]
+    end
+
+    # the corpora of size bytes, generated into dir unless they are there
+    def load(dir, size)
+      FileUtils.mkdir_p(dir)
+      index = File.join(dir, "index.json")
+      unless File.exist?(index)
+        list = all(size).map do |name, text, docs|
+          File.binwrite(File.join(dir, "#{name}.json"), text)
+          {"name" => name, "documents" => docs}
+        end
+        File.write(index, JSON.generate(list))
+      end
+      JSON.parse(File.read(index)).map do |c|
+        [c["name"], File.join(dir, "#{c["name"]}.json"), c["documents"]]
+      end
+    end
+  end
+
+  module_function
+
+  def peak_rss_kb
+    File.read("/proc/self/status")[/^VmHWM:\s*(\d+)/, 1]&.to_i
+  rescue SystemCallError
+    nil
+  end
+
+  # the best of RUNS calls of the block, in a process of its own
+  def measure(path, documents)
+    isolated do
+      src = File.binread(path)
+      src = yield(:prepare, src) || src
+      GC.start
+      allocated = nil
+      best = Float::INFINITY
+      RUNS.times do
+        before = GC.stat(:total_allocated_objects)
+        t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        yield(:run, src)
+        t = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+        allocated ||= GC.stat(:total_allocated_objects) - before
+        best = t if t < best
+      end
+      {
+        "bytes" => src.bytesize,
+        "documents" => documents,
+        "mb_per_s" => (src.bytesize / best / 1e6).round(2),
+        "allocations_per_document" => (allocated.fdiv(documents)).round(2),
+        "peak_rss_kb" => peak_rss_kb,
+      }
+    end
+  end
+
+  def isolated(&block)
+    return block.call unless Process.respond_to?(:fork)
+    r, w = IO.pipe
+    pid = fork do
+      r.close
+      w.write(Marshal.dump(block.call))
+      exit!(0)
+    end
+    w.close
+    result = Marshal.load(r.read)
+    Process.wait(pid)
+    result
+  ensure
+    r&.close
+  end
+
+  # the cases of a corpus: [library, mode, block]
+  def cases(multi)
+    opts = multi ? {multi_document: true} : {}
+    [
+      ["jsonista", "validate", multi ?
+        ->(s) { Jsonista::Parser.new(**opts).validate_finish(s) } :
+        ->(s) { Jsonista.valid?(s, max_nesting: false) }],
+      ["jsonista", "parse", ->(s) { Jsonista::Parser.new(NullHandler.new, max_nesting: false, **opts).finish(s) }],
+      ["jsonista", "build", multi ?
+        ->(s) { Jsonista::Parser.new(**opts).finish(s) } :
+        ->(s) { Jsonista.parse(s, max_nesting: false) }],
+      ["json", "build", multi ?
+        ->(s) { s.each_line.map { |l| JSON.parse(l) } } :
+        ->(s) { JSON.parse(s, max_nesting: false) }],
+    ]
+  end
+
+  def chunked(s, size)
+    parser = Jsonista::Parser.new
+    return parser.finish(s) unless size
+    pos = 0
+    while pos < s.bytesize
+      parser.parse_chunk(s.byteslice(pos, size))
+      pos += size
+    end
+    parser.finish
+  end
+
+  def run(size, out)
+    corpora = Corpus.load(File.join("tmp", "bench", size.to_s), size)
+    results = []
+    report = lambda do |entry|
+      results << entry
+      chunk = entry.key?("chunk") ? " chunk=#{entry["chunk"]}" : ""
+      $stderr.printf("%-8s %-9s %-9s%-13s %9.1f MB/s %10.2f allocs/doc %8s KB\n",
+                     entry["corpus"], entry["library"], entry["mode"], chunk,
+                     entry["mb_per_s"], entry["allocations_per_document"], entry["peak_rss_kb"])
+    end
+
+    corpora.each do |name, path, docs|
+      cases(name == "ndjson").each do |library, mode, fn|
+        m = measure(path, docs) { |phase, s| fn.call(s) if phase == :run }
+        report.call({"corpus" => name, "library" => library, "mode" => mode}.merge(m))
+      end
+    end
+
+    # the streaming parser over the strings corpus cut to SWEEP_SIZE
+    _, path, = corpora.assoc("strings")
+    CHUNKS.each do |chunk|
+      m = measure(path, 1) do |phase, s|
+        next %([#{s.byteslice(1, SWEEP_SIZE)[/\A.*\}/m]}]) if phase == :prepare
+        chunked(s, chunk)
+      end
+      report.call({"corpus" => "strings", "library" => "jsonista", "mode" => "build",
+                   "chunk" => chunk || "all"}.merge(m))
+    end
+
+    doc = {
+      "ruby" => RUBY_DESCRIPTION,
+      "jsonista" => Jsonista::VERSION,
+      "json" => JSON::VERSION,
+      "corpus_size" => size,
+      "runs" => RUNS,
+      "results" => results,
+    }
+    out ? File.write(out, JSON.pretty_generate(doc)) : puts(JSON.pretty_generate(doc))
+  end
+end
+
+if $0 == __FILE__
+  mb = (ARGV[0] || ENV["SIZE"] || 8).to_f
+  Bench.run((mb * 1024 * 1024).to_i, ENV["OUT"])
+end
@@ -0,0 +1,276 @@
+#include "aggregate.h"
+#include "cache.h"
+
+aggregates_t *
+aggregates_new(void) {
+    return ZALLOC(aggregates_t);
+}
+
+static void
+set_clear(aggregate_t *agg) {
+    size_t i;
+    if (!agg->set) return;
+    for (i = 0; i <= agg->set_mask; i++) xfree(agg->set[i].p);
+    xfree(agg->set);
+    agg->set = NULL;
+    agg->set_mask = 0;
+}
+
+void
+aggregates_free(aggregates_t *a) {
+    size_t i;
+    if (!a) return;
+    for (i = 0; i < a->n; i++) set_clear(&a->aggs[i]);
+    xfree(a->aggs);
+    xfree(a);
+}
+
+size_t
+aggregates_memsize(const aggregates_t *a) {
+    size_t i, size = sizeof(*a) + a->capa * sizeof(aggregate_t);
+    for (i = 0; i < a->n; i++) {
+	const aggregate_t *agg = &a->aggs[i];
+	if (agg->set) {
+	    size += (agg->set_mask + 1) * sizeof(aggregate_entry_t);
+	    size += agg->count * 16; /* the copies, roughly */
+	}
+    }
+    return size;
+}
+
+void
+aggregates_add(aggregates_t *a, enum aggregate_op op, int path) {
+    aggregate_t *agg;
+    if (a->n == a->capa) {
+	a->capa = a->capa ? a->capa * 2 : 4;
+	REALLOC_N(a->aggs, aggregate_t, a->capa);
+    }
+    agg = &a->aggs[a->n++];
+    MEMZERO(agg, aggregate_t, 1);
+    agg->op = op;
+    agg->path = path;
+}
+
+void
+aggregates_reset(aggregates_t *a) {
+    size_t i;
+    for (i = 0; i < a->n; i++) {
+	aggregate_t *agg = &a->aggs[i];
+	set_clear(agg);
+	agg->count = 0;
+	MEMZERO(&agg->value, aggregate_number_t, 1);
+    }
+    a->tag = 0;
+}
+
+static double
+number_double(const aggregate_number_t *n) {
+    return n->is_float ? n->d : (double)n->i;
+}
+
+static int
+number_cmp(const aggregate_number_t *x, const aggregate_number_t *y) {
+    double dx, dy;
+    if (!x->is_float && !y->is_float) return (x->i > y->i) - (x->i < y->i);
+    dx = number_double(x);
+    dy = number_double(y);
+    return (dx > dy) - (dx < dy);
+}
+
+/* x + y into *r, or 1 if it overflows */
+static inline int
+add_overflow(int64_t x, int64_t y, int64_t *r) {
+#if defined(__GNUC__) && __GNUC__ >= 5
+    return __builtin_add_overflow(x, y, r);
+#else
+    if (y > 0 ? x > INT64_MAX - y : x < INT64_MIN - y) return 1;
+    *r = x + y;
+    return 0;
+#endif
+}
+
+static void
+number_add(aggregate_number_t *sum, const aggregate_number_t *n) {
+    int64_t i;
+    if (!sum->is_float && !n->is_float && !add_overflow(sum->i, n->i, &i)) {
+	sum->i = i;
+	return;
+    }
+    /* floats, or integers out of int64_t range from now on */
+    sum->d = number_double(sum) + number_double(n);
+    sum->is_float = 1;
+}
+
+/* integers, other floats and integers beyond int64_t */
+static inline int
+number_tag(char tag) {
+    return tag == 'i' || tag == 'd' || tag == 'n';
+}
+
+/* inserts [p, p+len) tagged with tag into the set unless it is there */
+static void
+set_add(aggregate_t *agg, char tag, const char *p, size_t len) {
+    uint64_t h = cache_hash(p, len) ^ (unsigned char)tag;
+    aggregate_entry_t *ent;
+    size_t i;
+
+    if (!agg->set || agg->count * 4 >= (agg->set_mask + 1) * 3) {
+	/* grow at 3/4 full */
+	aggregate_entry_t *old = agg->set;
+	size_t old_size = old ? agg->set_mask + 1 : 0;
+	agg->set_mask = old ? agg->set_mask * 2 + 1 : 15;
+	agg->set = ZALLOC_N(aggregate_entry_t, agg->set_mask + 1);
+	for (i = 0; i < old_size; i++) {
+	    size_t j;
+	    if (!old[i].p) continue;
+	    for (j = old[i].hash & agg->set_mask; agg->set[j].p; j = (j + 1) & agg->set_mask);
+	    agg->set[j] = old[i];
+	}
+	xfree(old);
+    }
+    for (i = h & agg->set_mask; (ent = &agg->set[i])->p; i = (i + 1) & agg->set_mask) {
+	if (ent->hash == h && ent->len == len + 1 && ent->p[0] == tag &&
+	    memcmp(ent->p + 1, p, len) == 0) {
+	    return;
+	}
+    }
+    ent->p = ALLOC_N(char, len + 1);
+    ent->p[0] = tag;
+    memcpy(ent->p + 1, p, len);
+    ent->len = len + 1;
+    ent->hash = h;
+    agg->count++;
+}
+
+static void
+aggregate_value(aggregate_t *agg, const aggregates_t *a) {
+    switch (agg->op) {
+      case AGGREGATE_COUNT:
+	agg->count++;
+	break;
+      case AGGREGATE_SUM:
+	if (!number_tag(a->tag)) break;
+	number_add(&agg->value, &a->number);
+	agg->count++;
+	break;
+      case AGGREGATE_MIN:
+      case AGGREGATE_MAX:
+	if (!number_tag(a->tag)) break;
+	if (agg->count++ == 0 ||
+	    number_cmp(&a->number, &agg->value) == (agg->op == AGGREGATE_MIN ? -1 : 1)) {
+	    agg->value = a->number;
+	}
+	break;
+      case AGGREGATE_DISTINCT:
+	if (!a->tag) break;
+	set_add(agg, a->tag, a->p, a->len);
+	break;
+    }
+}
+
+VALUE
+aggregates_value(const aggregates_t *a, size_t i) {
+    const aggregate_t *agg = &a->aggs[i];
+    switch (agg->op) {
+      case AGGREGATE_MIN:
+      case AGGREGATE_MAX:
+	if (!agg->count) return Qnil;
+	/* fall through */
+      case AGGREGATE_SUM:
+	if (agg->value.is_float) return DBL2NUM(agg->value.d);
+	return LL2NUM(agg->value.i);
+      default:
+	return SIZET2NUM(agg->count);
+    }
+}
+
+/* events: note the scalar, then aggregate it on match */
+
+static void
+aggregate_scalar(void *data, char tag, const char *p, size_t len) {
+    aggregates_t *a = data;
+    a->tag = tag;
+    a->p = p;
+    a->len = len;
+}
+
+static void
+aggregate_string(void *data, const char *p, size_t len) {
+    aggregate_scalar(data, 's', p, len);
+}
+
+/*
+ * distinct numbers are compared by value: integral ones as int64_t, so
+ * that 1, 1.0 and 1e0 are one, and the other floats by their bits;
+ * integers beyond int64_t by their text
+ */
+static void
+aggregate_number(void *data, const parser_number_t *num) {
+    aggregates_t *a = data;
+    double d;
+    int64_t i;
+    if (!num->is_float && parser_number_int64(num, &a->number.i)) {
+	a->number.is_float = 0;
+	memcpy(a->number_key, &a->number.i, sizeof(a->number_key));
+	aggregate_scalar(data, 'i', a->number_key, sizeof(a->number_key));
+	return;
+    }
+    a->number.d = d = parser_number_double(num);
+    a->number.is_float = 1;
+    if (!num->is_float) {
+	aggregate_scalar(data, 'n', num->p, num->len);
+    }
+    else if (d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == (double)(i = (int64_t)d)) {
+	memcpy(a->number_key, &i, sizeof(a->number_key));
+	aggregate_scalar(data, 'i', a->number_key, sizeof(a->number_key));
+    }
+    else {
+	memcpy(a->number_key, &d, sizeof(a->number_key));
+	aggregate_scalar(data, 'd', a->number_key, sizeof(a->number_key));
+    }
+}
+
+static void
+aggregate_true(void *data) {
+    aggregate_scalar(data, 't', "", 0);
+}
+
+static void
+aggregate_false(void *data) {
+    aggregate_scalar(data, 'f', "", 0);
+}
+
+static void
+aggregate_null(void *data) {
+    aggregate_scalar(data, 'z', "", 0);
+}
+
+static void
+aggregate_match(void *data, int path) {
+    aggregates_t *a = data;
+    size_t i;
+    for (i = 0; i < a->n; i++) {
+	if (a->aggs[i].path == path) aggregate_value(&a->aggs[i], a);
+    }
+}
+
+static void
+aggregate_container(void *data) {
+    aggregates_t *a = data;
+    a->tag = 0;
+}
+
+const parser_events_t aggregate_events = {
+    aggregate_container, /* start_object */
+    NULL, /* end_object */
+    aggregate_container, /* start_array */
+    NULL, /* end_array */
+    NULL, /* key */
+    aggregate_string,
+    aggregate_number,
+    aggregate_true,
+    aggregate_false,
+    aggregate_null,
+    NULL, /* end_document */
+    aggregate_match,
+};
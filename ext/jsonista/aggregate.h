@@ -0,0 +1,68 @@
+#ifndef JSONISTA_AGGREGATE_H
+#define JSONISTA_AGGREGATE_H 1
+
+#include "jsonista.h"
+#include "parser.h"
+
+enum aggregate_op {
+    AGGREGATE_COUNT,    /* values at the path */
+    AGGREGATE_SUM,      /* numbers at the path; the others are ignored */
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_DISTINCT, /* distinct scalars at the path */
+};
+
+typedef struct aggregate_number_st {
+    int is_float;
+    int64_t i;
+    double d;
+} aggregate_number_t;
+
+/* a distinct value: a type tag, then the string text or number key */
+typedef struct aggregate_entry_st {
+    uint64_t hash;
+    char *p; /* NULL if the slot is empty */
+    size_t len;
+} aggregate_entry_t;
+
+typedef struct aggregate_st {
+    enum aggregate_op op;
+    int path;
+    size_t count;  /* values, numbers for sum, min and max, or set entries */
+    aggregate_number_t value;
+    aggregate_entry_t *set; /* open addressing, for distinct */
+    size_t set_mask;
+} aggregate_t;
+
+/*
+ * Accumulators fed by a parser with a nested filter: aggregate_events,
+ * with the aggregates_t as data, note each scalar matched and add it to
+ * the aggregates of its paths on match.  Nothing is allocated per value
+ * but the copies of new distinct values.
+ */
+typedef struct aggregates_st {
+    aggregate_t *aggs;
+    size_t n, capa;
+    /* the scalar before match: its tag, or 0 for a container, and its
+     * text, which is only valid until then */
+    char tag;
+    const char *p;
+    size_t len;
+    aggregate_number_t number;
+    char number_key[sizeof(int64_t)]; /* the bytes of a number for distinct */
+} aggregates_t;
+
+extern const parser_events_t aggregate_events;
+
+aggregates_t *aggregates_new(void);
+void aggregates_free(aggregates_t *a);
+size_t aggregates_memsize(const aggregates_t *a);
+/* adds an aggregate of the values at the path numbered path */
+void aggregates_add(aggregates_t *a, enum aggregate_op op, int path);
+/* back to no values */
+void aggregates_reset(aggregates_t *a);
+/* the value of aggregate i: an Integer, a Float, or nil for the min or
+ * max of no numbers */
+VALUE aggregates_value(const aggregates_t *a, size_t i);
+
+#endif /* JSONISTA_AGGREGATE_H */
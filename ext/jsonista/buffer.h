@@ -0,0 +1,127 @@
+#ifndef JSONISTA_BUFFER_H
+#define JSONISTA_BUFFER_H
+#include <stdlib.h>
+#include <string.h>
+
+/* growable byte buffer: decoded strings of the parser, output of the
+ * generator */
+typedef struct parser_buffer_st {
+    char *buf;
+    char *p;
+    char *e;
+    /* storage the buffer started in, owned by someone else (the parser
+     * arena), or NULL; it is copied out of, never realloc()ed */
+    char *init, *init_end;
+    size_t grows; /* times the storage was allocated */
+} buffer_t;
+
+#define BUFFER_INITIAL_SIZE 4096
+
+/* starts buf in [storage, storage+size), which may be empty */
+static inline void
+buffer_init(buffer_t *buf, char *storage, size_t size) {
+    buf->buf = buf->p = buf->init = storage;
+    buf->e = buf->init_end = storage ? storage + size : NULL;
+    buf->grows = 0;
+}
+
+/* the storage is allocated on the first write */
+static inline buffer_t *
+buffer_new(void) {
+    buffer_t *buf = malloc(sizeof(buffer_t));
+    if (!buf) abort();
+    buffer_init(buf, NULL, 0);
+    return buf;
+}
+
+/* frees the storage allocated by the buffer */
+static inline void
+buffer_release(buffer_t *buf) {
+    if (buf->buf != buf->init) free(buf->buf);
+}
+
+static inline void
+buffer_free(buffer_t *buf) {
+    buffer_release(buf);
+    free(buf);
+}
+
+static inline void
+buffer_clear(buffer_t *buf) {
+    buf->p = buf->buf;
+}
+
+/* empties buf and goes back to its initial storage */
+static inline void
+buffer_trim(buffer_t *buf) {
+    size_t grows = buf->grows;
+    buffer_release(buf);
+    buffer_init(buf, buf->init, buf->init_end - buf->init);
+    buf->grows = grows;
+}
+
+/* the storage allocated by the buffer */
+static inline size_t
+buffer_memsize(buffer_t *buf) {
+    return buf->buf != buf->init ? (size_t)(buf->e - buf->buf) : 0;
+}
+
+static inline void
+buffer_ensure_writable(buffer_t *buf, size_t len) {
+    if (buf->p + len > buf->e) {
+	size_t used = buf->p - buf->buf;
+	size_t capa = buf->e - buf->buf;
+	char *r;
+	if (!capa) capa = BUFFER_INITIAL_SIZE;
+	while (capa < used + len) capa *= 2;
+	if (buf->buf == buf->init) {
+	    r = malloc(capa);
+	    if (r && used) memcpy(r, buf->buf, used);
+	}
+	else {
+	    r = realloc(buf->buf, capa);
+	}
+	if (!r) abort();
+	buf->buf = r;
+	buf->p = r + used;
+	buf->e = r + capa;
+	buf->grows++;
+    }
+}
+
+static inline void
+buffer_write(buffer_t *buf, const char *p, size_t len) {
+    if (!len) return;
+    buffer_ensure_writable(buf, len);
+    memcpy(buf->p, p, len);
+    buf->p += len;
+}
+
+static inline void
+buffer_write_char(buffer_t *buf, int c) {
+    if (c <= 0x7F) {
+	buffer_ensure_writable(buf, 1);
+	buf->p[0] = c;
+	buf->p++;
+    } else if (c <= 0x7FF) {
+	buffer_ensure_writable(buf, 2);
+	buf->p[0] = 0xC0 | ((c >>  6) & 0x1F);
+	buf->p[1] = 0x80 | ((c      ) & 0x3F);
+	buf->p += 2;
+    } else if (c <= 0xFFFF) {
+	buffer_ensure_writable(buf, 3);
+	buf->p[0] = 0xE0 | ((c >> 12) & 0x0F);
+	buf->p[1] = 0x80 | ((c >>  6) & 0x3F);
+	buf->p[2] = 0x80 | ( c        & 0x3F);
+	buf->p += 3;
+    } else if (c <= 0x10FFFF) {
+	buffer_ensure_writable(buf, 4);
+	buf->p[0] = 0xF0 | ((c >> 18) & 0x0F);
+	buf->p[1] = 0x80 | ((c >> 12) & 0x3F);
+	buf->p[2] = 0x80 | ((c >>  6) & 0x3F);
+	buf->p[3] = 0x80 | ( c        & 0x3F);
+	buf->p += 4;
+    }
+}
+
+#endif
@@ -0,0 +1,234 @@
+#include "cache.h"
+#include <string.h>
+#ifdef HAVE_RUBY_RACTOR_H
+# include "ruby/ractor.h"
+#endif
+
+VALUE cCache;
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+static rb_ractor_local_key_t global_cache_key; /* Cache.global of each Ractor */
+#else
+static VALUE global_cache;
+#endif
+static ID id_hits, id_misses, id_size, id_uminus;
+
+static void
+cache_mark(void *ptr) {
+    cache_t *cache = ptr;
+    size_t i;
+    /* the allocation of the first entries may run the GC */
+    if (!cache->entries) return;
+    for (i = 0; i <= cache->mask; i++) {
+	cache_entry_t *ent = &cache->entries[i];
+	if (ent->str) rb_gc_mark(ent->str);
+	if (ent->sym) rb_gc_mark(ent->sym);
+    }
+}
+
+static void
+cache_free(void *ptr) {
+    cache_t *cache = ptr;
+    xfree(cache->entries);
+    xfree(cache);
+}
+
+static size_t
+cache_memsize(const void *ptr) {
+    const cache_t *cache = ptr;
+    return sizeof(*cache) + (cache->mask + 1) * sizeof(cache_entry_t);
+}
+
+static const rb_data_type_t cache_data_type = {
+    "jsonista_cache",
+    {
+	cache_mark, cache_free, cache_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+uint64_t
+cache_hash(const char *p, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+    for (; len >= 8; p += 8, len -= 8) {
+	memcpy(&w, p, 8);
+	h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 31;
+    }
+    if (len) {
+	w = 0;
+	memcpy(&w, p, len);
+	h = (h ^ w) * 0x94d049bb133111ebULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static VALUE
+interned_str(const char *p, size_t len) {
+#ifdef HAVE_RB_ENC_INTERNED_STR
+    return rb_enc_interned_str(p, len, rb_utf8_encoding());
+#else
+    return rb_funcall(rb_utf8_str_new(p, len), id_uminus, 0);
+#endif
+}
+
+VALUE
+cache_fetch(cache_t *cache, const char *p, size_t len, int sym) {
+    uint64_t h = cache_hash(p, len);
+    cache_entry_t *ent = &cache->entries[h & cache->mask];
+
+    if (ent->str && ent->hash == h && (size_t)RSTRING_LEN(ent->str) == len &&
+	memcmp(RSTRING_PTR(ent->str), p, len) == 0) {
+	cache->hits++;
+    }
+    else {
+	cache->misses++;
+	ent->hash = h;
+	RB_OBJ_WRITE(cache->self, &ent->str, interned_str(p, len));
+	ent->sym = 0;
+    }
+    if (!sym) return ent->str;
+    if (!ent->sym) {
+	RB_OBJ_WRITE(cache->self, &ent->sym, rb_str_intern(ent->str));
+    }
+    return ent->sym;
+}
+
+cache_t *
+cache_get(VALUE obj) {
+    return rb_check_typeddata(obj, &cache_data_type);
+}
+
+static VALUE
+cache_s_alloc(VALUE klass) {
+    cache_t *cache;
+    VALUE obj = TypedData_Make_Struct(klass, cache_t, &cache_data_type, cache);
+    cache->self = obj;
+    cache->entries = ZALLOC(cache_entry_t);
+    return obj;
+}
+
+static void
+cache_resize(cache_t *cache, size_t size) {
+    size_t n = 1;
+    cache_entry_t *old = cache->entries;
+    while (n < size) n <<= 1;
+    /* the allocation may run the GC, which marks the old entries */
+    cache->entries = ZALLOC_N(cache_entry_t, n);
+    cache->mask = n - 1;
+    xfree(old);
+}
+
+VALUE
+cache_new(size_t size) {
+    VALUE obj = cache_s_alloc(cCache);
+    cache_resize(cache_get(obj), size);
+    return obj;
+}
+
+/*
+ * @overload new(size = 1024)
+ *   @param size [Integer] number of slots, rounded up to a power of two
+ *
+ * returns a cache of frozen key strings, to be shared between parsers
+ * with Parser.new(cache: cache)
+ */
+static VALUE
+cache_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE vsize;
+    long size = CACHE_DEFAULT_SIZE;
+    if (rb_scan_args(argc, argv, "01", &vsize) && !NIL_P(vsize)) {
+	size = NUM2LONG(vsize);
+	if (size < 1 || size > (1L << 24)) {
+	    rb_raise(rb_eArgError, "invalid cache size: %ld", size);
+	}
+    }
+    rb_check_frozen(self);
+    cache_resize(cache_get(self), size);
+    return self;
+}
+
+/*
+ * @overload global()
+ *
+ * returns the cache of the current Ractor, made on first use; a cache
+ * can't be shared between Ractors
+ */
+static VALUE
+cache_s_global(VALUE klass) {
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+    VALUE cache;
+    if (!rb_ractor_local_storage_value_lookup(global_cache_key, &cache)) {
+	cache = cache_new(CACHE_DEFAULT_SIZE * 4);
+	rb_ractor_local_storage_value_set(global_cache_key, cache);
+    }
+    return cache;
+#else
+    return global_cache;
+#endif
+}
+
+/*
+ * @overload size()
+ *
+ * returns the number of slots
+ */
+static VALUE
+cache_size(VALUE self) {
+    return SIZET2NUM(cache_get(self)->mask + 1);
+}
+
+/*
+ * @overload stats()
+ *
+ * returns the lookup counters as {hits:, misses:, size:}
+ */
+static VALUE
+cache_stats(VALUE self) {
+    cache_t *cache = cache_get(self);
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(id_hits), SIZET2NUM(cache->hits));
+    rb_hash_aset(h, ID2SYM(id_misses), SIZET2NUM(cache->misses));
+    rb_hash_aset(h, ID2SYM(id_size), SIZET2NUM(cache->mask + 1));
+    return h;
+}
+
+/*
+ * @overload clear()
+ *
+ * empties the cache, resets the counters and returns self
+ */
+static VALUE
+cache_clear(VALUE self) {
+    cache_t *cache = cache_get(self);
+    MEMZERO(cache->entries, cache_entry_t, cache->mask + 1);
+    cache->hits = cache->misses = 0;
+    return self;
+}
+
+void
+Init_jsonista_cache(VALUE mJsonista)
+{
+    cCache = rb_define_class_under(mJsonista, "Cache", rb_cObject);
+    rb_define_alloc_func(cCache, cache_s_alloc);
+    rb_define_singleton_method(cCache, "global", cache_s_global, 0);
+    rb_define_method(cCache, "initialize", cache_initialize, -1);
+    rb_define_method(cCache, "size", cache_size, 0);
+    rb_define_method(cCache, "stats", cache_stats, 0);
+    rb_define_method(cCache, "clear", cache_clear, 0);
+
+    id_hits = rb_intern("hits");
+    id_misses = rb_intern("misses");
+    id_size = rb_intern("size");
+    id_uminus = rb_intern("-@");
+
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY
+    global_cache_key = rb_ractor_local_storage_value_newkey();
+#else
+    global_cache = cache_new(CACHE_DEFAULT_SIZE * 4);
+    rb_gc_register_mark_object(global_cache);
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef JSONISTA_CACHE_H
+#define JSONISTA_CACHE_H 1
+
+#include "jsonista.h"
+
+/* longer strings are never cached */
+#define CACHE_MAX_LEN 64
+#define CACHE_DEFAULT_SIZE 1024
+
+typedef struct {
+    uint64_t hash;
+    VALUE str; /* frozen, deduplicated UTF-8 String, or 0 if empty */
+    VALUE sym; /* Symbol for str, or 0 until asked for */
+} cache_entry_t;
+
+/*
+ * Direct-mapped cache from raw key bytes to frozen Strings: a slot holds
+ * the last string hashed into it.
+ */
+typedef struct {
+    VALUE self;
+    size_t mask;
+    size_t hits, misses;
+    cache_entry_t *entries;
+} cache_t;
+
+extern VALUE cCache;
+
+/* returns the cache_t of a Jsonista::Cache, or raises TypeError */
+cache_t *cache_get(VALUE obj);
+VALUE cache_new(size_t size);
+/* returns the String (or Symbol if sym) for [p, p+len), which must be at
+ * most CACHE_MAX_LEN bytes; allocates nothing on a hit */
+VALUE cache_fetch(cache_t *cache, const char *p, size_t len, int sym);
+/* the hash of cache slots, for other tables of raw strings */
+uint64_t cache_hash(const char *p, size_t len);
+void Init_jsonista_cache(VALUE mJsonista);
+
+#endif /* JSONISTA_CACHE_H */
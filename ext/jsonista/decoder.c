@@ -0,0 +1,687 @@
+#include "decoder.h"
+#include "parser.h"
+#include "cache.h"
+#include <string.h>
+
+VALUE cDecoder;
+static VALUE cData, eParseError;
+static ID id_members, id_keyword_init_p, id_boolean, id_any;
+
+/* the types a member can be decoded as; null is nil for any of them */
+enum decoder_kind {
+    KIND_ANY,     /* any value, as Jsonista.parse returns it */
+    KIND_STRING,
+    KIND_INTEGER,
+    KIND_FLOAT,   /* integers are converted */
+    KIND_BOOLEAN,
+    KIND_RECORD,  /* an object, by another decoder */
+    KIND_ARRAY,   /* of elem */
+};
+
+typedef struct decoder_type_st {
+    enum decoder_kind kind;
+    VALUE decoder;                /* KIND_RECORD */
+    struct decoder_type_st *elem; /* KIND_ARRAY */
+} decoder_type_t;
+
+typedef struct {
+    VALUE name; /* the key: the member name, or nil if not decoded */
+    decoder_type_t type;
+} decoder_field_t;
+
+/*
+ * Keys are matched with a perfect hash of the member names: the slot of
+ * cache_hash(key) in table holds the only member the key can be, or -1,
+ * and one comparison confirms it.  The seed is searched for by
+ * Decoder.new so that no two names share a slot.
+ */
+typedef struct {
+    VALUE klass;
+    int data;       /* klass is a Data class */
+    long nfields;   /* members of klass, in order */
+    decoder_field_t *fields;
+    int *table;
+    int bits;       /* table has 1 << bits slots */
+    uint64_t seed;
+    decoder_type_t self_type; /* a record of this decoder */
+    parser_t *parser; /* for one decode at a time */
+    VALUE vals;       /* and its values stack, see decode_t */
+    int busy;
+} decoder_t;
+
+#define DECODER_SLOT(d, h) ((size_t)(((h) * (d)->seed) >> (64 - (d)->bits)))
+
+static void
+type_mark(const decoder_type_t *t) {
+    for (; t; t = t->elem) rb_gc_mark(t->decoder);
+}
+
+/* frees the element types of t, which its holder owns */
+static void
+type_free(decoder_type_t *t) {
+    decoder_type_t *e = t->elem;
+    while (e) {
+	decoder_type_t *next = e->elem;
+	xfree(e);
+	e = next;
+    }
+}
+
+static void
+decoder_mark(void *ptr) {
+    decoder_t *d = ptr;
+    long i;
+    rb_gc_mark(d->klass);
+    rb_gc_mark(d->vals);
+    for (i = 0; i < d->nfields; i++) {
+	rb_gc_mark(d->fields[i].name);
+	type_mark(&d->fields[i].type);
+    }
+}
+
+static void
+decoder_free(void *ptr) {
+    decoder_t *d = ptr;
+    long i;
+    for (i = 0; i < d->nfields; i++) type_free(&d->fields[i].type);
+    xfree(d->fields);
+    xfree(d->table);
+    if (d->parser) parser_free(d->parser);
+    xfree(d);
+}
+
+static size_t
+decoder_memsize(const void *ptr) {
+    const decoder_t *d = ptr;
+    return sizeof(*d) + d->nfields * sizeof(decoder_field_t) +
+	(d->table ? ((size_t)1 << d->bits) * sizeof(int) : 0) +
+	(d->parser ? parser_memsize(d->parser) : 0);
+}
+
+static const rb_data_type_t decoder_data_type = {
+    "jsonista_decoder",
+    {
+	decoder_mark, decoder_free, decoder_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+static VALUE
+decoder_s_alloc(VALUE klass)
+{
+    decoder_t *d;
+    VALUE obj = TypedData_Make_Struct(klass, decoder_t, &decoder_data_type, d);
+    d->klass = Qnil;
+    d->vals = Qnil;
+    d->self_type.kind = KIND_RECORD;
+    d->self_type.decoder = Qnil;
+    return obj;
+}
+
+static decoder_t *
+decoder_get(VALUE self)
+{
+    decoder_t *d = rb_check_typeddata(self, &decoder_data_type);
+    if (!d->table) {
+	rb_raise(rb_eTypeError, "uninitialized %" PRIsVALUE, rb_obj_class(self));
+    }
+    return d;
+}
+
+static const char *
+type_name(const decoder_type_t *t)
+{
+    switch (t->kind) {
+      case KIND_STRING: return "a string";
+      case KIND_INTEGER: return "an integer";
+      case KIND_FLOAT: return "a number";
+      case KIND_BOOLEAN: return "true or false";
+      case KIND_RECORD: return "an object";
+      case KIND_ARRAY: return "an array";
+      default: return "a value";
+    }
+}
+
+static void
+type_parse(VALUE self, decoder_type_t *t, VALUE spec)
+{
+    t->decoder = Qnil;
+    t->elem = NULL;
+    if (spec == rb_cString) t->kind = KIND_STRING;
+    else if (spec == rb_cInteger) t->kind = KIND_INTEGER;
+    else if (spec == rb_cFloat) t->kind = KIND_FLOAT;
+    else if (spec == ID2SYM(id_boolean)) t->kind = KIND_BOOLEAN;
+    else if (spec == ID2SYM(id_any) || spec == rb_cObject) t->kind = KIND_ANY;
+    else if (rb_typeddata_is_kind_of(spec, &decoder_data_type)) {
+	decoder_get(spec);
+	t->kind = KIND_RECORD;
+	RB_OBJ_WRITE(self, &t->decoder, spec);
+    }
+    else if (RB_TYPE_P(spec, T_ARRAY) && RARRAY_LEN(spec) == 1) {
+	t->kind = KIND_ARRAY;
+	t->elem = ZALLOC(decoder_type_t);
+	type_parse(self, t->elem, RARRAY_AREF(spec, 0));
+    }
+    else {
+	rb_raise(rb_eArgError, "unknown type: %+"PRIsVALUE, spec);
+    }
+}
+
+struct field_args {
+    VALUE self;
+    decoder_t *d;
+    VALUE members;
+};
+
+static int
+decoder_field_i(VALUE key, VALUE spec, VALUE ptr)
+{
+    struct field_args *a = (struct field_args *)ptr;
+    VALUE sym = SYMBOL_P(key) ? key : rb_str_intern(rb_str_to_str(key));
+    decoder_field_t *f;
+    long i;
+
+    for (i = 0; i < a->d->nfields; i++) {
+	if (RARRAY_AREF(a->members, i) == sym) break;
+    }
+    if (i == a->d->nfields) {
+	rb_raise(rb_eArgError, "unknown member: %+"PRIsVALUE, key);
+    }
+    f = &a->d->fields[i];
+    if (!NIL_P(f->name)) {
+	rb_raise(rb_eArgError, "duplicate member: %+"PRIsVALUE, key);
+    }
+    type_parse(a->self, &f->type, spec);
+    RB_OBJ_WRITE(a->self, &f->name, rb_sym2str(sym));
+    return ST_CONTINUE;
+}
+
+/* finds a seed for which the names take distinct slots */
+static void
+decoder_hash_build(decoder_t *d, long nkeys)
+{
+    int bits = 1;
+    while ((1L << bits) < nkeys) bits++;
+    for (;; bits++) {
+	size_t size = (size_t)1 << bits;
+	uint64_t s;
+	REALLOC_N(d->table, int, size);
+	d->bits = bits;
+	for (s = 1; s <= 64; s++) {
+	    long i;
+	    d->seed = (s * 0x9e3779b97f4a7c15ULL) | 1;
+	    memset(d->table, 0xff, size * sizeof(int));
+	    for (i = 0; i < d->nfields; i++) {
+		VALUE name = d->fields[i].name;
+		size_t slot;
+		if (NIL_P(name)) continue;
+		slot = DECODER_SLOT(d, cache_hash(RSTRING_PTR(name), RSTRING_LEN(name)));
+		if (d->table[slot] >= 0) break;
+		d->table[slot] = (int)i;
+	    }
+	    if (i == d->nfields) return;
+	}
+    }
+}
+
+/* the member of a key, or -1 */
+static long
+decoder_field_at(const decoder_t *d, const char *p, size_t len)
+{
+    int i = d->table[DECODER_SLOT(d, cache_hash(p, len))];
+    VALUE name;
+    if (i < 0) return -1;
+    name = d->fields[i].name;
+    if ((size_t)RSTRING_LEN(name) != len || memcmp(RSTRING_PTR(name), p, len)) {
+	return -1;
+    }
+    return i;
+}
+
+/*
+ * @overload new(klass, fields)
+ *   @param klass [Class] a Struct or Data class
+ *   @param fields [Hash{Symbol => Object}] the members to decode and
+ *     their types: String, Integer, Float, :boolean, :any, a Decoder for
+ *     a nested object, or [type] for an array
+ *
+ * returns a decoder of JSON objects into instances of klass
+ *
+ * The key of a member is its name.  Keys are matched with a perfect hash
+ * made here, values are converted as they are scanned, and keys not in
+ * fields are skipped with their values, so that decoding allocates the
+ * instances and their values alone: no Hash and no key String.  Members
+ * not in fields or not in the input are nil.  A value of another type
+ * than its member's raises ParseError; null is nil for any type.
+ *
+ * Structs are made with new, Data objects without calling initialize,
+ * as Marshal does.  Structs with keyword_init are not supported.
+ */
+static VALUE
+decoder_initialize(VALUE self, VALUE klass, VALUE fields)
+{
+    decoder_t *d = rb_check_typeddata(self, &decoder_data_type);
+    struct field_args a;
+    long i;
+
+    if (d->fields) {
+	rb_raise(rb_eTypeError, "already initialized %" PRIsVALUE, rb_obj_class(self));
+    }
+    Check_Type(klass, T_CLASS);
+    Check_Type(fields, T_HASH);
+    if (RTEST(rb_class_inherited_p(klass, rb_cStruct))) {
+	if (rb_respond_to(klass, id_keyword_init_p) &&
+	    RTEST(rb_funcall(klass, id_keyword_init_p, 0))) {
+	    rb_raise(rb_eArgError, "keyword_init Structs are not supported");
+	}
+    }
+    else if (!NIL_P(cData) && RTEST(rb_class_inherited_p(klass, cData))) {
+	d->data = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "not a Struct or Data class: %" PRIsVALUE, klass);
+    }
+    if (!RHASH_SIZE(fields)) {
+	rb_raise(rb_eArgError, "no fields");
+    }
+    a.members = rb_funcall(klass, id_members, 0);
+    Check_Type(a.members, T_ARRAY);
+    RB_OBJ_WRITE(self, &d->klass, klass);
+    d->fields = ALLOC_N(decoder_field_t, RARRAY_LEN(a.members));
+    for (i = 0; i < RARRAY_LEN(a.members); i++) {
+	d->fields[i].name = Qnil;
+	d->fields[i].type.kind = KIND_ANY;
+	d->fields[i].type.decoder = Qnil;
+	d->fields[i].type.elem = NULL;
+    }
+    d->nfields = RARRAY_LEN(a.members);
+    a.self = self;
+    a.d = d;
+    rb_hash_foreach(fields, decoder_field_i, (VALUE)&a);
+    RB_GC_GUARD(a.members);
+    decoder_hash_build(d, RHASH_SIZE(fields));
+    RB_OBJ_WRITE(self, &d->self_type.decoder, self);
+    return self;
+}
+
+/* decode */
+
+enum frame_kind {
+    FRAME_RECORD,
+    FRAME_ARRAY,
+    FRAME_SKIP,   /* a value of an unknown key */
+    FRAME_ANY,    /* a container of a KIND_ANY member, parsed at its end */
+};
+
+typedef struct {
+    enum frame_kind kind;
+    const decoder_t *d;         /* FRAME_RECORD */
+    const decoder_type_t *elem; /* FRAME_ARRAY */
+    long base;  /* record: index of its values in vals; array: of the Array */
+    long field; /* record: the member of the current key, or -1 */
+    long depth; /* skip, any: containers open */
+    const char *start; /* any: the source of the value */
+} frame_t;
+
+typedef struct {
+    decoder_t *d;
+    parser_t *parser;
+    VALUE src;
+    const char *s, *e;
+    VALUE vals;   /* the values of the open records and arrays */
+    VALUE result;
+    VALUE any_parser; /* for FRAME_ANY, made on first use */
+    int sp;
+    frame_t frames[PARSER_MAX_NESTING + 1];
+} decode_t;
+
+#define DECODE_TOP(ds) (&(ds)->frames[(ds)->sp - 1])
+#define DECODE_SKIPPING(ds) ((ds)->sp && DECODE_TOP(ds)->kind >= FRAME_SKIP)
+
+/* the type of the next value, or NULL to skip it */
+static const decoder_type_t *
+decode_expected(decode_t *ds)
+{
+    frame_t *f;
+    if (!ds->sp) return &ds->d->self_type;
+    f = DECODE_TOP(ds);
+    if (f->kind == FRAME_ARRAY) return f->elem;
+    return f->field < 0 ? NULL : &f->d->fields[f->field].type;
+}
+
+NORETURN(static void decode_type_error(decode_t *ds, const decoder_type_t *t));
+static void
+decode_type_error(decode_t *ds, const decoder_type_t *t)
+{
+    ptrdiff_t pos = ds->parser->token - ds->s;
+    VALUE argv[3];
+    if (ds->sp && DECODE_TOP(ds)->kind == FRAME_RECORD) {
+	frame_t *f = DECODE_TOP(ds);
+	argv[0] = rb_sprintf("expected %s for %"PRIsVALUE" at %"PRIdPTRDIFF,
+			     type_name(t), f->d->fields[f->field].name, pos);
+    }
+    else {
+	argv[0] = rb_sprintf("expected %s at %"PRIdPTRDIFF, type_name(t), pos);
+    }
+    argv[1] = ds->src;
+    argv[2] = LONG2NUM(pos);
+    rb_exc_raise(rb_class_new_instance(3, argv, eParseError));
+}
+
+static void
+decode_add(decode_t *ds, VALUE v)
+{
+    frame_t *f;
+    if (!ds->sp) {
+	ds->result = v;
+	return;
+    }
+    f = DECODE_TOP(ds);
+    if (f->kind == FRAME_RECORD) {
+	rb_ary_store(ds->vals, f->base + f->field, v);
+    }
+    else {
+	rb_ary_push(RARRAY_AREF(ds->vals, f->base), v);
+    }
+}
+
+static VALUE
+decode_record(const decoder_t *d, VALUE vals, long base)
+{
+    long i, n = d->nfields;
+    VALUE obj;
+    if (!d->data) {
+	VALUE *argv = ALLOCA_N(VALUE, n);
+	MEMCPY(argv, RARRAY_CONST_PTR(vals) + base, VALUE, n);
+	return rb_class_new_instance((int)n, argv, d->klass);
+    }
+    obj = rb_obj_alloc(d->klass);
+    for (i = 0; i < n; i++) {
+	RSTRUCT_SET(obj, i, RARRAY_AREF(vals, base + i));
+    }
+    return rb_obj_freeze(obj);
+}
+
+static void
+decode_start(decode_t *ds, int array)
+{
+    const decoder_type_t *t, *elem = NULL;
+    frame_t *f;
+
+    if (DECODE_SKIPPING(ds)) {
+	DECODE_TOP(ds)->depth++;
+	return;
+    }
+    t = decode_expected(ds);
+    if (array && t) {
+	if (t->kind == KIND_ARRAY) elem = t->elem;
+	/* a top-level array of records */
+	else if (!ds->sp) elem = t;
+    }
+    f = &ds->frames[ds->sp];
+    f->depth = 1;
+    if (!t) {
+	f->kind = FRAME_SKIP;
+    }
+    else if (t->kind == KIND_ANY) {
+	f->kind = FRAME_ANY;
+	f->start = ds->parser->token;
+    }
+    else if (elem) {
+	f->kind = FRAME_ARRAY;
+	f->elem = elem;
+	f->base = RARRAY_LEN(ds->vals);
+	rb_ary_push(ds->vals, rb_ary_new());
+    }
+    else if (!array && t->kind == KIND_RECORD) {
+	const decoder_t *d = RTYPEDDATA_DATA(t->decoder);
+	long i;
+	f->kind = FRAME_RECORD;
+	f->d = d;
+	f->field = -1;
+	f->base = RARRAY_LEN(ds->vals);
+	for (i = 0; i < d->nfields; i++) rb_ary_push(ds->vals, Qnil);
+    }
+    else {
+	decode_type_error(ds, t);
+    }
+    ds->sp++;
+}
+
+static void
+decode_start_object(void *data) {
+    decode_start(data, 0);
+}
+
+static void
+decode_start_array(void *data) {
+    decode_start(data, 1);
+}
+
+static void
+decode_end(void *data) {
+    decode_t *ds = data;
+    frame_t *f = DECODE_TOP(ds);
+    VALUE v;
+
+    if (f->kind >= FRAME_SKIP && --f->depth) return;
+    ds->sp--;
+    switch (f->kind) {
+      case FRAME_SKIP:
+	return;
+      case FRAME_ANY:
+	if (NIL_P(ds->any_parser)) ds->any_parser = jsonista_parser_new(Qnil);
+	v = jsonista_parse_value(ds->any_parser, ds->src, f->start, ds->parser->token_end);
+	break;
+      case FRAME_ARRAY:
+	v = RARRAY_AREF(ds->vals, f->base);
+	rb_ary_resize(ds->vals, f->base);
+	break;
+      default:
+	v = decode_record(f->d, ds->vals, f->base);
+	rb_ary_resize(ds->vals, f->base);
+	break;
+    }
+    decode_add(ds, v);
+}
+
+static void
+decode_key(void *data, const char *p, size_t len) {
+    decode_t *ds = data;
+    frame_t *f = DECODE_TOP(ds);
+    if (f->kind == FRAME_RECORD) f->field = decoder_field_at(f->d, p, len);
+}
+
+static void
+decode_string(void *data, const char *p, size_t len) {
+    decode_t *ds = data;
+    const decoder_type_t *t;
+    if (DECODE_SKIPPING(ds) || !(t = decode_expected(ds))) return;
+    if (t->kind != KIND_STRING && t->kind != KIND_ANY) decode_type_error(ds, t);
+    decode_add(ds, rb_utf8_str_new(p, len));
+}
+
+static void
+decode_number(void *data, const parser_number_t *num) {
+    decode_t *ds = data;
+    const decoder_type_t *t;
+    if (DECODE_SKIPPING(ds) || !(t = decode_expected(ds))) return;
+    switch (t->kind) {
+      case KIND_INTEGER:
+	if (num->is_float) decode_type_error(ds, t);
+	/* fall through */
+      case KIND_ANY:
+	decode_add(ds, jsonista_number_value(num));
+	break;
+      case KIND_FLOAT:
+	decode_add(ds, DBL2NUM(parser_number_double(num)));
+	break;
+      default:
+	decode_type_error(ds, t);
+    }
+}
+
+static void
+decode_literal(decode_t *ds, VALUE v) {
+    const decoder_type_t *t;
+    if (DECODE_SKIPPING(ds) || !(t = decode_expected(ds))) return;
+    if (!NIL_P(v) && t->kind != KIND_BOOLEAN && t->kind != KIND_ANY) {
+	decode_type_error(ds, t);
+    }
+    decode_add(ds, v);
+}
+
+static void
+decode_true(void *data) {
+    decode_literal(data, Qtrue);
+}
+
+static void
+decode_false(void *data) {
+    decode_literal(data, Qfalse);
+}
+
+static void
+decode_null(void *data) {
+    decode_literal(data, Qnil);
+}
+
+static const parser_events_t decode_events = {
+    decode_start_object,
+    decode_end,
+    decode_start_array,
+    decode_end,
+    decode_key,
+    decode_string,
+    decode_number,
+    decode_true,
+    decode_false,
+    decode_null,
+    NULL,
+    NULL,
+};
+
+static VALUE
+decode_body(VALUE ptr)
+{
+    decode_t *ds = (decode_t *)ptr;
+    parser_t *parser = ds->parser;
+    const char *p = ds->s;
+
+    parser_init(parser);
+    parser->events = &decode_events;
+    parser->data = ds;
+    switch (parser_parse_end(parser, &p, ds->e)) {
+      case ERR_SUCCESS:
+	break;
+      case ERR_NESTING:
+	jsonista_nesting_error(ds->src, parser->max_nesting, p - ds->s);
+      case ERR_NEEDMORE:
+	jsonista_parse_error(ds->src, ds->e, ds->e, ds->e - ds->s);
+      default:
+	jsonista_parse_error(ds->src, p, ds->e, p - ds->s);
+    }
+    return ds->result;
+}
+
+static VALUE
+decode_ensure(VALUE ptr)
+{
+    decode_t *ds = (decode_t *)ptr;
+    if (ds->parser == ds->d->parser) {
+	rb_ary_clear(ds->vals);
+	ds->d->busy = 0;
+    }
+    else {
+	parser_free(ds->parser);
+    }
+    return Qnil;
+}
+
+/*
+ * @overload decode(str)
+ *   @param str [String] a JSON object, or an array of objects
+ *
+ * returns an instance of the class of the decoder, or an Array of them
+ */
+static VALUE
+decoder_decode(VALUE self, VALUE str)
+{
+    decode_t ds;
+    VALUE result;
+
+    ds.d = decoder_get(self);
+    StringValue(str);
+    ds.src = rb_str_new_frozen(str);
+    ds.s = RSTRING_PTR(ds.src);
+    ds.e = RSTRING_END(ds.src);
+    ds.result = Qnil;
+    ds.any_parser = Qnil;
+    ds.sp = 0;
+    /* a decode from the initialize of a Struct has its own */
+    if (ds.d->busy) {
+	ds.parser = parser_new();
+	ds.vals = rb_ary_new();
+    }
+    else {
+	if (!ds.d->parser) {
+	    ds.d->parser = parser_new();
+	    RB_OBJ_WRITE(self, &ds.d->vals, rb_ary_new());
+	}
+	ds.parser = ds.d->parser;
+	ds.vals = ds.d->vals;
+	ds.d->busy = 1;
+    }
+    result = rb_ensure(decode_body, (VALUE)&ds, decode_ensure, (VALUE)&ds);
+    RB_GC_GUARD(self);
+    RB_GC_GUARD(ds.src);
+    RB_GC_GUARD(ds.vals);
+    return result;
+}
+
+/*
+ * @overload compile(klass, fields)
+ *   @param klass [Class] a Struct or Data class
+ *   @param fields [Hash{Symbol => Object}] the members to decode and
+ *     their types
+ *
+ * returns a Jsonista::Decoder of klass, see Decoder.new
+ */
+static VALUE
+decoder_s_compile(VALUE mod, VALUE klass, VALUE fields)
+{
+    VALUE argv[2];
+    argv[0] = klass;
+    argv[1] = fields;
+    return rb_class_new_instance(2, argv, cDecoder);
+}
+
+void
+Init_jsonista_decoder(VALUE mJsonista)
+{
+    cDecoder = rb_define_class_under(mJsonista, "Decoder", rb_cObject);
+    rb_define_alloc_func(cDecoder, decoder_s_alloc);
+    rb_define_method(cDecoder, "initialize", decoder_initialize, 2);
+    rb_define_method(cDecoder, "decode", decoder_decode, 1);
+    rb_define_module_function(mJsonista, "compile", decoder_s_compile, 2);
+
+    eParseError = rb_const_get(mJsonista, rb_intern("ParseError"));
+    /* Data of Ruby 3.2, not the Data of Ruby 2 */
+    cData = Qnil;
+    if (rb_const_defined(rb_cObject, rb_intern("Data"))) {
+	VALUE data = rb_const_get(rb_cObject, rb_intern("Data"));
+	if (RB_TYPE_P(data, T_CLASS) && rb_respond_to(data, rb_intern("define"))) {
+	    cData = data;
+	}
+    }
+    rb_gc_register_mark_object(cData);
+
+    id_members = rb_intern("members");
+    id_keyword_init_p = rb_intern("keyword_init?");
+    id_boolean = rb_intern("boolean");
+    id_any = rb_intern("any");
+}
@@ -0,0 +1,10 @@
+#ifndef JSONISTA_DECODER_H
+#define JSONISTA_DECODER_H 1
+
+#include "jsonista.h"
+
+extern VALUE cDecoder;
+
+void Init_jsonista_decoder(VALUE mJsonista);
+
+#endif /* JSONISTA_DECODER_H */
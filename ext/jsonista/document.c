@@ -0,0 +1,484 @@
+#include "document.h"
+#include "parser.h"
+#include <string.h>
+
+VALUE cDocument;
+static ID id_multi_document, id_paths, id_aggregate;
+
+/*
+ * One entry per value of a document in document order, keys included,
+ * plus one after the members of each container.  Types are not stored:
+ * they are read back from the source byte at `off`.
+ */
+typedef struct {
+    uint32_t off; /* start of the value; for an end entry, one past the bracket */
+    uint32_t arg; /* scalars and keys: end of the value; containers: index
+		   * of their end entry; end entries: index of their container */
+} tape_entry_t;
+
+typedef struct {
+    VALUE src;    /* frozen copy of the input */
+    VALUE parser; /* Jsonista::Parser decoding the values accessed */
+    tape_entry_t *entries;
+    size_t len, capa;
+} tape_t;
+
+/* a value of a document: a position in the tape shared by all of them */
+typedef struct {
+    VALUE tape;
+    size_t i;
+} document_t;
+
+static void
+tape_mark(void *ptr) {
+    tape_t *t = ptr;
+    rb_gc_mark(t->src);
+    rb_gc_mark(t->parser);
+}
+
+static void
+tape_free(void *ptr) {
+    tape_t *t = ptr;
+    xfree(t->entries);
+    xfree(t);
+}
+
+static size_t
+tape_memsize(const void *ptr) {
+    const tape_t *t = ptr;
+    return sizeof(*t) + t->capa * sizeof(tape_entry_t);
+}
+
+static const rb_data_type_t tape_data_type = {
+    "jsonista_tape",
+    {
+	tape_mark, tape_free, tape_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+static void
+document_mark(void *ptr) {
+    document_t *doc = ptr;
+    rb_gc_mark(doc->tape);
+}
+
+static size_t
+document_memsize(const void *ptr) {
+    return sizeof(document_t);
+}
+
+static const rb_data_type_t document_data_type = {
+    "jsonista_document",
+    {
+	document_mark, RUBY_TYPED_DEFAULT_FREE, document_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+/* tape building: record the values as the parser reports them */
+
+typedef struct {
+    tape_t *tape;
+    parser_t *parser;
+    const char *s;
+    uint32_t *open; /* tape indexes of the open containers */
+    size_t depth, capa;
+} tape_builder_t;
+
+static size_t
+tape_push(tape_t *t, size_t off, size_t arg) {
+    if (t->len == t->capa) {
+	t->capa = t->capa ? t->capa * 2 : 64;
+	REALLOC_N(t->entries, tape_entry_t, t->capa);
+    }
+    t->entries[t->len].off = (uint32_t)off;
+    t->entries[t->len].arg = (uint32_t)arg;
+    return t->len++;
+}
+
+static void
+tape_start(void *data) {
+    tape_builder_t *b = data;
+    size_t i = tape_push(b->tape, b->parser->token - b->s, 0);
+    if (b->depth == b->capa) {
+	b->capa = b->capa ? b->capa * 2 : 16;
+	REALLOC_N(b->open, uint32_t, b->capa);
+    }
+    b->open[b->depth++] = (uint32_t)i;
+}
+
+static void
+tape_end(void *data) {
+    tape_builder_t *b = data;
+    size_t i = b->open[--b->depth];
+    size_t j = tape_push(b->tape, b->parser->token_end - b->s, i);
+    b->tape->entries[i].arg = (uint32_t)j;
+}
+
+static void
+tape_token(void *data) {
+    tape_builder_t *b = data;
+    tape_push(b->tape, b->parser->token - b->s, b->parser->token_end - b->s);
+}
+
+static void
+tape_slice(void *data, const char *p, size_t len) {
+    tape_token(data);
+}
+
+static void
+tape_number(void *data, const parser_number_t *num) {
+    tape_token(data);
+}
+
+static const parser_events_t tape_events = {
+    tape_start,
+    tape_end,
+    tape_start,
+    tape_end,
+    tape_slice,
+    tape_slice,
+    tape_number,
+    tape_token,
+    tape_token,
+    tape_token,
+    NULL,
+};
+
+static VALUE
+tape_build_body(VALUE ptr) {
+    tape_builder_t *b = (tape_builder_t *)ptr;
+    const char *p = b->s, *e = b->s + RSTRING_LEN(b->tape->src);
+    enum parse_error err = parser_parse_end(b->parser, &p, e);
+    if (err == ERR_NEEDMORE) p = e;
+    if (err == ERR_NESTING) {
+	jsonista_nesting_error(b->tape->src, b->parser->max_nesting, p - b->s);
+    }
+    if (err) jsonista_parse_error(b->tape->src, p, e, p - b->s);
+    return Qnil;
+}
+
+static VALUE
+tape_build_ensure(VALUE ptr) {
+    tape_builder_t *b = (tape_builder_t *)ptr;
+    parser_free(b->parser);
+    xfree(b->open);
+    return Qnil;
+}
+
+/* access */
+
+static tape_t *
+tape_get(VALUE tape) {
+    return RTYPEDDATA_DATA(tape);
+}
+
+/* the first byte of entry i: its type */
+static int
+tape_type(const tape_t *t, size_t i) {
+    return RSTRING_PTR(t->src)[t->entries[i].off];
+}
+
+/* the entry after value i, skipping its members */
+static size_t
+tape_next(const tape_t *t, size_t i) {
+    int c = tape_type(t, i);
+    return c == '{' || c == '[' ? t->entries[i].arg + 1 : i + 1;
+}
+
+static VALUE document_new(VALUE tape, size_t i);
+
+/* value i: a Document for containers, decoded otherwise */
+static VALUE
+tape_value(VALUE tape, size_t i) {
+    tape_t *t = tape_get(tape);
+    const char *s = RSTRING_PTR(t->src);
+    const tape_entry_t *ent = &t->entries[i];
+    switch (s[ent->off]) {
+      case '{':
+      case '[':
+	return document_new(tape, i);
+      case 't':
+	return Qtrue;
+      case 'f':
+	return Qfalse;
+      case 'n':
+	return Qnil;
+      default:
+	return jsonista_parse_value(t->parser, t->src, s + ent->off, s + ent->arg);
+    }
+}
+
+static VALUE
+tape_key(VALUE tape, size_t i) {
+    tape_t *t = tape_get(tape);
+    const char *s = RSTRING_PTR(t->src);
+    return jsonista_parse_key(t->parser, t->src, s + t->entries[i].off, s + t->entries[i].arg);
+}
+
+/* whether key i is the String key; only keys with escapes are decoded */
+static int
+tape_key_eq(const tape_t *t, size_t i, VALUE key) {
+    const char *p = RSTRING_PTR(t->src) + t->entries[i].off + 1;
+    size_t len = t->entries[i].arg - t->entries[i].off - 2;
+    if (!memchr(p, '\\', len)) {
+	return (size_t)RSTRING_LEN(key) == len && memcmp(p, RSTRING_PTR(key), len) == 0;
+    }
+    return rb_str_equal(jsonista_parse_value(t->parser, t->src, p - 1, p + len + 1), key) == Qtrue;
+}
+
+static long
+tape_count(const tape_t *t, size_t i) {
+    size_t j, end = t->entries[i].arg;
+    long n = 0;
+    for (j = i + 1; j < end; j = tape_next(t, j)) n++;
+    return tape_type(t, i) == '{' ? n / 2 : n;
+}
+
+static VALUE
+document_s_alloc(VALUE klass) {
+    document_t *doc;
+    VALUE obj = TypedData_Make_Struct(klass, document_t, &document_data_type, doc);
+    doc->tape = Qnil;
+    return obj;
+}
+
+static VALUE
+document_new(VALUE tape, size_t i) {
+    VALUE obj = document_s_alloc(cDocument);
+    document_t *doc = RTYPEDDATA_DATA(obj);
+    RB_OBJ_WRITE(obj, &doc->tape, tape);
+    doc->i = i;
+    return obj;
+}
+
+static document_t *
+document_get(VALUE obj) {
+    document_t *doc = rb_check_typeddata(obj, &document_data_type);
+    if (NIL_P(doc->tape)) {
+	rb_raise(rb_eTypeError, "uninitialized %" PRIsVALUE, rb_obj_class(obj));
+    }
+    return doc;
+}
+
+/* the document of an object or array, or raises TypeError */
+static document_t *
+document_container(VALUE obj, int *type) {
+    document_t *doc = document_get(obj);
+    *type = tape_type(tape_get(doc->tape), doc->i);
+    if (*type != '{' && *type != '[') {
+	rb_raise(rb_eTypeError, "not an object or array");
+    }
+    return doc;
+}
+
+/*
+ * @overload new(str, **opts)
+ *   @param str [String] one JSON document
+ *   @param opts [Hash] options of Parser.new for the values decoded
+ *
+ * returns the document of str after checking that it is valid
+ *
+ * Only the positions of the values are recorded, 8 bytes per value.
+ * Values are decoded when they are accessed: objects and arrays are
+ * returned as Documents, scanning which skips nested containers
+ * whole; other values as Ruby values.
+ */
+static VALUE
+document_initialize(int argc, VALUE *argv, VALUE self)
+{
+    document_t *doc = rb_check_typeddata(self, &document_data_type);
+    VALUE str, opts, tape;
+    tape_t *t;
+    tape_builder_t b;
+
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+    StringValue(str);
+    if (!NIL_P(opts) && RTEST(rb_hash_lookup(opts, ID2SYM(id_multi_document)))) {
+	rb_raise(rb_eArgError, "a Document holds one document");
+    }
+    if (!NIL_P(opts) && (!NIL_P(rb_hash_lookup(opts, ID2SYM(id_paths))) ||
+			 !NIL_P(rb_hash_lookup(opts, ID2SYM(id_aggregate))))) {
+	rb_raise(rb_eArgError, "paths and aggregate can't be used with a Document");
+    }
+    if ((unsigned long)RSTRING_LEN(str) > UINT32_MAX) {
+	rb_raise(rb_eArgError, "document too large: %ld bytes", RSTRING_LEN(str));
+    }
+    rb_check_frozen(self);
+    tape = TypedData_Make_Struct(0, tape_t, &tape_data_type, t);
+    t->src = Qnil;
+    t->parser = Qnil;
+    RB_OBJ_WRITE(tape, &t->src, rb_str_new_frozen(str));
+    RB_OBJ_WRITE(tape, &t->parser, jsonista_parser_new(opts));
+
+    b.tape = t;
+    b.parser = parser_new();
+    b.parser->max_nesting = jsonista_parser_max_nesting(t->parser);
+    b.parser->events = &tape_events;
+    b.parser->data = &b;
+    b.s = RSTRING_PTR(t->src);
+    b.open = NULL;
+    b.depth = b.capa = 0;
+    rb_ensure(tape_build_body, (VALUE)&b, tape_build_ensure, (VALUE)&b);
+    REALLOC_N(t->entries, tape_entry_t, t->len);
+    t->capa = t->len;
+
+    RB_OBJ_WRITE(self, &doc->tape, tape);
+    doc->i = 0;
+    return self;
+}
+
+/*
+ * @overload [](key)
+ *   @param key [String, Symbol] of an object
+ * @overload [](index)
+ *   @param index [Integer] of an array, negative from its end
+ *
+ * returns the member, or nil if there is none
+ */
+static VALUE
+document_aref(VALUE self, VALUE key)
+{
+    int type;
+    document_t *doc = document_container(self, &type);
+    tape_t *t = tape_get(doc->tape);
+    size_t i, end = t->entries[doc->i].arg;
+
+    if (type == '{') {
+	if (SYMBOL_P(key)) key = rb_sym2str(key);
+	if (!RB_TYPE_P(key, T_STRING)) return Qnil;
+	for (i = doc->i + 1; i < end; i = tape_next(t, i + 1)) {
+	    if (tape_key_eq(t, i, key)) return tape_value(doc->tape, i + 1);
+	}
+    }
+    else {
+	long n = NUM2LONG(key);
+	if (n < 0) n += tape_count(t, doc->i);
+	if (n < 0) return Qnil;
+	for (i = doc->i + 1; i < end; i = tape_next(t, i)) {
+	    if (n-- == 0) return tape_value(doc->tape, i);
+	}
+    }
+    return Qnil;
+}
+
+static VALUE
+document_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+    int type;
+    document_t *doc = document_container(self, &type);
+    return LONG2NUM(tape_count(tape_get(doc->tape), doc->i));
+}
+
+/*
+ * @overload each { |key, value| ... }
+ *   for an object
+ * @overload each { |value| ... }
+ *   for an array
+ *
+ * yields the members in document order and returns self
+ */
+static VALUE
+document_each(VALUE self)
+{
+    int type;
+    document_t *doc;
+    tape_t *t;
+    size_t i, end;
+
+    RETURN_SIZED_ENUMERATOR(self, 0, 0, document_enum_size);
+    doc = document_container(self, &type);
+    t = tape_get(doc->tape);
+    end = t->entries[doc->i].arg;
+    if (type == '{') {
+	for (i = doc->i + 1; i < end; i = tape_next(t, i + 1)) {
+	    VALUE k = tape_key(doc->tape, i);
+	    rb_yield(rb_assoc_new(k, tape_value(doc->tape, i + 1)));
+	}
+    }
+    else {
+	for (i = doc->i + 1; i < end; i = tape_next(t, i)) {
+	    rb_yield(tape_value(doc->tape, i));
+	}
+    }
+    return self;
+}
+
+/*
+ * @overload size()
+ *
+ * returns the number of members
+ */
+static VALUE
+document_size(VALUE self)
+{
+    return document_enum_size(self, 0, 0);
+}
+
+/*
+ * @overload keys()
+ *
+ * returns the keys of an object
+ */
+static VALUE
+document_keys(VALUE self)
+{
+    int type;
+    document_t *doc = document_container(self, &type);
+    tape_t *t = tape_get(doc->tape);
+    size_t i, end = t->entries[doc->i].arg;
+    VALUE keys = rb_ary_new();
+    if (type != '{') {
+	rb_raise(rb_eTypeError, "not an object");
+    }
+    for (i = doc->i + 1; i < end; i = tape_next(t, i + 1)) {
+	rb_ary_push(keys, tape_key(doc->tape, i));
+    }
+    return keys;
+}
+
+/*
+ * @overload to_ruby()
+ *
+ * returns the value decoded as Parser#parse_chunk would
+ */
+static VALUE
+document_to_ruby(VALUE self)
+{
+    document_t *doc = document_get(self);
+    tape_t *t = tape_get(doc->tape);
+    const tape_entry_t *ent = &t->entries[doc->i];
+    const char *s = RSTRING_PTR(t->src);
+    int type = s[ent->off];
+    if (type == '{' || type == '[') {
+	return jsonista_parse_value(t->parser, t->src, s + ent->off, s + t->entries[ent->arg].off);
+    }
+    return tape_value(doc->tape, doc->i);
+}
+
+void
+Init_jsonista_document(VALUE mJsonista)
+{
+    cDocument = rb_define_class_under(mJsonista, "Document", rb_cObject);
+    rb_include_module(cDocument, rb_mEnumerable);
+    rb_define_alloc_func(cDocument, document_s_alloc);
+    rb_define_method(cDocument, "initialize", document_initialize, -1);
+    rb_define_method(cDocument, "[]", document_aref, 1);
+    rb_define_method(cDocument, "each", document_each, 0);
+    rb_define_method(cDocument, "size", document_size, 0);
+    rb_define_method(cDocument, "keys", document_keys, 0);
+    rb_define_method(cDocument, "to_ruby", document_to_ruby, 0);
+
+    id_multi_document = rb_intern("multi_document");
+    id_paths = rb_intern("paths");
+    id_aggregate = rb_intern("aggregate");
+}
@@ -0,0 +1,10 @@
+#ifndef JSONISTA_DOCUMENT_H
+#define JSONISTA_DOCUMENT_H 1
+
+#include "jsonista.h"
+
+extern VALUE cDocument;
+
+void Init_jsonista_document(VALUE mJsonista);
+
+#endif /* JSONISTA_DOCUMENT_H */
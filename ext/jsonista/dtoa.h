@@ -0,0 +1,11 @@
+#ifndef JSONISTA_DTOA_H
+#define JSONISTA_DTOA_H
+#include <stdint.h>
+
+/*
+ * the shortest decimal digits * 10^*exponent that reads back as the
+ * finite, nonzero d, ignoring its sign; *digits has no trailing zeros
+ */
+void dtoa_shortest(double d, uint64_t *digits, int *exponent);
+
+#endif
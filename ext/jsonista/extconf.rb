@@ -1,3 +1,22 @@
 require "mkmf"
 
+have_func("rb_enc_interned_str", "ruby/encoding.h")
+have_func("rb_io_descriptor", "ruby/io.h")
+# Ractor support, Ruby 3.0 and later
+have_func("rb_ext_ractor_safe", "ruby.h")
+if have_header("ruby/ractor.h")
+  have_func("rb_ractor_local_storage_value_newkey", "ruby/ractor.h")
+  have_func("rb_ractor_local_storage_ptr_newkey", "ruby/ractor.h")
+end
+have_header("sys/mman.h")
+# gzip input, where zlib is installed
+have_library("z", "inflate", "zlib.h")
+have_header("pthread.h")
+# USDT probes, unless --disable-probes
+if enable_config("probes", true)
+  have_header("sys/sdt.h")
+end
+# parser traces to stderr with --enable-trace
+$defs << "-DJSONISTA_TRACE" if enable_config("trace", false)
+
 create_makefile("jsonista/jsonista")
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+filter_t *
+filter_new(void) {
+    filter_t *f = calloc(1, sizeof(filter_t));
+    if (!f) abort();
+    f->nnodes = 1;
+    f->nodes[0].index = -1;
+    f->nodes[0].parent = -1;
+    f->nodes[0].path = -1;
+    filter_reset(f);
+    return f;
+}
+
+void
+filter_free(filter_t *f) {
+    int i;
+    if (!f) return;
+    for (i = 0; i < f->nnodes; i++) free(f->nodes[i].token);
+    free(f->masks);
+    free(f->indexes);
+    free(f);
+}
+
+size_t
+filter_memsize(const filter_t *f) {
+    return sizeof(*f) + f->capa * (sizeof(uint64_t) + sizeof(long));
+}
+
+void
+filter_reset(filter_t *f) {
+    f->next = 1; /* the root */
+    f->nesting = -1;
+    f->depth = 0;
+    f->skip_depth = 0;
+    f->skip_string = f->skip_escaped = 0;
+}
+
+/* the child of node parent for a token, added if needed */
+static int
+filter_child(filter_t *f, int parent, const char *token, size_t len, int wildcard) {
+    filter_node_t *n;
+    size_t i;
+    int c;
+    for (c = 1; c < f->nnodes; c++) {
+	n = &f->nodes[c];
+	if (n->parent == parent && n->wildcard == wildcard && n->len == len &&
+	    memcmp(n->token, token, len) == 0) {
+	    return c;
+	}
+    }
+    if (f->nnodes == FILTER_MAX_NODES) return -1;
+    n = &f->nodes[f->nnodes];
+    n->token = malloc(len + 1);
+    if (!n->token) abort();
+    memcpy(n->token, token, len);
+    n->token[len] = '\0';
+    n->len = len;
+    n->wildcard = wildcard;
+    n->parent = parent;
+    n->path = -1;
+    f->parents |= (uint64_t)1 << parent;
+    /* array indexes are digits without leading zeros */
+    n->index = len > 0 && (len == 1 || token[0] != '0') && len < 16 ? 0 : -1;
+    for (i = 0; i < len && n->index >= 0; i++) {
+	if (token[i] < '0' || token[i] > '9') n->index = -1;
+	else n->index = n->index * 10 + (token[i] - '0');
+    }
+    return f->nnodes++;
+}
+
+int
+filter_add(filter_t *f, const char *path, size_t len) {
+    const char *p = path, *e = path + len;
+    char *token = malloc(len + 1);
+    int node = 0;
+    if (!token) abort();
+    if (p < e && *p != '/') goto invalid;
+    while (p < e) {
+	size_t n = 0;
+	int wildcard;
+	for (p++; p < e && *p != '/'; p++) {
+	    if (*p == '~') {
+		if (p + 1 == e || (p[1] != '0' && p[1] != '1')) goto invalid;
+		token[n++] = *++p == '0' ? '~' : '/';
+	    }
+	    else {
+		token[n++] = *p;
+	    }
+	}
+	wildcard = n == 1 && token[0] == '*';
+	node = filter_child(f, node, token, n, wildcard);
+	if (node < 0) goto invalid;
+    }
+    free(token);
+    if (f->nodes[node].path < 0) f->nodes[node].path = f->npaths++;
+    return f->nodes[node].path;
+invalid:
+    free(token);
+    return -1;
+}
+
+void
+filter_push(filter_t *f, uint64_t mask) {
+    if (f->depth == f->capa) {
+	size_t capa = f->capa ? f->capa * 2 : 16;
+	uint64_t *masks = realloc(f->masks, capa * sizeof(uint64_t));
+	long *indexes;
+	if (!masks) abort();
+	f->masks = masks;
+	indexes = realloc(f->indexes, capa * sizeof(long));
+	if (!indexes) abort();
+	f->indexes = indexes;
+	f->capa = capa;
+    }
+    f->masks[f->depth] = mask;
+    f->indexes[f->depth] = 0;
+    f->depth++;
+}
+
+void
+filter_pop(filter_t *f) {
+    f->depth--;
+}
+
+uint64_t
+filter_key(const filter_t *f, const char *key, size_t len) {
+    uint64_t mask = f->masks[f->depth - 1], next = 0;
+    int c;
+    for (c = 1; c < f->nnodes; c++) {
+	const filter_node_t *n = &f->nodes[c];
+	if (!(mask >> n->parent & 1)) continue;
+	if (n->wildcard || (n->len == len && memcmp(n->token, key, len) == 0)) {
+	    next |= (uint64_t)1 << c;
+	}
+    }
+    return next;
+}
+
+uint64_t
+filter_index(filter_t *f) {
+    uint64_t mask = f->masks[f->depth - 1], next = 0;
+    long i = f->indexes[f->depth - 1]++;
+    int c;
+    for (c = 1; c < f->nnodes; c++) {
+	const filter_node_t *n = &f->nodes[c];
+	if (!(mask >> n->parent & 1)) continue;
+	if (n->wildcard || n->index == i) {
+	    next |= (uint64_t)1 << c;
+	}
+    }
+    return next;
+}
+
+int
+filter_path(const filter_t *f, uint64_t mask) {
+    int path = -1;
+    while (mask) {
+	const filter_node_t *n = &f->nodes[filter_lowest(mask)];
+	if (n->path >= 0 && (path < 0 || n->path < path)) path = n->path;
+	mask &= mask - 1;
+    }
+    return path;
+}
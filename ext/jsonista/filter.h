@@ -0,0 +1,78 @@
+#ifndef JSONISTA_FILTER_H
+#define JSONISTA_FILTER_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* node sets are bit masks */
+#define FILTER_MAX_NODES 64
+
+/* one path segment; node 0 is the document root */
+typedef struct filter_node_st {
+    char *token;   /* member name, unescaped */
+    size_t len;
+    long index;    /* the token as an array index, or -1 */
+    int wildcard;  /* "*": any member or element */
+    int parent;
+    int path;      /* the path ending here, or -1 */
+} filter_node_t;
+
+/*
+ * JSON Pointer paths compiled into a trie, and where the parser is in
+ * it: for each container descended into, the trie nodes it is at.
+ */
+typedef struct filter_st {
+    filter_node_t nodes[FILTER_MAX_NODES];
+    int nnodes;
+    int npaths;
+    uint64_t parents; /* the nodes with children */
+    const struct parser_events_st *events; /* the events of matched values */
+    int nested;      /* report every match, at every path of a node set,
+		      * and keep matching inside matched containers */
+    uint64_t next;   /* the nodes of the value about to start */
+    uint64_t matched; /* the nodes of the value being matched */
+    int path;        /* the path of the value being matched */
+    long nesting;    /* containers open in the value being matched, or -1 */
+    uint64_t *masks; /* the containers descended into */
+    long *indexes;   /* the index of the next element, for arrays */
+    size_t depth, capa;
+    /* state of a skipped value, kept across chunks */
+    long skip_depth;
+    int skip_string;
+    int skip_escaped;
+} filter_t;
+
+filter_t *filter_new(void);
+void filter_free(filter_t *f);
+size_t filter_memsize(const filter_t *f);
+/* adds a path such as "/items/0/price", or with "*" segments matching any
+ * member or element (RFC 6901 otherwise); returns its number, or -1 if it
+ * is invalid or the trie is full */
+int filter_add(filter_t *f, const char *path, size_t len);
+/* back to the start of a document */
+void filter_reset(filter_t *f);
+
+void filter_push(filter_t *f, uint64_t mask);
+void filter_pop(filter_t *f);
+/* the nodes of the member named [key, key+len) of the current object */
+uint64_t filter_key(const filter_t *f, const char *key, size_t len);
+/* the nodes of the next element of the current array */
+uint64_t filter_index(filter_t *f);
+/* the first path ending at one of the nodes, or -1 */
+int filter_path(const filter_t *f, uint64_t mask);
+
+/* the lowest node of a nonempty set */
+static inline int
+filter_lowest(uint64_t mask) {
+#ifdef __GNUC__
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+	mask >>= 1;
+	i++;
+    }
+    return i;
+#endif
+}
+
+#endif
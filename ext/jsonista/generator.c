@@ -0,0 +1,775 @@
+#include "generator.h"
+#include "buffer.h"
+#include "scan.h"
+#include "dtoa.h"
+#include <math.h>
+#ifdef HAVE_RUBY_RACTOR_H
+# include "ruby/ractor.h"
+#endif
+
+VALUE cWriter;
+VALUE eGeneratorError;
+static ID id_max_nesting, id_buffer_size;
+
+#define GENERATOR_MAX_NESTING 100
+#define WRITER_BLOCK_SIZE 65536
+/* dump keeps its buffer for the next call up to this size */
+#define DUMP_SPARE_MAX (1024 * 1024)
+
+typedef struct {
+    buffer_t *buf;
+    VALUE io;        /* the Writer target of full blocks, or nil */
+    size_t block;    /* the size of the blocks written to io, SIZE_MAX without */
+    size_t flushed;  /* bytes written to io */
+    long depth;      /* containers open */
+    long max_nesting;
+} generator_t;
+
+/* output */
+
+/* writes the full blocks of the buffer to io */
+static void
+gen_flush_blocks(generator_t *g) {
+    size_t len = g->buf->p - g->buf->buf, n;
+    if (NIL_P(g->io) || len < g->block) return;
+    n = len - len % g->block;
+    g->flushed += n;
+    rb_io_write(g->io, rb_str_new(g->buf->buf, n));
+    memmove(g->buf->buf, g->buf->buf + n, len - n);
+    g->buf->p -= n;
+}
+
+/* with an IO, a block goes out as soon as it is full */
+static inline void
+gen_written(generator_t *g) {
+    if ((size_t)(g->buf->p - g->buf->buf) >= g->block) gen_flush_blocks(g);
+}
+
+static void
+gen_write(generator_t *g, const char *p, size_t len) {
+    /* long runs go through in blocks */
+    while (len > g->block) {
+	buffer_write(g->buf, p, g->block);
+	gen_flush_blocks(g);
+	p += g->block;
+	len -= g->block;
+    }
+    buffer_write(g->buf, p, len);
+    gen_written(g);
+}
+
+static void
+gen_char(generator_t *g, char c) {
+    buffer_ensure_writable(g->buf, 1);
+    *g->buf->p++ = c;
+    gen_written(g);
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void
+gen_long(generator_t *g, long v) {
+    char tmp[24], *e = tmp + sizeof(tmp), *p = e;
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+    while (u >= 100) {
+	p -= 2;
+	memcpy(p, digit_pairs + (u % 100) * 2, 2);
+	u /= 100;
+    }
+    if (u >= 10) {
+	p -= 2;
+	memcpy(p, digit_pairs + u * 2, 2);
+    }
+    else {
+	*--p = '0' + (char)u;
+    }
+    if (v < 0) *--p = '-';
+    gen_write(g, p, e - p);
+}
+
+/*
+ * the shortest digits that read back as d, laid out as %g would with a
+ * precision of max(15, digits); integral values below 2**53 take the
+ * integer path
+ */
+static void
+gen_float(generator_t *g, double d) {
+    char buf[20], *digits = buf + sizeof(buf), tmp[40], *p = tmp;
+    uint64_t f;
+    int n, e, x, i;
+    if (isnan(d) || isinf(d)) {
+	rb_raise(eGeneratorError, "%s is not allowed in JSON", isnan(d) ? "NaN" : "Infinity");
+    }
+    if (fabs(d) < 9007199254740992.0 && d == (double)(long long)d && !(d == 0 && signbit(d))) {
+	gen_long(g, (long)d);
+	gen_write(g, ".0", 2);
+	return;
+    }
+    if (signbit(d)) *p++ = '-';
+    if (d == 0) {
+	memcpy(p, "0.0", 3);
+	gen_write(g, tmp, p + 3 - tmp);
+	return;
+    }
+    dtoa_shortest(d, &f, &e);
+    for (n = 0; f; f /= 10, n++) *--digits = '0' + f % 10;
+    x = e + n - 1; /* the exponent of the first digit */
+    if (x < -4 || x >= (n > 15 ? n : 15)) {
+	*p++ = digits[0];
+	if (n > 1) {
+	    *p++ = '.';
+	    memcpy(p, digits + 1, n - 1);
+	    p += n - 1;
+	}
+	*p++ = 'e';
+	*p++ = x < 0 ? '-' : '+';
+	if (x < 0) x = -x;
+	if (x >= 100) *p++ = '0' + x / 100;
+	memcpy(p, digit_pairs + (x % 100) * 2, 2);
+	p += 2;
+    } else if (x < 0) {
+	*p++ = '0';
+	*p++ = '.';
+	for (i = -1; i > x; i--) *p++ = '0';
+	memcpy(p, digits, n);
+	p += n;
+    } else {
+	for (i = 0; i <= x; i++) *p++ = i < n ? digits[i] : '0';
+	*p++ = '.';
+	if (n > x + 1) {
+	    memcpy(p, digits + x + 1, n - x - 1);
+	    p += n - x - 1;
+	} else {
+	    *p++ = '0';
+	}
+    }
+    gen_write(g, tmp, p - tmp);
+}
+
+/* escaped bytes: '"', '\\' and control characters */
+static void
+gen_escape(generator_t *g, unsigned char c) {
+    static const char hex[] = "0123456789abcdef";
+    char esc[6] = {'\\', 0};
+    switch (c) {
+      case '"': esc[1] = '"'; break;
+      case '\\': esc[1] = '\\'; break;
+      case '\b': esc[1] = 'b'; break;
+      case '\f': esc[1] = 'f'; break;
+      case '\n': esc[1] = 'n'; break;
+      case '\r': esc[1] = 'r'; break;
+      case '\t': esc[1] = 't'; break;
+      default:
+	memcpy(esc + 1, "u00", 3);
+	esc[4] = hex[c >> 4];
+	esc[5] = hex[c & 0xF];
+	gen_write(g, esc, 6);
+	return;
+    }
+    gen_write(g, esc, 2);
+}
+
+/* clean runs are found by the SIMD scanner and copied whole */
+static void
+gen_string_bytes(generator_t *g, const char *p, size_t len) {
+    const char *e = p + len;
+    gen_char(g, '"');
+    for (;;) {
+	const char *q = scan_escape_impl(p, e);
+	gen_write(g, p, q - p);
+	if (q == e) break;
+	gen_escape(g, (unsigned char)*q);
+	p = q + 1;
+    }
+    gen_char(g, '"');
+}
+
+static void
+gen_string(generator_t *g, VALUE str) {
+    int enc = ENCODING_GET(str);
+    if (enc == rb_ascii8bit_encindex() && !rb_enc_str_asciionly_p(str)) {
+	/* binary input such as IO#read output, if it is UTF-8 */
+	str = rb_enc_associate_index(rb_str_dup(str), rb_utf8_encindex());
+    }
+    else if (enc != rb_utf8_encindex() && enc != rb_usascii_encindex() &&
+	     enc != rb_ascii8bit_encindex()) {
+	/* raises for characters with no UTF-8 equivalent */
+	str = rb_str_encode(str, rb_enc_from_encoding(rb_utf8_encoding()), 0, Qnil);
+    }
+    if (rb_enc_str_coderange(str) == ENC_CODERANGE_BROKEN) {
+	rb_raise(eGeneratorError, "invalid UTF-8 string: %+"PRIsVALUE, str);
+    }
+    gen_string_bytes(g, RSTRING_PTR(str), RSTRING_LEN(str));
+    RB_GC_GUARD(str);
+}
+
+static void gen_value(generator_t *g, VALUE obj);
+
+static void
+gen_open(generator_t *g, char c) {
+    if (g->max_nesting && g->depth >= g->max_nesting) {
+	rb_raise(eGeneratorError, "nesting of %ld is too deep", g->depth + 1);
+    }
+    g->depth++;
+    gen_char(g, c);
+}
+
+static void
+gen_close(generator_t *g, char c) {
+    g->depth--;
+    gen_char(g, c);
+}
+
+static void
+gen_key(generator_t *g, VALUE key) {
+    if (RB_TYPE_P(key, T_STRING)) {
+	gen_string(g, key);
+    }
+    else if (SYMBOL_P(key)) {
+	gen_string(g, rb_sym2str(key));
+    }
+    else {
+	gen_string(g, rb_obj_as_string(key));
+    }
+}
+
+struct gen_hash_args {
+    generator_t *g;
+    int first;
+};
+
+static int
+gen_hash_i(VALUE key, VALUE value, VALUE arg) {
+    struct gen_hash_args *a = (struct gen_hash_args *)arg;
+    if (!a->first) gen_char(a->g, ',');
+    a->first = 0;
+    gen_key(a->g, key);
+    gen_char(a->g, ':');
+    gen_value(a->g, value);
+    return ST_CONTINUE;
+}
+
+static void
+gen_value(generator_t *g, VALUE obj) {
+    long i;
+    switch (rb_type(obj)) {
+      case T_NIL:
+	gen_write(g, "null", 4);
+	break;
+      case T_TRUE:
+	gen_write(g, "true", 4);
+	break;
+      case T_FALSE:
+	gen_write(g, "false", 5);
+	break;
+      case T_FIXNUM:
+	gen_long(g, FIX2LONG(obj));
+	break;
+      case T_BIGNUM:
+	{
+	    VALUE str = rb_big2str(obj, 10);
+	    gen_write(g, RSTRING_PTR(str), RSTRING_LEN(str));
+	}
+	break;
+      case T_FLOAT:
+	gen_float(g, RFLOAT_VALUE(obj));
+	break;
+      case T_STRING:
+	gen_string(g, obj);
+	break;
+      case T_SYMBOL:
+	gen_string(g, rb_sym2str(obj));
+	break;
+      case T_ARRAY:
+	gen_open(g, '[');
+	for (i = 0; i < RARRAY_LEN(obj); i++) {
+	    if (i) gen_char(g, ',');
+	    gen_value(g, RARRAY_AREF(obj, i));
+	}
+	gen_close(g, ']');
+	break;
+      case T_HASH:
+	{
+	    struct gen_hash_args a;
+	    a.g = g;
+	    a.first = 1;
+	    gen_open(g, '{');
+	    rb_hash_foreach(obj, gen_hash_i, (VALUE)&a);
+	    gen_close(g, '}');
+	}
+	break;
+      default:
+	gen_string(g, rb_obj_as_string(obj));
+	break;
+    }
+}
+
+static long
+max_nesting_value(VALUE v) {
+    if (v == Qundef) return GENERATOR_MAX_NESTING;
+    if (!RTEST(v)) return 0;
+    return NUM2LONG(v);
+}
+
+/* dump */
+
+/* the buffer of the last dump, for the next; one per Ractor */
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+static void
+spare_buffer_free(void *ptr) {
+    if (ptr) buffer_free(ptr);
+}
+
+static const struct rb_ractor_local_storage_type spare_buffer_type = {
+    NULL, spare_buffer_free,
+};
+static rb_ractor_local_key_t spare_buffer_key;
+# define SPARE_BUFFER() ((buffer_t *)rb_ractor_local_storage_ptr(spare_buffer_key))
+# define SET_SPARE_BUFFER(buf) rb_ractor_local_storage_ptr_set(spare_buffer_key, (buf))
+#else
+static buffer_t *spare_buffer;
+# define SPARE_BUFFER() spare_buffer
+# define SET_SPARE_BUFFER(buf) (spare_buffer = (buf))
+#endif
+
+struct dump_args {
+    generator_t g;
+    VALUE obj;
+};
+
+static VALUE
+dump_body(VALUE ptr) {
+    struct dump_args *a = (struct dump_args *)ptr;
+    gen_value(&a->g, a->obj);
+    return rb_utf8_str_new(a->g.buf->buf, a->g.buf->p - a->g.buf->buf);
+}
+
+static VALUE
+dump_ensure(VALUE ptr) {
+    struct dump_args *a = (struct dump_args *)ptr;
+    buffer_t *buf = a->g.buf;
+    if (!SPARE_BUFFER() && (size_t)(buf->e - buf->buf) <= DUMP_SPARE_MAX) {
+	buffer_clear(buf);
+	SET_SPARE_BUFFER(buf);
+    }
+    else {
+	buffer_free(buf);
+    }
+    return Qnil;
+}
+
+/*
+ * @overload dump(obj, max_nesting: 100)
+ *   @param obj [Object] the value to generate
+ *   @param max_nesting [Integer, false] the depth of nested objects and
+ *     arrays allowed, or false for no limit
+ *
+ * returns obj as a JSON String
+ *
+ * Hash, Array, String, Symbol, Integer, Float, true, false and nil map
+ * to their JSON counterparts; Hash keys and other objects are converted
+ * with to_s.  Strings must be valid UTF-8, or convertible to it.
+ * Raises GeneratorError for NaN, Infinity and too deep nesting.
+ */
+static VALUE
+jsonista_s_dump(int argc, VALUE *argv, VALUE mod)
+{
+    struct dump_args a;
+    VALUE opts, v = Qundef;
+    rb_scan_args(argc, argv, "1:", &a.obj, &opts);
+    if (!NIL_P(opts)) rb_get_kwargs(opts, &id_max_nesting, 0, 1, &v);
+    a.g.max_nesting = max_nesting_value(v);
+    a.g.io = Qnil;
+    a.g.block = SIZE_MAX;
+    a.g.depth = 0;
+    a.g.flushed = 0;
+    if ((a.g.buf = SPARE_BUFFER()) != NULL) {
+	SET_SPARE_BUFFER(NULL);
+    }
+    else {
+	a.g.buf = buffer_new();
+    }
+    return rb_ensure(dump_body, (VALUE)&a, dump_ensure, (VALUE)&a);
+}
+
+/* writer */
+
+enum writer_state {
+    WRITER_ARRAY_FIRST,
+    WRITER_ARRAY,
+    WRITER_OBJECT_FIRST,
+    WRITER_OBJECT,
+    WRITER_OBJECT_VALUE, /* after a key */
+};
+
+typedef struct {
+    generator_t g;
+    unsigned char *states; /* the state of each open container */
+    size_t capa;
+    long documents;        /* top-level values started */
+    int failed;            /* raised after part of a value went to io */
+} writer_t;
+
+static void
+writer_mark(void *ptr) {
+    writer_t *w = ptr;
+    rb_gc_mark(w->g.io);
+}
+
+static void
+writer_free(void *ptr) {
+    writer_t *w = ptr;
+    if (w->g.buf) buffer_free(w->g.buf);
+    xfree(w->states);
+    xfree(w);
+}
+
+static size_t
+writer_memsize(const void *ptr) {
+    const writer_t *w = ptr;
+    return sizeof(*w) + w->capa + (w->g.buf ? sizeof(buffer_t) + buffer_memsize(w->g.buf) : 0);
+}
+
+static const rb_data_type_t writer_data_type = {
+    "jsonista_writer",
+    {
+	writer_mark, writer_free, writer_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+static VALUE
+writer_s_alloc(VALUE klass)
+{
+    writer_t *w;
+    VALUE obj = TypedData_Make_Struct(klass, writer_t, &writer_data_type, w);
+    w->g.io = Qnil;
+    return obj;
+}
+
+static writer_t *
+writer_get(VALUE self)
+{
+    writer_t *w = rb_check_typeddata(self, &writer_data_type);
+    if (!w->g.buf) {
+	rb_raise(rb_eTypeError, "uninitialized %" PRIsVALUE, rb_obj_class(self));
+    }
+    if (w->failed) {
+	rb_raise(eGeneratorError, "a value failed after part of it was written");
+    }
+    return w;
+}
+
+struct writer_call_args {
+    writer_t *w;
+    void (*func)(writer_t *w, VALUE arg);
+    VALUE arg;
+};
+
+static VALUE
+writer_call_body(VALUE ptr) {
+    struct writer_call_args *a = (struct writer_call_args *)ptr;
+    a->func(a->w, a->arg);
+    return Qnil;
+}
+
+/*
+ * runs func(w, arg); if it raises, the writer is put back as it was, or
+ * is marked failed when some of the output has already gone to the IO
+ */
+static void
+writer_call(writer_t *w, void (*func)(writer_t *w, VALUE arg), VALUE arg) {
+    generator_t *g = &w->g;
+    struct writer_call_args a;
+    size_t len = g->buf->p - g->buf->buf, flushed = g->flushed;
+    long depth = g->depth, documents = w->documents;
+    unsigned char state = depth ? w->states[depth - 1] : 0;
+    int status;
+
+    a.w = w;
+    a.func = func;
+    a.arg = arg;
+    rb_protect(writer_call_body, (VALUE)&a, &status);
+    if (!status) return;
+    if (g->flushed == flushed) {
+	g->buf->p = g->buf->buf + len;
+	g->depth = depth;
+	w->documents = documents;
+	if (depth) w->states[depth - 1] = state;
+    }
+    else {
+	w->failed = 1;
+    }
+    rb_jump_tag(status);
+}
+
+/*
+ * @overload new(io, buffer_size: 65536, max_nesting: 100)
+ *   @param io [IO, #write] where the output goes
+ *   @param buffer_size [Integer] the size of the blocks written to io
+ *   @param max_nesting [Integer, false] as for Jsonista.dump
+ *
+ * returns a writer generating JSON to io piece by piece
+ *
+ * Output is buffered and written to io in blocks of buffer_size bytes,
+ * so memory use stays bounded however long the output is.  #flush
+ * writes the rest; #finish checks that every container is closed and
+ * flushes.  Top-level values after the first are separated by newlines.
+ *
+ * A call that raises, for instance on NaN, leaves the writer as it was
+ * before it; if part of its output had already been written to io,
+ * every later call raises GeneratorError instead.
+ */
+static VALUE
+writer_initialize(int argc, VALUE *argv, VALUE self)
+{
+    writer_t *w = rb_check_typeddata(self, &writer_data_type);
+    VALUE io, opts, vals[2] = {Qundef, Qundef};
+    long block = WRITER_BLOCK_SIZE;
+
+    rb_scan_args(argc, argv, "1:", &io, &opts);
+    if (w->g.buf) {
+	rb_raise(rb_eTypeError, "already initialized %" PRIsVALUE, rb_obj_class(self));
+    }
+    if (!NIL_P(opts)) {
+	ID keys[2];
+	keys[0] = id_buffer_size;
+	keys[1] = id_max_nesting;
+	rb_get_kwargs(opts, keys, 0, 2, vals);
+	if (vals[0] != Qundef) block = NUM2LONG(vals[0]);
+	if (block <= 0) rb_raise(rb_eArgError, "buffer_size must be positive");
+    }
+    w->g.max_nesting = max_nesting_value(vals[1]);
+    w->g.block = block;
+    RB_OBJ_WRITE(self, &w->g.io, io);
+    w->g.buf = buffer_new();
+    return self;
+}
+
+/* the separator before a value or key, after checking it is allowed */
+static void
+writer_before(writer_t *w, int key) {
+    generator_t *g = &w->g;
+    unsigned char *state;
+    if (g->depth == 0) {
+	if (key) rb_raise(eGeneratorError, "key outside an object");
+	if (w->documents++) gen_char(g, '\n');
+	return;
+    }
+    state = &w->states[g->depth - 1];
+    switch (*state) {
+      case WRITER_ARRAY:
+	gen_char(g, ',');
+	/* fall through */
+      case WRITER_ARRAY_FIRST:
+	if (key) rb_raise(eGeneratorError, "key in an array");
+	*state = WRITER_ARRAY;
+	break;
+      case WRITER_OBJECT:
+      case WRITER_OBJECT_FIRST:
+	if (!key) rb_raise(eGeneratorError, "value without a key in an object");
+	if (*state == WRITER_OBJECT) gen_char(g, ',');
+	*state = WRITER_OBJECT_VALUE;
+	break;
+      case WRITER_OBJECT_VALUE:
+	if (key) rb_raise(eGeneratorError, "key after a key");
+	*state = WRITER_OBJECT;
+	break;
+    }
+}
+
+static void
+writer_start_i(writer_t *w, VALUE arg)
+{
+    char c = (char)FIX2INT(arg);
+    writer_before(w, 0);
+    if ((size_t)w->g.depth >= w->capa) {
+	w->capa = w->capa ? w->capa * 2 : 16;
+	REALLOC_N(w->states, unsigned char, w->capa);
+    }
+    gen_open(&w->g, c);
+    w->states[w->g.depth - 1] = c == '{' ? WRITER_OBJECT_FIRST : WRITER_ARRAY_FIRST;
+}
+
+static VALUE
+writer_start(VALUE self, char c)
+{
+    writer_call(writer_get(self), writer_start_i, INT2FIX(c));
+    return self;
+}
+
+static void
+writer_end_i(writer_t *w, VALUE arg)
+{
+    char c = (char)FIX2INT(arg);
+    int object = c == '}';
+    unsigned char state = w->g.depth ? w->states[w->g.depth - 1] : 0;
+    if (w->g.depth == 0 ||
+	(object ? state != WRITER_OBJECT_FIRST && state != WRITER_OBJECT
+		: state != WRITER_ARRAY_FIRST && state != WRITER_ARRAY)) {
+	rb_raise(eGeneratorError, "no %s to end", object ? "object" : "array");
+    }
+    gen_close(&w->g, c);
+}
+
+static VALUE
+writer_end(VALUE self, char c)
+{
+    writer_call(writer_get(self), writer_end_i, INT2FIX(c));
+    return self;
+}
+
+/*
+ * @overload start_object()
+ *
+ * opens an object and returns self; members are written with #key and
+ * a value each
+ */
+static VALUE
+writer_start_object(VALUE self)
+{
+    return writer_start(self, '{');
+}
+
+/*
+ * @overload end_object()
+ *
+ * closes the innermost object and returns self
+ */
+static VALUE
+writer_end_object(VALUE self)
+{
+    return writer_end(self, '}');
+}
+
+/*
+ * @overload start_array()
+ *
+ * opens an array and returns self
+ */
+static VALUE
+writer_start_array(VALUE self)
+{
+    return writer_start(self, '[');
+}
+
+/*
+ * @overload end_array()
+ *
+ * closes the innermost array and returns self
+ */
+static VALUE
+writer_end_array(VALUE self)
+{
+    return writer_end(self, ']');
+}
+
+/*
+ * @overload key(name)
+ *   @param name [String, Symbol, Object] the member name
+ *
+ * writes a member name of the innermost object and returns self
+ */
+static void
+writer_key_i(writer_t *w, VALUE name)
+{
+    writer_before(w, 1);
+    gen_key(&w->g, name);
+    gen_char(&w->g, ':');
+}
+
+static VALUE
+writer_key(VALUE self, VALUE name)
+{
+    writer_call(writer_get(self), writer_key_i, name);
+    return self;
+}
+
+/*
+ * @overload value(obj)
+ *   @param obj [Object] a value as for Jsonista.dump
+ *
+ * writes a whole value and returns self
+ */
+static void
+writer_value_i(writer_t *w, VALUE obj)
+{
+    writer_before(w, 0);
+    gen_value(&w->g, obj);
+}
+
+static VALUE
+writer_value(VALUE self, VALUE obj)
+{
+    writer_call(writer_get(self), writer_value_i, obj);
+    return self;
+}
+
+/*
+ * @overload flush()
+ *
+ * writes the buffered output to the IO and returns self
+ */
+static VALUE
+writer_flush(VALUE self)
+{
+    writer_t *w = writer_get(self);
+    buffer_t *buf = w->g.buf;
+    if (buf->p > buf->buf) {
+	VALUE str = rb_str_new(buf->buf, buf->p - buf->buf);
+	buffer_clear(buf);
+	rb_io_write(w->g.io, str);
+    }
+    return self;
+}
+
+/*
+ * @overload finish()
+ *
+ * flushes the output and returns nil; raises GeneratorError if a
+ * container is still open
+ */
+static VALUE
+writer_finish(VALUE self)
+{
+    writer_t *w = writer_get(self);
+    if (w->g.depth) {
+	rb_raise(eGeneratorError, "%ld containers are still open", w->g.depth);
+    }
+    writer_flush(self);
+    return Qnil;
+}
+
+void
+Init_jsonista_generator(VALUE mJsonista)
+{
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+    spare_buffer_key = rb_ractor_local_storage_ptr_newkey(&spare_buffer_type);
+#endif
+    rb_define_module_function(mJsonista, "dump", jsonista_s_dump, -1);
+
+    cWriter = rb_define_class_under(mJsonista, "Writer", rb_cObject);
+    rb_define_alloc_func(cWriter, writer_s_alloc);
+    rb_define_method(cWriter, "initialize", writer_initialize, -1);
+    rb_define_method(cWriter, "start_object", writer_start_object, 0);
+    rb_define_method(cWriter, "end_object", writer_end_object, 0);
+    rb_define_method(cWriter, "start_array", writer_start_array, 0);
+    rb_define_method(cWriter, "end_array", writer_end_array, 0);
+    rb_define_method(cWriter, "key", writer_key, 1);
+    rb_define_method(cWriter, "value", writer_value, 1);
+    rb_define_alias(cWriter, "<<", "value");
+    rb_define_method(cWriter, "flush", writer_flush, 0);
+    rb_define_method(cWriter, "finish", writer_finish, 0);
+
+    eGeneratorError = rb_define_class_under(mJsonista, "GeneratorError", rb_eStandardError);
+
+    id_max_nesting = rb_intern("max_nesting");
+    id_buffer_size = rb_intern("buffer_size");
+}
@@ -0,0 +1,11 @@
+#ifndef JSONISTA_GENERATOR_H
+#define JSONISTA_GENERATOR_H 1
+
+#include "jsonista.h"
+
+extern VALUE cWriter;
+extern VALUE eGeneratorError;
+
+void Init_jsonista_generator(VALUE mJsonista);
+
+#endif /* JSONISTA_GENERATOR_H */
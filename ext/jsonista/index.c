@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+#include "index.h"
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+/* offsets in a block are 32 bits */
+#define INDEX_MAX_BLOCK ((size_t)1 << 31)
+
+/* classes of the bytes of a 64-byte word, one bit per byte */
+typedef struct {
+    uint64_t backslash;
+    uint64_t quote;
+    uint64_t structural; /* {}[]:, */
+    uint64_t ws;
+    uint64_t ctrl;
+    uint64_t high;       /* non-ASCII */
+} masks_t;
+
+#ifdef __SSE2__
+static void
+classify(const unsigned char *p, masks_t *m) {
+    const __m128i bs = _mm_set1_epi8('\\'), dq = _mm_set1_epi8('"');
+    const __m128i lb = _mm_set1_epi8('{'), rb = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(',');
+    const __m128i lower = _mm_set1_epi8(0x20), sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t'), lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r'), c1f = _mm_set1_epi8(0x1F);
+    int i;
+    memset(m, 0, sizeof(*m));
+    for (i = 0; i < 4; i++) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+	/* '[' | 0x20 == '{' and ']' | 0x20 == '}' */
+	__m128i v20 = _mm_or_si128(v, lower);
+	__m128i st = _mm_or_si128(
+	    _mm_or_si128(_mm_cmpeq_epi8(v20, lb), _mm_cmpeq_epi8(v20, rb)),
+	    _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+	__m128i ws = _mm_or_si128(
+	    _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+	    _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+	__m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, c1f), v);
+	int sh = 16 * i;
+	m->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bs)) << sh;
+	m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dq)) << sh;
+	m->structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(st) << sh;
+	m->ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << sh;
+	m->ctrl |= (uint64_t)(uint16_t)_mm_movemask_epi8(ctrl) << sh;
+	m->high |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << sh;
+    }
+}
+#else
+static void
+classify(const unsigned char *p, masks_t *m) {
+    int i;
+    memset(m, 0, sizeof(*m));
+    for (i = 0; i < 64; i++) {
+	uint64_t bit = (uint64_t)1 << i;
+	unsigned char c = p[i];
+	switch (c) {
+	  case '\\': m->backslash |= bit; break;
+	  case '"': m->quote |= bit; break;
+	  case '{': case '}': case '[': case ']': case ':': case ',':
+	    m->structural |= bit;
+	    break;
+	  case ' ': case '\t': case '\n': case '\r':
+	    m->ws |= bit;
+	    break;
+	}
+	if (c < 0x20) m->ctrl |= bit;
+	if (c >= 0x80) m->high |= bit;
+    }
+}
+#endif
+
+/* bits of the bytes escaped by a backslash; *carry is set if the next
+ * word starts escaped */
+static uint64_t
+find_escaped(uint64_t backslash, uint64_t *carry) {
+    const uint64_t even = 0x5555555555555555ULL;
+    uint64_t follows, odd_starts, seq_even;
+    backslash &= ~*carry;
+    follows = backslash << 1 | *carry;
+    odd_starts = backslash & ~even & ~follows;
+    *carry = __builtin_add_overflow(odd_starts, backslash, &seq_even);
+    return (even ^ (seq_even << 1)) & follows;
+}
+
+/* bit i is the parity of the bits 0..i */
+static uint64_t
+prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/* validates the characters starting in [p, limit), which may end up to e;
+ * returns the end of the last one, or NULL with *bad set to the first
+ * byte that can't be part of a character, as parse_string0 reports it */
+static const unsigned char *
+utf8_validate(const unsigned char *p, const unsigned char *limit,
+	      const unsigned char *e, const unsigned char **bad) {
+    while (p < limit) {
+	unsigned char c = *p, lo = 0x80, hi = 0xBF;
+	int n, i;
+	if (c < 0x80) {
+	    p++;
+	    continue;
+	}
+	n = c < 0xC2 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+	if (!n) {
+	    *bad = p;
+	    return NULL;
+	}
+	if (c == 0xE0) lo = 0xA0;
+	if (c == 0xED) hi = 0x9F;
+	if (c == 0xF0) lo = 0x90;
+	if (c == 0xF4) hi = 0x8F;
+	for (i = 1; i < n; i++) {
+	    if (p + i == e || p[i] < lo || p[i] > hi) {
+		*bad = p + i;
+		return NULL;
+	    }
+	    lo = 0x80;
+	    hi = 0xBF;
+	}
+	p += n;
+    }
+    return p;
+}
+
+static int
+index_reserve(index_block_t *b, size_t n) {
+    if (b->len + n > b->capa) {
+	size_t capa = b->capa ? b->capa : 1024;
+	uint32_t *r;
+	while (capa < b->len + n) capa *= 2;
+	r = realloc(b->pos, capa * sizeof(uint32_t));
+	if (!r) return 0;
+	b->pos = r;
+	b->capa = capa;
+    }
+    return 1;
+}
+
+/*
+ * pass 1 only counts the unescaped quotes of the block; pass 2, which
+ * knows whether the block starts inside a string, records the positions.
+ * Blocks never start right after a backslash, so escapes don't cross them.
+ */
+static void
+block_scan(const index_t *idx, index_block_t *b, int pass) {
+    const unsigned char *s = (const unsigned char *)b->s;
+    const unsigned char *e = (const unsigned char *)b->e;
+    const unsigned char *p, *u8 = s;
+    uint64_t escaped_carry = 0, scalar_carry = 0;
+    uint64_t in_string = b->in_string ? ~(uint64_t)0 : 0;
+    unsigned char tail[64];
+    int quotes = 0;
+
+    for (p = s; p < e; p += 64) {
+	const unsigned char *w = p;
+	size_t n = (size_t)(e - p) < 64 ? (size_t)(e - p) : 64;
+	uint64_t quote, str, scalar, bits;
+	masks_t m;
+
+	if (!((p - s) & (INDEX_MIN_BLOCK - 1)) && INDEX_INTERRUPTED(idx)) break;
+	if (n < 64) {
+	    memset(tail, ' ', sizeof(tail));
+	    memcpy(tail, p, n);
+	    w = tail;
+	}
+	classify(w, &m);
+	quote = m.quote & ~find_escaped(m.backslash, &escaped_carry);
+	if (pass == 1) {
+	    quotes ^= __builtin_popcountll(quote) & 1;
+	    continue;
+	}
+	/* from each opening quote up to its closing quote */
+	str = prefix_xor(quote) ^ in_string;
+	in_string = (uint64_t)((int64_t)str >> 63);
+	if (m.ctrl & str & ~quote) {
+	    b->error = (const char *)p + __builtin_ctzll(m.ctrl & str & ~quote);
+	}
+	if (m.high && u8 < p + n) {
+	    const unsigned char *bad = NULL;
+	    u8 = utf8_validate(u8 > p ? u8 : p, p + n, e, &bad);
+	    if (!u8 && (!b->error || (const char *)bad < b->error)) {
+		b->error = (const char *)bad;
+	    }
+	}
+	scalar = ~(m.structural | m.ws | quote) & ~str;
+	bits = (m.structural & ~str) | quote | (scalar & ~(scalar << 1 | scalar_carry));
+	scalar_carry = scalar >> 63;
+	if (b->error) {
+	    /* index only what precedes the error */
+	    size_t off = (const unsigned char *)b->error - p;
+	    bits &= off < 64 ? ((uint64_t)1 << off) - 1 : ~(uint64_t)0;
+	}
+	if (!index_reserve(b, 64)) {
+	    b->error = (const char *)p;
+	    break;
+	}
+	while (bits) {
+	    b->pos[b->len++] = (uint32_t)(p - s) + __builtin_ctzll(bits);
+	    bits &= bits - 1;
+	}
+	if (b->error) break;
+    }
+    b->quotes = quotes;
+}
+
+typedef struct {
+    index_t *idx;
+    int first, step, pass;
+} worker_t;
+
+static void *
+index_worker(void *ptr) {
+    worker_t *w = ptr;
+    int i;
+    for (i = w->first; i < w->idx->nblocks; i += w->step) {
+	if (INDEX_INTERRUPTED(w->idx)) break;
+	block_scan(w->idx, &w->idx->blocks[i], w->pass);
+    }
+    return NULL;
+}
+
+/* runs a pass over all blocks on nthreads threads, the caller's included */
+static void
+index_run(index_t *idx, int nthreads, int pass) {
+    worker_t w[64];
+    int i;
+    if (nthreads > 64) nthreads = 64;
+    for (i = 0; i < nthreads; i++) {
+	w[i].idx = idx;
+	w[i].first = i;
+	w[i].step = nthreads;
+	w[i].pass = pass;
+    }
+#ifdef HAVE_PTHREAD_H
+    {
+	pthread_t th[64];
+	int started[64];
+	for (i = 1; i < nthreads; i++) {
+	    started[i] = pthread_create(&th[i], NULL, index_worker, &w[i]) == 0;
+	    if (!started[i]) index_worker(&w[i]);
+	}
+	index_worker(&w[0]);
+	for (i = 1; i < nthreads; i++) {
+	    if (started[i]) pthread_join(th[i], NULL);
+	}
+    }
+#else
+    for (i = 0; i < nthreads; i++) index_worker(&w[i]);
+#endif
+}
+
+const char *
+index_build(index_t *idx, const char *s, const char *e, int nthreads,
+	    const volatile int *interrupted) {
+    static const char delims[] = " \t\r\n{}[]:,\"";
+    size_t size = e - s, n;
+    const char *bs = s;
+    int i;
+
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > 64) nthreads = 64;
+    n = size / INDEX_MIN_BLOCK;
+    if (n > (size_t)nthreads) n = nthreads;
+    if (n < 1) n = 1;
+    while (size / n >= INDEX_MAX_BLOCK) n++;
+    if ((size_t)nthreads > n) nthreads = (int)n;
+
+    idx->nblocks = (int)n;
+    idx->error = NULL;
+    idx->interrupted = interrupted;
+    idx->blocks = calloc(n, sizeof(index_block_t));
+    if (!idx->blocks) abort();
+    for (i = 0; i < idx->nblocks; i++) {
+	const char *be = i == idx->nblocks - 1 ? e : s + size / n * (i + 1);
+	if (be < bs) be = bs;
+	/* don't split an escape, a character or a scalar */
+	while (be < e && (be[-1] == '\\' || ((unsigned char)*be & 0xC0) == 0x80 ||
+			  (!strchr(delims, be[-1]) && !strchr(delims, *be)))) {
+	    be++;
+	}
+	idx->blocks[i].s = bs;
+	idx->blocks[i].e = be;
+	bs = be;
+    }
+
+    if (idx->nblocks > 1) {
+	index_run(idx, nthreads, 1);
+	for (i = 1; i < idx->nblocks; i++) {
+	    idx->blocks[i].in_string = idx->blocks[i - 1].in_string ^ idx->blocks[i - 1].quotes;
+	}
+    }
+    if (INDEX_INTERRUPTED(idx)) return NULL;
+    index_run(idx, nthreads, 2);
+
+    for (i = 0; i < idx->nblocks; i++) {
+	if (idx->blocks[i].error) {
+	    /* positions after the first error mean nothing */
+	    const char *error = idx->blocks[i].error;
+	    int j;
+	    for (j = i + 1; j < idx->nblocks; j++) free(idx->blocks[j].pos);
+	    idx->nblocks = i + 1;
+	    idx->error = error;
+	    return error;
+	}
+    }
+    return NULL;
+}
+
+void
+index_free(index_t *idx) {
+    int i;
+    if (!idx->blocks) return;
+    for (i = 0; i < idx->nblocks; i++) {
+	free(idx->blocks[i].pos);
+    }
+    free(idx->blocks);
+    idx->blocks = NULL;
+}
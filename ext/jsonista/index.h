@@ -0,0 +1,79 @@
+#ifndef JSONISTA_INDEX_H
+#define JSONISTA_INDEX_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Structural index of a whole document, built in parallel (stage 1):
+ * the positions of {}[]:, outside strings, of every unescaped quote and of
+ * the first byte of every other token.  The input is split into blocks,
+ * one per thread; each block lists its positions as offsets from its start.
+ */
+typedef struct index_block_st {
+    const char *s, *e;
+    uint32_t *pos;
+    size_t len, capa;
+    int quotes;    /* parity of the unescaped quotes in the block */
+    int in_string; /* the block starts inside a string */
+    const char *error; /* control character in a string or bad UTF-8 */
+} index_block_t;
+
+typedef struct index_st {
+    index_block_t *blocks;
+    int nblocks;
+    const char *error; /* the index stops there, or NULL */
+    /* set by another thread to stop building or walking the index, which
+     * is then incomplete; may be NULL */
+    const volatile int *interrupted;
+} index_t;
+
+#define INDEX_INTERRUPTED(idx) ((idx)->interrupted && *(idx)->interrupted)
+
+/* inputs shorter than this per thread are not split */
+#define INDEX_MIN_BLOCK (1024 * 1024)
+
+/*
+ * build the index of [s, e) on up to nthreads native threads; returns NULL
+ * on success, or the first invalid byte found (the index is still usable
+ * up to there).  Never calls back into Ruby.  *interrupted is polled
+ * between blocks and every INDEX_MIN_BLOCK bytes of a block.
+ */
+const char *index_build(index_t *idx, const char *s, const char *e, int nthreads,
+			const volatile int *interrupted);
+void index_free(index_t *idx);
+
+typedef struct index_iter_st {
+    const index_t *idx;
+    int block;
+    size_t i;
+} index_iter_t;
+
+static inline void
+index_iter_init(index_iter_t *it, const index_t *idx) {
+    it->idx = idx;
+    it->block = 0;
+    it->i = 0;
+}
+
+/* the next indexed position, or NULL at the end or after an interrupt;
+ * doesn't advance */
+static inline const char *
+index_peek(index_iter_t *it) {
+    while (it->block < it->idx->nblocks) {
+	const index_block_t *b = &it->idx->blocks[it->block];
+	if (it->i < b->len) return b->s + b->pos[it->i];
+	it->block++;
+	it->i = 0;
+	if (INDEX_INTERRUPTED(it->idx)) break;
+    }
+    return NULL;
+}
+
+static inline const char *
+index_next(index_iter_t *it) {
+    const char *p = index_peek(it);
+    if (p) it->i++;
+    return p;
+}
+
+#endif
@@ -1,146 +1,1868 @@
 #include "jsonista.h"
 #include "parser.h"
+#include "scan.h"
+#include "cache.h"
+#include "document.h"
+#include "index.h"
+#include "filter.h"
+#include "aggregate.h"
+#include "generator.h"
+#include "pool.h"
+#include "decoder.h"
+#include "ruby/io.h"
+#include "ruby/thread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+/* read size of Parser#parse_io */
+#define IO_BUFSIZE (128 * 1024)
+/* bytes of a mapped file handed to the parser at once */
+#define MMAP_WINDOW (8 * 1024 * 1024)
+/* inflated bytes handed to the parser at once, to parse them in cache */
+#define GZIP_WINDOW (64 * 1024)
+/* inputs at least this long are validated without the GVL */
+#define VALIDATE_NOGVL_MIN (64 * 1024)
+/* bytes validated between checks for interrupts */
+#define VALIDATE_WINDOW (1024 * 1024)
+
+static VALUE mJsonista, cParser, eParseError, eNestingError;
+static ID id_src, id_pos, id_readpartial, id_seek, id_tell, id_threads;
+static ID id_symbolize_names, id_cache, id_cache_values, id_multi_document, id_paths;
+static ID id_aggregate, aggregate_ops[AGGREGATE_DISTINCT + 1], id_max_nesting;
+static ID id_freeze, id_compression, id_gzip;
+
+/* handler methods called in event mode, in parser_events_t order */
+enum handler_event {
+    EV_START_OBJECT,
+    EV_END_OBJECT,
+    EV_START_ARRAY,
+    EV_END_ARRAY,
+    EV_KEY,
+    EV_STRING,
+    EV_NUMBER,
+    EV_TRUE_VALUE,
+    EV_FALSE_VALUE,
+    EV_NULL_VALUE,
+    EV_END_DOCUMENT,
+    EV_MAX
+};
+static const char *const handler_method_names[EV_MAX] = {
+    "start_object",
+    "end_object",
+    "start_array",
+    "end_array",
+    "key",
+    "string",
+    "number",
+    "true_value",
+    "false_value",
+    "null_value",
+    "end_document",
+};
+static ID handler_ids[EV_MAX];
+
+typedef struct {
+    parser_t *parser;
+    VALUE stack;   /* partial containers and pending object keys */
+    VALUE handler; /* event handler, or nil in builder mode */
+    unsigned int handler_events; /* bit set of methods the handler has */
+    int done;      /* the top-level value is on the stack */
+    VALUE docs;    /* documents completed in multi-document mode, or the
+		    * [path, value] pairs matched with paths */
+    VALUE paths;   /* the frozen path Strings, or nil */
+    aggregates_t *aggregates; /* the parser data with aggregate, or NULL */
+    VALUE names;   /* the names of the aggregates */
+    VALUE pool;    /* the ParserPool it is checked out of, or nil */
+    char *iobuf;   /* read buffer of parse_io */
+    size_t iobuf_capa;
+    struct gzip_st *gzip; /* inflater of parse_gzip_chunk, or NULL */
+    VALUE src;     /* input being parsed, only during a parse call */
+    const char *src_ptr, *src_end;
+    VALUE cache;   /* Jsonista::Cache for keys, or nil */
+    cache_t *key_cache;
+    int symbolize_names;
+    int cache_values; /* short string values go through the cache too */
+    int freeze;       /* values are frozen and shareable as they are built */
+} ruby_json_parser_t;
+
+/* gzip: inflate in windows for the parser */
 
-static VALUE mJsonista, cParser, eParseError;
-static ID id_src, id_pos;
+#ifdef HAVE_LIBZ
+typedef struct gzip_st {
+    z_stream zs;
+    int started;    /* input was given since the last reset */
+    int member_end; /* the input so far ends with a whole gzip member */
+    size_t in_pos;  /* compressed bytes consumed, for errors */
+    ptrdiff_t pos;  /* input position of buf, for errors */
+    size_t len;     /* inflated bytes in buf the parser has not consumed */
+    char buf[GZIP_WINDOW];
+} gzip_t;
+
+static void
+gzip_free(gzip_t *gz) {
+    if (!gz) return;
+    inflateEnd(&gz->zs);
+    xfree(gz);
+}
+
+static void
+gzip_reset(gzip_t *gz) {
+    if (!gz) return;
+    inflateReset(&gz->zs);
+    gz->started = 0;
+    gz->member_end = 1;
+    gz->in_pos = 0;
+    gz->pos = 0;
+    gz->len = 0;
+}
+#define gzip_memsize(gz) ((gz) ? sizeof(gzip_t) : 0)
+#else
+#define gzip_free(gz) ((void)(gz))
+#define gzip_reset(gz) ((void)(gz))
+#define gzip_memsize(gz) 0
+#endif
 
 #define GetJsonistaParserVal(obj, tobj) ((tobj) = get_jsonista_parser_val(obj))
 #define GetNewJsonistaParserVal(obj, tobj) ((tobj) = get_new_jsonista_parser_val(obj))
-#define JSONISTA_PARSER_INIT_P(tobj) ((tobj)->stack)
+#define JSONISTA_PARSER_INIT_P(tobj) ((tobj)->parser)
 
 static void
-jsonista_parser_free(void *parser) {
-    parser_free((void *)parser);
+jsonista_parser_mark(void *ptr) {
+    ruby_json_parser_t *rp = ptr;
+    rb_gc_mark(rp->stack);
+    rb_gc_mark(rp->handler);
+    rb_gc_mark(rp->cache);
+    rb_gc_mark(rp->docs);
+    rb_gc_mark(rp->paths);
+    rb_gc_mark(rp->names);
+    rb_gc_mark(rp->pool);
+}
+
+static void
+jsonista_parser_free(void *ptr) {
+    ruby_json_parser_t *rp = ptr;
+    if (rp->parser) parser_free(rp->parser);
+    aggregates_free(rp->aggregates);
+    xfree(rp->iobuf);
+    gzip_free(rp->gzip);
+    xfree(rp);
+}
+
+static size_t
+jsonista_parser_memsize(const void *ptr) {
+    const ruby_json_parser_t *rp = ptr;
+    return sizeof(*rp) + rp->iobuf_capa + gzip_memsize(rp->gzip) +
+	(rp->parser ? parser_memsize(rp->parser) : 0) +
+	(rp->aggregates ? aggregates_memsize(rp->aggregates) : 0);
+}
+
+static const rb_data_type_t jsonista_parser_data_type = {
+    "jsonista_parser",
+    {
+	jsonista_parser_mark, jsonista_parser_free, jsonista_parser_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+/* builder: construct Ruby values from parser events */
+
+/*
+ * freezes a complete value and marks it shareable, so that neither
+ * Ractor.make_shareable nor Ractor.shareable? traverse it.  Setting the
+ * flag by hand holds because of how values are built bottom-up:
+ * - elements, member values and path pairs are passed here as soon as
+ *   they are complete, so they are frozen and marked before their
+ *   container is, and the paths in the pairs are plain frozen Strings;
+ * - keys are frozen Strings (jsonista_key_new, or the cache's interned
+ *   ones) or Symbols, and rb_hash_aset keeps a frozen key as it is;
+ * - nothing else is reachable: no instance variables, default procs or
+ *   singleton classes are set, and a String sharing the input refers to a
+ *   frozen shared root of its own, as any frozen substring does.
+ */
+static VALUE
+builder_freeze(VALUE v) {
+    if (SPECIAL_CONST_P(v)) return v;
+    rb_obj_freeze(v);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    RB_FL_SET_RAW(v, RUBY_FL_SHAREABLE);
+#endif
+    return v;
+}
+
+static void
+builder_add(ruby_json_parser_t *rp, VALUE v) {
+    VALUE stack = rp->stack;
+    long len = RARRAY_LEN(stack);
+    VALUE top;
+
+    if (rp->freeze) builder_freeze(v);
+    if (len == 0) {
+	rb_ary_push(stack, v);
+	return;
+    }
+    top = RARRAY_AREF(stack, len - 1);
+    if (RB_TYPE_P(top, T_ARRAY)) {
+	rb_ary_push(top, v);
+    } else {
+	/* top is the pending key of the enclosing Hash */
+	rb_ary_pop(stack);
+	rb_hash_aset(RARRAY_AREF(stack, len - 2), top, v);
+    }
+}
+
+static void
+builder_start_object(void *data) {
+    ruby_json_parser_t *rp = data;
+    rb_ary_push(rp->stack, rb_hash_new());
+}
+
+static void
+builder_start_array(void *data) {
+    ruby_json_parser_t *rp = data;
+    rb_ary_push(rp->stack, rb_ary_new());
+}
+
+static void
+builder_end_container(void *data) {
+    ruby_json_parser_t *rp = data;
+    builder_add(rp, rb_ary_pop(rp->stack));
+}
+
+/* a string slice as a String, sharing the input buffer when it is a slice
+ * of the input (escape-free strings) */
+static VALUE
+jsonista_str_new(ruby_json_parser_t *rp, const char *p, size_t len) {
+    VALUE str;
+    if (rp->cache_values && len <= CACHE_MAX_LEN) {
+	return cache_fetch(rp->key_cache, p, len, 0);
+    }
+    if (rp->src_ptr <= p && p + len <= rp->src_end) {
+	str = rb_str_subseq(rp->src, p - rp->src_ptr, len);
+	if (ENCODING_GET_INLINED(str) != rb_utf8_encindex()) {
+	    rb_enc_associate_index(str, rb_utf8_encindex());
+	}
+	return str;
+    }
+    return rb_utf8_str_new(p, len);
+}
+
+/* an object key as a frozen String, or a Symbol with symbolize_names */
+static VALUE
+jsonista_key_new(ruby_json_parser_t *rp, const char *p, size_t len) {
+    VALUE str;
+    if (rp->key_cache && len <= CACHE_MAX_LEN) {
+	return cache_fetch(rp->key_cache, p, len, rp->symbolize_names);
+    }
+    str = rb_utf8_str_new(p, len);
+    if (rp->symbolize_names) {
+	return rb_str_intern(str);
+    }
+    return rb_str_freeze(str);
+}
+
+static void
+builder_key(void *data, const char *p, size_t len) {
+    ruby_json_parser_t *rp = data;
+    rb_ary_push(rp->stack, jsonista_key_new(rp, p, len));
+}
+
+static void
+builder_string(void *data, const char *p, size_t len) {
+    builder_add(data, jsonista_str_new(data, p, len));
+}
+
+VALUE
+jsonista_number_value(const parser_number_t *num) {
+    int64_t i;
+    if (num->is_float) {
+	return DBL2NUM(parser_number_double(num));
+    }
+    if (parser_number_int64(num, &i)) {
+	return LL2NUM(i);
+    }
+    return rb_str_to_inum(rb_str_new(num->p, num->len), 10, 0);
+}
+
+static void
+builder_number(void *data, const parser_number_t *num) {
+    builder_add(data, jsonista_number_value(num));
+}
+
+static void
+builder_true(void *data) {
+    builder_add(data, Qtrue);
+}
+
+static void
+builder_false(void *data) {
+    builder_add(data, Qfalse);
+}
+
+static void
+builder_null(void *data) {
+    builder_add(data, Qnil);
+}
+
+static void
+builder_end_document(void *data) {
+    ruby_json_parser_t *rp = data;
+    if (rp->parser->multi) {
+	rb_ary_push(rp->docs, rb_ary_pop(rp->stack));
+	return;
+    }
+    rp->done = 1;
+}
+
+static void
+builder_match(void *data, int path) {
+    ruby_json_parser_t *rp = data;
+    VALUE v = rb_ary_pop(rp->stack), pair;
+    pair = rb_assoc_new(RARRAY_AREF(rp->paths, path), v);
+    if (rp->freeze) builder_freeze(pair);
+    rb_ary_push(rp->docs, pair);
+}
+
+static const parser_events_t builder_events = {
+    builder_start_object,
+    builder_end_container,
+    builder_start_array,
+    builder_end_container,
+    builder_key,
+    builder_string,
+    builder_number,
+    builder_true,
+    builder_false,
+    builder_null,
+    builder_end_document,
+    builder_match,
+};
+
+/* handler: dispatch parser events to methods of a Ruby object */
+
+#define HANDLER_P(rp, ev) ((rp)->handler_events & (1U << (ev)))
+
+static void
+handler_call0(void *data, enum handler_event ev) {
+    ruby_json_parser_t *rp = data;
+    if (HANDLER_P(rp, ev)) {
+	rb_funcallv(rp->handler, handler_ids[ev], 0, 0);
+    }
+}
+
+static void
+handler_start_object(void *data) {
+    handler_call0(data, EV_START_OBJECT);
+}
+
+static void
+handler_end_object(void *data) {
+    handler_call0(data, EV_END_OBJECT);
+}
+
+static void
+handler_start_array(void *data) {
+    handler_call0(data, EV_START_ARRAY);
+}
+
+static void
+handler_end_array(void *data) {
+    handler_call0(data, EV_END_ARRAY);
+}
+
+static void
+handler_key(void *data, const char *p, size_t len) {
+    ruby_json_parser_t *rp = data;
+    if (HANDLER_P(rp, EV_KEY)) {
+	VALUE key = jsonista_key_new(rp, p, len);
+	rb_funcallv(rp->handler, handler_ids[EV_KEY], 1, &key);
+    }
+}
+
+static void
+handler_string(void *data, const char *p, size_t len) {
+    ruby_json_parser_t *rp = data;
+    if (HANDLER_P(rp, EV_STRING)) {
+	VALUE str = jsonista_str_new(rp, p, len);
+	rb_funcallv(rp->handler, handler_ids[EV_STRING], 1, &str);
+    }
+}
+
+static void
+handler_number(void *data, const parser_number_t *num) {
+    ruby_json_parser_t *rp = data;
+    if (HANDLER_P(rp, EV_NUMBER)) {
+	VALUE v = jsonista_number_value(num);
+	rb_funcallv(rp->handler, handler_ids[EV_NUMBER], 1, &v);
+    }
+}
+
+static void
+handler_true(void *data) {
+    handler_call0(data, EV_TRUE_VALUE);
+}
+
+static void
+handler_false(void *data) {
+    handler_call0(data, EV_FALSE_VALUE);
+}
+
+static void
+handler_null(void *data) {
+    handler_call0(data, EV_NULL_VALUE);
+}
+
+static void
+handler_end_document(void *data) {
+    handler_call0(data, EV_END_DOCUMENT);
+}
+
+static const parser_events_t handler_events = {
+    handler_start_object,
+    handler_end_object,
+    handler_start_array,
+    handler_end_array,
+    handler_key,
+    handler_string,
+    handler_number,
+    handler_true,
+    handler_false,
+    handler_null,
+    handler_end_document,
+};
+
+static void
+builder_clear(ruby_json_parser_t *rp) {
+    rb_ary_clear(rp->stack);
+    rp->done = 0;
+}
+
+static VALUE
+jsonista_parser_s_alloc(VALUE klass)
+{
+    VALUE obj;
+    ruby_json_parser_t *tobj;
+    obj = TypedData_Make_Struct(klass, ruby_json_parser_t,
+				&jsonista_parser_data_type, tobj);
+    tobj->stack = Qnil;
+    tobj->handler = Qnil;
+    tobj->src = Qnil;
+    tobj->cache = Qnil;
+    tobj->docs = Qnil;
+    tobj->paths = Qnil;
+    tobj->names = Qnil;
+    tobj->pool = Qnil;
+    tobj->parser = parser_new();
+    tobj->parser->events = &builder_events;
+    tobj->parser->data = tobj;
+    RB_OBJ_WRITE(obj, &tobj->stack, rb_ary_new());
+    return obj;
+}
+
+static ruby_json_parser_t *
+get_jsonista_parser_val(VALUE obj)
+{
+    ruby_json_parser_t *tobj;
+    TypedData_Get_Struct(obj, ruby_json_parser_t, &jsonista_parser_data_type,
+			 tobj);
+    if (!JSONISTA_PARSER_INIT_P(tobj)) {
+	rb_raise(rb_eTypeError, "uninitialized %" PRIsVALUE, rb_obj_class(obj));
+    }
+    return tobj;
+}
+
+static ruby_json_parser_t *
+get_new_jsonista_parser_val(VALUE obj)
+{
+    ruby_json_parser_t *tobj;
+    TypedData_Get_Struct(obj, ruby_json_parser_t, &jsonista_parser_data_type,
+			 tobj);
+    if (JSONISTA_PARSER_INIT_P(tobj)) {
+	rb_raise(rb_eTypeError, "already initialized %" PRIsVALUE,
+		 rb_obj_class(obj));
+    }
+    return tobj;
+}
+
+/* compiles the paths into the filter of the parser */
+static void
+set_paths(VALUE self, ruby_json_parser_t *rp, VALUE paths)
+{
+    filter_t *f;
+    VALUE ary;
+    long i;
+
+    paths = rb_ary_dup(rb_Array(paths));
+    for (i = 0; i < RARRAY_LEN(paths); i++) {
+	VALUE path = RARRAY_AREF(paths, i);
+	StringValue(path);
+	rb_ary_store(paths, i, path);
+    }
+    f = filter_new();
+    ary = rb_ary_new_capa(RARRAY_LEN(paths));
+    for (i = 0; i < RARRAY_LEN(paths); i++) {
+	VALUE path = RARRAY_AREF(paths, i);
+	int n = filter_add(f, RSTRING_PTR(path), RSTRING_LEN(path));
+	if (n < 0) {
+	    filter_free(f);
+	    rb_raise(rb_eArgError, "invalid path or too many paths: %+"PRIsVALUE, path);
+	}
+	/* a duplicate keeps the number of the first; the copy is a plain
+	 * String, as builder_freeze marks the pairs holding it shareable */
+	if (n == RARRAY_LEN(ary)) {
+	    rb_ary_push(ary, rb_str_freeze(rb_enc_str_new(RSTRING_PTR(path), RSTRING_LEN(path), rb_enc_get(path))));
+	}
+    }
+    RB_OBJ_WRITE(self, &rp->paths, rb_ary_freeze(ary));
+    parser_set_filter(rp->parser, f);
+}
+
+struct set_aggregate_args {
+    ruby_json_parser_t *rp;
+    filter_t *filter;
+    VALUE names;
+};
+
+static int
+set_aggregate_i(VALUE name, VALUE spec, VALUE arg)
+{
+    struct set_aggregate_args *a = (struct set_aggregate_args *)arg;
+    VALUE op, path;
+    int i, n;
+
+    spec = rb_Array(spec);
+    if (RARRAY_LEN(spec) != 2) {
+	rb_raise(rb_eArgError, "aggregate %+"PRIsVALUE" is not [op, path]", name);
+    }
+    op = RARRAY_AREF(spec, 0);
+    path = RARRAY_AREF(spec, 1);
+    StringValue(path);
+    for (i = 0; i <= AGGREGATE_DISTINCT; i++) {
+	if (op == ID2SYM(aggregate_ops[i])) break;
+    }
+    if (i > AGGREGATE_DISTINCT) {
+	rb_raise(rb_eArgError, "unknown aggregate: %+"PRIsVALUE, op);
+    }
+    n = filter_add(a->filter, RSTRING_PTR(path), RSTRING_LEN(path));
+    if (n < 0) {
+	rb_raise(rb_eArgError, "invalid path or too many paths: %+"PRIsVALUE, path);
+    }
+    aggregates_add(a->rp->aggregates, (enum aggregate_op)i, n);
+    rb_ary_push(a->names, name);
+    return ST_CONTINUE;
+}
+
+/* compiles the aggregates, {name => [op, path]}, into accumulators fed
+ * by a nested filter */
+static void
+set_aggregate(VALUE self, ruby_json_parser_t *rp, VALUE spec)
+{
+    struct set_aggregate_args a;
+
+    spec = rb_convert_type(spec, T_HASH, "Hash", "to_hash");
+    a.rp = rp;
+    a.filter = filter_new();
+    a.filter->nested = 1;
+    a.names = rb_ary_new_capa(RHASH_SIZE(spec));
+    RB_OBJ_WRITE(self, &rp->names, a.names);
+    rp->aggregates = aggregates_new();
+    rp->parser->events = &aggregate_events;
+    rp->parser->data = rp->aggregates;
+    /* owned by the parser from here on, even if a spec is invalid */
+    parser_set_filter(rp->parser, a.filter);
+    rb_hash_foreach(spec, set_aggregate_i, (VALUE)&a);
+}
+
+/* the values of the aggregates by name */
+static VALUE
+aggregate_result(ruby_json_parser_t *rp)
+{
+    VALUE h = rb_hash_new();
+    long i;
+    for (i = 0; i < RARRAY_LEN(rp->names); i++) {
+	rb_hash_aset(h, RARRAY_AREF(rp->names, i), aggregates_value(rp->aggregates, i));
+    }
+    return h;
+}
+
+/* the value of a max_nesting: option */
+static long
+max_nesting_value(VALUE v)
+{
+    long n;
+    if (!RTEST(v)) return 0;
+    n = NUM2LONG(v);
+    if (n < 1) {
+	rb_raise(rb_eArgError, "max_nesting must be positive: %ld", n);
+    }
+    return n;
+}
+
+/*
+ * @overload new(handler = nil, symbolize_names: false, cache: true, cache_values: false, multi_document: false, paths: nil, aggregate: nil, max_nesting: 100, freeze: false)
+ *   @param handler [Object] receiver of parse events
+ *   @param symbolize_names [Boolean] return object keys as Symbols
+ *   @param cache [Boolean, Jsonista::Cache] cache object keys: true for a
+ *     cache of this parser, or a cache to share such as Cache.global
+ *   @param cache_values [Boolean] return short string values from the
+ *     cache too; they are frozen then
+ *   @param multi_document [Boolean] parse a stream of whitespace-separated
+ *     documents such as newline-delimited JSON
+ *   @param paths [Array<String>] JSON Pointers of the values to extract;
+ *     a "*" segment matches any member or element
+ *   @param aggregate [Hash{Object => Array(Symbol, String)}] aggregates
+ *     to compute instead of building values, by name: [op, path] with
+ *     op one of :count, :sum, :min, :max or :distinct
+ *   @param max_nesting [Integer, false] the depth of nested objects and
+ *     arrays to allow, or false for any; deeper input raises
+ *     Jsonista::NestingError as soon as its bracket is read
+ *   @param freeze [Boolean] return deeply frozen values, which are
+ *     Ractor.shareable? without a traversal of their own
+ *
+ * returns parser object
+ *
+ * Object keys are frozen Strings.  With a cache, repeated keys are the
+ * same deduplicated String and are not allocated again.
+ *
+ * In multi-document mode #parse_chunk and #finish yield each document
+ * completed by the chunk, or return them as an Array without a block;
+ * a partial trailing document is kept for the next chunk.  With a
+ * handler, end_document is called after each document.
+ *
+ * With paths, only the values at the paths are built: #parse_chunk and
+ * #finish yield each as path and value when it is complete, or return
+ * them as an Array of [path, value] pairs, in document order.  Values
+ * off the paths are skipped without being decoded or validated beyond
+ * their brackets and string quotes.  Of nested matches only the
+ * outermost value is returned.  paths can't be used with a handler.
+ *
+ * With aggregate, no values are built at all: #finish returns the Hash of
+ * the aggregates by name, over every document with multi_document, and
+ * #parse_chunk returns nil.  :count counts the values at its path,
+ * :distinct the distinct scalars, with numbers compared by value (1, 1.0
+ * and 1e0 are one); :sum, :min and :max take the numbers at their path
+ * and ignore other values.  Paths may be nested, e.g. to
+ * count records and sum a member of each.  #reset clears the aggregates.
+ *
+ * Without a handler, #parse_chunk builds and returns Ruby values.
+ * With a handler, no values are built; instead these methods of the
+ * handler are called as the input is scanned, and #parse_chunk
+ * returns nil.  Methods the handler does not respond to are skipped.
+ *
+ *   start_object, end_object, start_array, end_array,
+ *   key(str), string(str), number(num),
+ *   true_value, false_value, null_value, end_document
+ */
+static VALUE
+jsonista_parser_initialize(int argc, VALUE *argv, VALUE self)
+{
+    ruby_json_parser_t *tobj;
+    VALUE handler, opts, cache = Qtrue, paths = Qnil, aggregate = Qnil;
+    GetJsonistaParserVal(self, tobj);
+    rb_scan_args(argc, argv, "01:", &handler, &opts);
+    if (!NIL_P(opts)) {
+	ID keys[8];
+	VALUE vals[8];
+	keys[0] = id_symbolize_names;
+	keys[1] = id_cache;
+	keys[2] = id_cache_values;
+	keys[3] = id_multi_document;
+	keys[4] = id_paths;
+	keys[5] = id_aggregate;
+	keys[6] = id_max_nesting;
+	keys[7] = id_freeze;
+	rb_get_kwargs(opts, keys, 0, 8, vals);
+	if (vals[0] != Qundef) tobj->symbolize_names = RTEST(vals[0]);
+	if (vals[1] != Qundef) cache = vals[1];
+	if (vals[2] != Qundef) tobj->cache_values = RTEST(vals[2]);
+	if (vals[3] != Qundef) tobj->parser->multi = RTEST(vals[3]);
+	if (vals[4] != Qundef) paths = vals[4];
+	if (vals[5] != Qundef) aggregate = vals[5];
+	if (vals[6] != Qundef) tobj->parser->max_nesting = max_nesting_value(vals[6]);
+	if (vals[7] != Qundef) tobj->freeze = RTEST(vals[7]);
+    }
+    if (!NIL_P(aggregate)) {
+	if (!NIL_P(handler) || !NIL_P(paths)) {
+	    rb_raise(rb_eArgError, "aggregate can't be used with a handler or paths");
+	}
+	set_aggregate(self, tobj, aggregate);
+    }
+    if (!NIL_P(paths)) {
+	if (!NIL_P(handler)) {
+	    rb_raise(rb_eArgError, "paths can't be used with a handler");
+	}
+	set_paths(self, tobj, paths);
+    }
+    if ((tobj->parser->multi || !NIL_P(paths)) && NIL_P(handler) && NIL_P(aggregate)) {
+	RB_OBJ_WRITE(self, &tobj->docs, rb_ary_new());
+    }
+    if (cache == Qtrue) {
+	cache = cache_new(CACHE_DEFAULT_SIZE);
+    }
+    else if (!RTEST(cache)) {
+	cache = Qnil;
+	tobj->cache_values = 0;
+    }
+    tobj->key_cache = NIL_P(cache) ? NULL : cache_get(cache);
+    RB_OBJ_WRITE(self, &tobj->cache, cache);
+    if (!NIL_P(handler)) {
+	int i;
+	tobj->handler_events = 0;
+	for (i = 0; i < EV_MAX; i++) {
+	    if (rb_respond_to(handler, handler_ids[i])) {
+		tobj->handler_events |= 1U << i;
+	    }
+	}
+	RB_OBJ_WRITE(self, &tobj->handler, handler);
+	tobj->parser->events = &handler_events;
+    }
+    return self;
+}
+
+/*
+ * @overload cache()
+ *
+ * returns the Jsonista::Cache of object keys, or nil
+ */
+static VALUE
+jsonista_parser_cache(VALUE self)
+{
+    ruby_json_parser_t *tobj;
+    GetJsonistaParserVal(self, tobj);
+    return tobj->cache;
+}
+
+/*
+ * @overload stats()
+ *
+ * returns a Hash of counters since the parser was made, over every
+ * document and chunk: :bytes consumed; the tokens read, as :objects,
+ * :arrays, :keys, :strings, :numbers and :literals; :documents
+ * completed; :resumes, the chunks that ended inside a document; the
+ * reallocations of the state stack and of the string buffer, as
+ * :stack_grows and :buffer_grows; and :max_depth, the deepest nesting
+ * of objects and arrays.  Values skipped for paths count as bytes only.
+ */
+static VALUE
+jsonista_parser_stats(VALUE self)
+{
+    ruby_json_parser_t *tobj;
+    parser_stats_t stats;
+    VALUE h = rb_hash_new();
+    GetJsonistaParserVal(self, tobj);
+    parser_stats(tobj->parser, &stats);
+#define STAT(name) rb_hash_aset(h, ID2SYM(rb_intern(#name)), SIZET2NUM(stats.name))
+    STAT(bytes);
+    STAT(objects);
+    STAT(arrays);
+    STAT(keys);
+    STAT(strings);
+    STAT(numbers);
+    STAT(literals);
+    STAT(documents);
+    STAT(resumes);
+    STAT(stack_grows);
+    STAT(buffer_grows);
+    STAT(max_depth);
+#undef STAT
+    return h;
+}
+
+NORETURN(static void parse_error_at(VALUE src, const char *p, const char *e, ptrdiff_t pos));
+NORETURN(static void invalid_error_at(VALUE src, const parser_t *parser, const char *p, const char *e, ptrdiff_t pos));
+NORETURN(static void nesting_error_at(VALUE src, long max_nesting, ptrdiff_t pos));
+
+/*
+ * @overload reset()
+ *
+ * discards the partial document and returns nil
+ */
+static VALUE
+jsonista_parser_reset(VALUE self)
+{
+    ruby_json_parser_t *tobj;
+    GetJsonistaParserVal(self, tobj);
+    parser_init(tobj->parser);
+    builder_clear(tobj);
+    if (!NIL_P(tobj->docs)) rb_ary_clear(tobj->docs);
+    if (tobj->aggregates) aggregates_reset(tobj->aggregates);
+    gzip_reset(tobj->gzip);
+    return Qnil;
+}
+
+/*
+ * Runs the parser over [*pp, e) and returns the document, the documents
+ * completed in multi-document mode, or nil.  The parser consumes all of
+ * [*pp, e) unless it raises: a token cut off by e is kept by the parser.
+ * src is the String holding [s, e) to share string values with, or nil
+ * to copy them; base is the input position of s for errors.
+ */
+static VALUE
+jsonista_parse0(VALUE self, ruby_json_parser_t *rp, VALUE src,
+		const char *s, const char **pp, const char *e, int last,
+		ptrdiff_t base)
+{
+    const char *p = *pp;
+    enum parse_error err;
+    VALUE result, docs = Qnil;
+
+    rp->src = src;
+    if (!NIL_P(src)) {
+	rp->src_ptr = s;
+	rp->src_end = e;
+    }
+    if (last) {
+	err = parser_parse_end(rp->parser, &p, e);
+    }
+    else {
+	err = parser_parse_chunk(rp->parser, &p, e);
+    }
+    rp->src = Qnil;
+    rp->src_ptr = rp->src_end = NULL;
+    *pp = p;
+    if (!NIL_P(rp->docs)) {
+	docs = rp->docs;
+	RB_OBJ_WRITE(self, &rp->docs, rb_ary_new());
+	/* documents before an error are still delivered */
+	if (rb_block_given_p()) {
+	    long i;
+	    for (i = 0; i < RARRAY_LEN(docs); i++) {
+		rb_yield(RARRAY_AREF(docs, i));
+	    }
+	    docs = Qnil;
+	}
+    }
+    switch (err) {
+      case ERR_INVALID:
+	invalid_error_at(src, rp->parser, p, e, base + (p - s));
+	break;
+      case ERR_NESTING:
+	nesting_error_at(src, rp->parser->max_nesting, base + (p - s));
+	break;
+      case ERR_NEEDMORE:
+	if (last) {
+	    parse_error_at(src, e, e, base + (e - s));
+	}
+	return docs;
+      case ERR_EXTRABYTE:
+	parse_error_at(src, p, e, base + (p - s));
+	break;
+      case ERR_SUCCESS:
+	break;
+    }
+    if (rp->aggregates) return last ? aggregate_result(rp) : Qnil;
+    if (rp->parser->multi || rp->parser->filter) return docs;
+    if (!rp->done) return Qnil;
+    result = rb_ary_pop(rp->stack);
+    rp->done = 0;
+    return result;
+}
+
+VALUE
+jsonista_parser_new(VALUE opts)
+{
+    if (NIL_P(opts) || !RHASH_SIZE(opts)) {
+	return rb_class_new_instance(0, 0, cParser);
+    }
+    return rb_class_new_instance_kw(1, &opts, cParser, RB_PASS_KEYWORDS);
+}
+
+VALUE
+jsonista_parser_pool(VALUE self)
+{
+    ruby_json_parser_t *rp;
+    GetJsonistaParserVal(self, rp);
+    return rp->pool;
+}
+
+void
+jsonista_parser_set_pool(VALUE self, VALUE pool)
+{
+    ruby_json_parser_t *rp;
+    GetJsonistaParserVal(self, rp);
+    RB_OBJ_WRITE(self, &rp->pool, pool);
+}
+
+void
+jsonista_parser_recycle(VALUE self, size_t max_retained)
+{
+    ruby_json_parser_t *rp;
+    GetJsonistaParserVal(self, rp);
+    jsonista_parser_reset(self);
+    /* the read buffer and the gzip window have a fixed size and are kept
+     * for the next use, like the arena; only growth counts */
+    if (jsonista_parser_memsize(rp) - rp->iobuf_capa - gzip_memsize(rp->gzip) > max_retained) {
+	parser_trim(rp->parser);
+    }
+}
+
+VALUE
+jsonista_parse_value(VALUE self, VALUE src, const char *p, const char *e)
+{
+    ruby_json_parser_t *rp;
+    GetJsonistaParserVal(self, rp);
+    parser_init(rp->parser);
+    builder_clear(rp);
+    return jsonista_parse0(self, rp, src, RSTRING_PTR(src), &p, e, 1, 0);
+}
+
+VALUE
+jsonista_parse_key(VALUE self, VALUE src, const char *p, const char *e)
+{
+    ruby_json_parser_t *rp;
+    VALUE str, key;
+    GetJsonistaParserVal(self, rp);
+    if (!memchr(p + 1, '\\', e - p - 2)) {
+	return jsonista_key_new(rp, p + 1, e - p - 2);
+    }
+    str = jsonista_parse_value(self, src, p, e);
+    key = jsonista_key_new(rp, RSTRING_PTR(str), RSTRING_LEN(str));
+    RB_GC_GUARD(str);
+    return key;
+}
+
+/* adds the result of one jsonista_parse0 call to those before */
+static VALUE
+parse_result_merge(ruby_json_parser_t *rp, VALUE acc, VALUE result)
+{
+    if (NIL_P(result)) return acc;
+    if ((rp->parser->multi || rp->parser->filter) && !NIL_P(acc)) {
+	return rb_ary_concat(acc, result);
+    }
+    return result;
+}
+
+static VALUE
+parse_result_end(ruby_json_parser_t *rp, VALUE acc)
+{
+    if (NIL_P(acc) && !NIL_P(rp->docs) && !rb_block_given_p()) {
+	return rb_ary_new();
+    }
+    return acc;
+}
+
+static VALUE
+jsonista_parse(VALUE self, VALUE str, int last)
+{
+    ruby_json_parser_t *rp;
+    const char *p, *e;
+    VALUE result;
+
+    GetJsonistaParserVal(self, rp);
+    if (NIL_P(str)) {
+	str = rb_str_new(0, 0);
+    }
+    p = RSTRING_PTR(str);
+    e = RSTRING_END(str);
+    /* error positions count from the first chunk */
+    result = jsonista_parse0(self, rp, str, p, &p, e, last,
+			     (ptrdiff_t)rp->parser->offset);
+    RB_GC_GUARD(str);
+    return result;
+}
+
+#ifdef HAVE_LIBZ
+static gzip_t *
+gzip_get(ruby_json_parser_t *rp)
+{
+    gzip_t *gz = rp->gzip;
+    int ret;
+    if (gz) return gz;
+    gz = ZALLOC(gzip_t);
+    /* +32: a gzip or a zlib header, whichever comes */
+    ret = inflateInit2(&gz->zs, MAX_WBITS + 32);
+    if (ret != Z_OK) {
+	xfree(gz);
+	if (ret == Z_MEM_ERROR) rb_memerror();
+	rb_raise(rb_eRuntimeError, "inflateInit2 failed: %d", ret);
+    }
+    gz->member_end = 1;
+    return rp->gzip = gz;
+}
+
+NORETURN(static void gzip_error(gzip_t *gz, const char *msg));
+static void
+gzip_error(gzip_t *gz, const char *msg)
+{
+    VALUE argv[3];
+    argv[0] = rb_sprintf("%s at %"PRIuSIZE" of the gzip input", msg, gz->in_pos);
+    argv[1] = Qnil;
+    argv[2] = SIZET2NUM(gz->in_pos);
+    rb_exc_raise(rb_class_new_instance(3, argv, eParseError));
+}
+
+/*
+ * Inflates [s, e) into the window of the parser and runs the parser over
+ * each window full while it is in cache; returns the results as
+ * parse_io does.  With last, the input ends with e, which must end a
+ * gzip member.  Concatenated members are one stream, as for gzip(1).
+ */
+static VALUE
+gzip_parse(VALUE self, ruby_json_parser_t *rp, const char *s, const char *e, int last)
+{
+    gzip_t *gz = gzip_get(rp);
+    z_stream *zs = &gz->zs;
+    VALUE acc = Qnil;
+    int more;
+
+    zs->next_in = (Bytef *)s;
+    do {
+	const char *b = gz->buf, *p = b;
+	size_t in = e - (const char *)zs->next_in;
+	int pending = 0, fin;
+
+	if (in && gz->member_end) {
+	    inflateReset(zs);
+	    gz->member_end = 0;
+	    gz->started = 1;
+	}
+	if (!gz->member_end && gz->len < GZIP_WINDOW) {
+	    const Bytef *q = zs->next_in;
+	    int ret;
+	    zs->avail_in = in > UINT_MAX ? UINT_MAX : (uInt)in;
+	    zs->next_out = (Bytef *)gz->buf + gz->len;
+	    zs->avail_out = (uInt)(GZIP_WINDOW - gz->len);
+	    ret = inflate(zs, Z_NO_FLUSH);
+	    gz->in_pos += zs->next_in - q;
+	    switch (ret) {
+	      case Z_STREAM_END:
+		gz->member_end = 1;
+		break;
+	      case Z_OK:
+	      case Z_BUF_ERROR: /* no progress possible until more input */
+		/* a full window may have more output to come */
+		pending = zs->avail_out == 0;
+		break;
+	      case Z_MEM_ERROR:
+		rb_memerror();
+		break;
+	      default:
+		gzip_error(gz, zs->msg ? zs->msg : "invalid gzip data");
+	    }
+	    gz->len = GZIP_WINDOW - zs->avail_out;
+	}
+	more = (const char *)zs->next_in < e || pending;
+	fin = last && !more;
+	if (fin && !gz->member_end) gzip_error(gz, "unexpected end");
+	if (!gz->len && !fin) continue;
+	acc = parse_result_merge(rp, acc,
+		jsonista_parse0(self, rp, Qnil, b, &p, b + gz->len, fin, gz->pos));
+	gz->pos += p - b;
+	gz->len -= p - b;
+	memmove(gz->buf, p, gz->len);
+    } while (more);
+    return acc;
+}
+#endif
+
+/*
+ * @overload parse_chunk(str)
+ *   @param str [String] full or partial JSON string
+ *
+ * returns the parsed document when its top-level value is complete,
+ * nil if more input is needed
+ *
+ * @overload parse_chunk(str) { |doc| ... }
+ *
+ * in multi-document mode, yields each document completed by str
+ */
+static VALUE
+jsonista_parser_parse_chunk(VALUE self, VALUE str)
+{
+    StringValue(str);
+    return jsonista_parse(self, str, 0);
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * @overload parse_gzip_chunk(str)
+ *   @param str [String] part of a gzip or zlib compressed JSON stream
+ *
+ * inflates str and parses the JSON as #parse_chunk does; #finish then
+ * takes the last compressed part, if any, and raises ParseError if the
+ * stream is cut short
+ *
+ * The inflated JSON is never held whole: it is parsed as it comes out of
+ * zlib, in windows of 64KB kept by the parser, so compressed input of any
+ * size parses in constant memory.  Error positions are those of the
+ * inflated JSON.  Concatenated gzip members are read as one stream.
+ */
+static VALUE
+jsonista_parser_parse_gzip_chunk(VALUE self, VALUE str)
+{
+    ruby_json_parser_t *rp;
+    VALUE result;
+    StringValue(str);
+    GetJsonistaParserVal(self, rp);
+    str = rb_str_new_frozen(str);
+    result = gzip_parse(self, rp, RSTRING_PTR(str), RSTRING_END(str), 0);
+    RB_GC_GUARD(str);
+    return parse_result_end(rp, result);
 }
+#endif
 
-static size_t
-jsonista_parser_memsize(const void *parser) {
-    return parser_memsize((void *)parser);
+/*
+ * @overload finish(str = nil)
+ *   @param str [String] last part of JSON string
+ *
+ * signals the end of input and returns the parsed document;
+ * a top-level number is only complete at the end of input
+ *
+ * in multi-document mode, yields or returns the remaining documents
+ * as #parse_chunk does
+ *
+ * after #parse_gzip_chunk, str is compressed too
+ */
+static VALUE
+jsonista_parser_finish(int argc, VALUE *argv, VALUE self)
+{
+    VALUE str = Qnil;
+#ifdef HAVE_LIBZ
+    ruby_json_parser_t *rp;
+#endif
+    if (rb_scan_args(argc, argv, "01", &str) && !NIL_P(str)) {
+	StringValue(str);
+    }
+#ifdef HAVE_LIBZ
+    GetJsonistaParserVal(self, rp);
+    if (rp->gzip && rp->gzip->started) {
+	VALUE result;
+	if (NIL_P(str)) str = rb_str_new(0, 0);
+	str = rb_str_new_frozen(str);
+	result = gzip_parse(self, rp, RSTRING_PTR(str), RSTRING_END(str), 1);
+	RB_GC_GUARD(str);
+	return parse_result_end(rp, result);
+    }
+#endif
+    return jsonista_parse(self, str, 1);
 }
 
-static const rb_data_type_t jsonista_parser_data_type = {
-    "jsonista_parser",
-    {
-	NULL, jsonista_parser_free, jsonista_parser_memsize,
-    },
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-    0,
-    0,
-    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
-#endif
+struct validate_args {
+    parser_t *parser;
+    const char *p, *e;
+    int last;
+    enum parse_error err;
+    volatile int interrupted;
 };
 
-static VALUE
-jsonista_parser_s_alloc(VALUE klass)
+/* validates in windows so that an interrupt is noticed in time */
+static void *
+validate_nogvl(void *ptr)
 {
-    VALUE obj;
-    parser_t *tobj;
-    obj = TypedData_Make_Struct(klass, parser_t,
-				&jsonista_parser_data_type, tobj);
-    parser_init(tobj);
-    return obj;
+    struct validate_args *a = ptr;
+    const char *p = a->p, *e = a->e;
+    enum parse_error err;
+
+    for (;;) {
+	/* a window ending in a token consumes it too */
+	const char *we = (size_t)(e - p) > VALIDATE_WINDOW ? p + VALIDATE_WINDOW : e;
+	if (we == e && a->last) {
+	    err = parser_validate_end(a->parser, &p, we);
+	}
+	else {
+	    err = parser_validate_chunk(a->parser, &p, we);
+	}
+	if (err != ERR_NEEDMORE || we == e || a->interrupted) break;
+    }
+    a->p = p;
+    a->err = err;
+    return NULL;
 }
 
-static parser_t *
-get_jsonista_parser_val(VALUE obj)
+/* unblocks the loops without the GVL, which poll the flag at ptr */
+static void
+interrupt_ubf(void *ptr)
 {
-    parser_t *tobj;
-    TypedData_Get_Struct(obj, parser_t, &jsonista_parser_data_type,
-			 tobj);
-    if (!JSONISTA_PARSER_INIT_P(tobj)) {
-	rb_raise(rb_eTypeError, "uninitialized %" PRIsVALUE, rb_obj_class(obj));
+    *(volatile int *)ptr = 1;
+}
+
+/*
+ * validates [*pp, e), without the GVL if it is long; on ERR_NEEDMORE *pp
+ * is e.  [*pp, e) must not change meanwhile.
+ */
+static enum parse_error
+validate(parser_t *parser, const char **pp, const char *e, int last)
+{
+    struct validate_args a;
+
+    if (e - *pp < VALIDATE_NOGVL_MIN) {
+	return last ? parser_validate_end(parser, pp, e)
+		    : parser_validate_chunk(parser, pp, e);
     }
-    return tobj;
+    a.parser = parser;
+    a.p = *pp;
+    a.e = e;
+    a.last = last;
+    for (;;) {
+	a.interrupted = 0;
+	rb_thread_call_without_gvl(validate_nogvl, &a, interrupt_ubf, (void *)&a.interrupted);
+	if (!a.interrupted || a.err != ERR_NEEDMORE || a.p == e) break;
+	rb_thread_check_ints();
+    }
+    *pp = a.p;
+    return a.err;
 }
 
-static parser_t *
-get_new_jsonista_parser_val(VALUE obj)
+static VALUE
+jsonista_validate(VALUE self, VALUE str, int last)
 {
-    parser_t *tobj;
-    TypedData_Get_Struct(obj, parser_t, &jsonista_parser_data_type,
-			 tobj);
-    if (JSONISTA_PARSER_INIT_P(tobj)) {
-	rb_raise(rb_eTypeError, "already initialized %" PRIsVALUE,
-		 rb_obj_class(obj));
+    ruby_json_parser_t *rp;
+    const char *s, *p, *e;
+    enum parse_error err;
+    ptrdiff_t base;
+
+    GetJsonistaParserVal(self, rp);
+    if (NIL_P(str)) {
+	str = rb_str_new(0, 0);
     }
-    return tobj;
+    else {
+	/* keeps the bytes while the GVL is released */
+	str = rb_str_new_frozen(str);
+    }
+    s = p = RSTRING_PTR(str);
+    e = RSTRING_END(str);
+    base = (ptrdiff_t)rp->parser->offset;
+    err = validate(rp->parser, &p, e, last);
+    switch (err) {
+      case ERR_INVALID:
+	invalid_error_at(str, rp->parser, p, e, base + (p - s));
+	break;
+      case ERR_EXTRABYTE:
+	parse_error_at(str, p, e, base + (p - s));
+	break;
+      case ERR_NESTING:
+	nesting_error_at(str, rp->parser->max_nesting, base + (p - s));
+	break;
+      case ERR_NEEDMORE:
+	if (last) {
+	    parse_error_at(str, e, e, base + (e - s));
+	}
+	return Qfalse;
+      case ERR_SUCCESS:
+	break;
+    }
+    RB_GC_GUARD(str);
+    return Qtrue;
 }
 
 /*
- * @overload new()
+ * @overload validate_chunk(str)
+ *   @param str [String] full or partial JSON string
  *
- * returns parser object
+ * checks the syntax of the input without building any value; returns
+ * true when the document is complete, false if more input is needed,
+ * and raises ParseError if the input is invalid.
+ *
+ * Long inputs are checked without the GVL, so that other threads keep
+ * running meanwhile.  Don't mix validate_chunk and parse_chunk within a
+ * document.
  */
 static VALUE
-jsonista_parser_initialize(VALUE self)
+jsonista_parser_validate_chunk(VALUE self, VALUE str)
 {
-    parser_t *tobj;
-    TypedData_Get_Struct(self, parser_t, &jsonista_parser_data_type, tobj);
-    return self;
+    StringValue(str);
+    return jsonista_validate(self, str, 0);
 }
 
-static void parse_error_src_pos(VALUE src, ptrdiff_t pos);
 /*
- * @overload parser_chunk(str)
- *   @param str [String] full or partial JSON string
+ * @overload validate_finish(str = nil)
+ *   @param str [String] last part of JSON string
  *
- * returns nil
+ * signals the end of input to validate_chunk; returns true or raises
+ * ParseError
  */
 static VALUE
-jsonista_parser_reset(VALUE self)
+jsonista_parser_validate_finish(int argc, VALUE *argv, VALUE self)
+{
+    VALUE str = Qnil;
+    if (rb_scan_args(argc, argv, "01", &str) && !NIL_P(str)) {
+	StringValue(str);
+    }
+    return jsonista_validate(self, str, 1);
+}
+
+struct valid_p_args {
+    parser_t *parser;
+    const char *p, *e;
+    int nthreads;
+    int valid;
+    volatile int interrupted;
+};
+
+/* both stages stop early on an interrupt, leaving valid meaningless */
+static void *
+validate_index_nogvl(void *ptr)
+{
+    struct valid_p_args *a = ptr;
+    index_t idx;
+    const char *p = a->p;
+    const char *error = index_build(&idx, p, a->e, a->nthreads, &a->interrupted);
+    a->valid = !error && !INDEX_INTERRUPTED(&idx) &&
+	parser_validate_index(a->parser, &idx, &p, a->e) == ERR_SUCCESS;
+    index_free(&idx);
+    return NULL;
+}
+
+static VALUE
+valid_p_body(VALUE ptr)
+{
+    struct valid_p_args *a = (struct valid_p_args *)ptr;
+    if (a->nthreads) {
+	for (;;) {
+	    a->interrupted = 0;
+	    rb_thread_call_without_gvl(validate_index_nogvl, a, interrupt_ubf,
+				       (void *)&a->interrupted);
+	    if (!a->interrupted) break;
+	    /* raises a pending exception, or validates again */
+	    rb_thread_check_ints();
+	}
+	return a->valid ? Qtrue : Qfalse;
+    }
+    return validate(a->parser, &a->p, a->e, 1) == ERR_SUCCESS ? Qtrue : Qfalse;
+}
+
+static VALUE
+valid_p_ensure(VALUE ptr)
 {
-    parser_t *tobj;
-    TypedData_Get_Struct(self, parser_t, &jsonista_parser_data_type, tobj);
-    parser_init(tobj);
+    parser_free((parser_t *)ptr);
     return Qnil;
 }
 
-struct {
-} ruby_json_parser_t;
+/* the value of a threads: option; 0 if not given */
+static int
+threads_num(VALUE v)
+{
+    int n;
+    if (v == Qundef || NIL_P(v)) return 0;
+    n = NUM2INT(v);
+    if (n < 1 || n > 64) {
+	rb_raise(rb_eArgError, "threads must be 1..64: %d", n);
+    }
+    return n;
+}
 
 /*
- * @overload parser_chunk(str)
- *   @param str [String] full or partial JSON string
+ * @overload valid?(str, threads: nil, max_nesting: 100)
+ *   @param str [String] JSON string
+ *   @param threads [Integer] validate in the two-stage mode on this many
+ *     native threads (see Jsonista.parse)
+ *   @param max_nesting [Integer, false] as for Parser.new
  *
- * returns nil
+ * returns true if str is exactly one well-formed JSON document.
+ * No Ruby objects are created, and long inputs are checked without the
+ * GVL.
  */
 static VALUE
-jsonista_parser_parse_chunk(VALUE self, VALUE str)
+jsonista_s_valid_p(int argc, VALUE *argv, VALUE mod)
 {
-    parser_t *parser;
-    const char *s, *p, *e;
-    enum parse_error err;
+    struct valid_p_args a;
+    VALUE str, opts, result;
+    long max_nesting = PARSER_MAX_NESTING;
 
-    TypedData_Get_Struct(self, parser_t, &jsonista_parser_data_type, parser);
+    rb_scan_args(argc, argv, "1:", &str, &opts);
     StringValue(str);
-    s = p = RSTRING_PTR(str);
-    e = RSTRING_END(str);
-    err = parser_parse_chunk(parser, &p, e);
+    a.nthreads = 0;
+    if (!NIL_P(opts)) {
+	ID keys[2];
+	VALUE vals[2];
+	keys[0] = id_threads;
+	keys[1] = id_max_nesting;
+	rb_get_kwargs(opts, keys, 0, 2, vals);
+	a.nthreads = threads_num(vals[0]);
+	if (vals[1] != Qundef) max_nesting = max_nesting_value(vals[1]);
+    }
+    str = rb_str_new_frozen(str);
+    a.parser = parser_new();
+    a.parser->max_nesting = max_nesting;
+    a.p = RSTRING_PTR(str);
+    a.e = RSTRING_END(str);
+    result = rb_ensure(valid_p_body, (VALUE)&a, valid_p_ensure, (VALUE)a.parser);
+    RB_GC_GUARD(str);
+    return result;
+}
+
+struct parse_index_args {
+    VALUE self;
+    VALUE str;
+    index_t idx;
+    const char *s, *e, *error;
+    int nthreads;
+    volatile int interrupted;
+};
+
+static void *
+index_build_nogvl(void *ptr)
+{
+    struct parse_index_args *a = ptr;
+    a->error = index_build(&a->idx, a->s, a->e, a->nthreads, &a->interrupted);
+    return NULL;
+}
+
+static VALUE
+parse_index_body(VALUE ptr)
+{
+    struct parse_index_args *a = (struct parse_index_args *)ptr;
+    ruby_json_parser_t *rp;
+    const char *p = a->s;
+    enum parse_error err;
+    VALUE result;
+
+    GetJsonistaParserVal(a->self, rp);
+    for (;;) {
+	a->interrupted = 0;
+	rb_thread_call_without_gvl(index_build_nogvl, a, interrupt_ubf,
+				   (void *)&a->interrupted);
+	if (!a->interrupted) break;
+	/* raises a pending exception, or builds the index again */
+	rb_thread_check_ints();
+	index_free(&a->idx);
+    }
+    rp->src = a->str;
+    rp->src_ptr = a->s;
+    rp->src_end = a->e;
+    err = parser_parse_index(rp->parser, &a->idx, &p, a->e);
+    rp->src = Qnil;
+    rp->src_ptr = rp->src_end = NULL;
     switch (err) {
       case ERR_INVALID:
-	parse_error_src_pos(str, p - s);
+      case ERR_EXTRABYTE:
+	parse_error_at(a->str, p, a->e, p - a->s);
+	break;
+      case ERR_NESTING:
+	nesting_error_at(a->str, rp->parser->max_nesting, p - a->s);
 	break;
       case ERR_NEEDMORE:
       case ERR_SUCCESS:
-      case ERR_EXTRABYTE:
+	if (a->error) {
+	    parse_error_at(a->str, a->error, a->e, a->error - a->s);
+	}
+	if (err == ERR_NEEDMORE) {
+	    parse_error_at(a->str, a->e, a->e, a->e - a->s);
+	}
 	break;
     }
+    if (!rp->done) return Qnil;
+    result = rb_ary_pop(rp->stack);
+    rp->done = 0;
+    return result;
+}
+
+static VALUE
+parse_index_ensure(VALUE ptr)
+{
+    struct parse_index_args *a = (struct parse_index_args *)ptr;
+    index_free(&a->idx);
+    return Qnil;
+}
+
+/*
+ * @overload parse(str, threads: nil, **opts)
+ *   @param str [String] a whole JSON document
+ *   @param threads [Integer] use the two-stage mode on this many native
+ *     threads
+ *   @param opts [Hash] options of Parser.new
+ *
+ * returns the parsed document.
+ *
+ * In the two-stage mode, stage 1 splits the input into blocks and finds
+ * the structural characters, quotes and string contents of each block in
+ * parallel, outside the GVL, then resolves which blocks start inside a
+ * string; stage 2 walks the resulting index to build the values.  It
+ * pays off for documents of many megabytes.
+ */
+static VALUE
+jsonista_s_parse(int argc, VALUE *argv, VALUE mod)
+{
+    struct parse_index_args a;
+    VALUE str, opts, parser;
+    ruby_json_parser_t *rp;
+
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+    StringValue(str);
+    a.nthreads = 0;
+    if (!NIL_P(opts)) {
+	opts = rb_hash_dup(opts);
+	a.nthreads = threads_num(rb_hash_delete(opts, ID2SYM(id_threads)));
+    }
+    parser = jsonista_parser_new(opts);
+    if (!a.nthreads) {
+	return jsonista_parse(parser, str, 1);
+    }
+    GetJsonistaParserVal(parser, rp);
+    if (rp->parser->multi) {
+	rb_raise(rb_eArgError, "threads can't be used with multi_document");
+    }
+    if (rp->parser->filter) {
+	rb_raise(rb_eArgError, "threads can't be used with paths or aggregate");
+    }
+    a.self = parser;
+    a.str = rb_str_new_frozen(str);
+    a.s = RSTRING_PTR(a.str);
+    a.e = RSTRING_END(a.str);
+    a.error = NULL;
+    a.idx.blocks = NULL;
+    a.idx.nblocks = 0;
+    return rb_ensure(parse_index_body, (VALUE)&a, parse_index_ensure, (VALUE)&a);
+}
+
+static int
+io_descriptor(VALUE io)
+{
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    return rb_io_descriptor(io);
+#else
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    return fptr->fd;
+#endif
+}
+
+struct io_pread_args {
+    int fd;
+    char *buf;
+    size_t len;
+    off_t off;
+    ssize_t ret;
+    int err;
+};
+
+static void *
+io_pread_nogvl(void *ptr)
+{
+    struct io_pread_args *a = ptr;
+    a->ret = pread(a->fd, a->buf, a->len, a->off);
+    a->err = errno;
+    return NULL;
+}
+
+static size_t
+io_pread(int fd, char *buf, size_t len, off_t off)
+{
+    struct io_pread_args a;
+    a.fd = fd;
+    a.buf = buf;
+    a.len = len;
+    a.off = off;
+    for (;;) {
+	rb_thread_call_without_gvl(io_pread_nogvl, &a, RUBY_UBF_IO, NULL);
+	if (a.ret >= 0) return (size_t)a.ret;
+	if (a.err != EINTR) rb_syserr_fail(a.err, "pread");
+	rb_thread_check_ints();
+    }
+}
+
+static VALUE
+io_readpartial(VALUE ptr)
+{
+    VALUE *argv = (VALUE *)ptr;
+    return rb_funcallv(argv[0], id_readpartial, 2, argv + 1);
+}
+
+static VALUE
+io_eof(VALUE arg, VALUE exc)
+{
+    return Qnil;
+}
+
+/*
+ * @overload parse_io(io)
+ *   @param io [IO] input to read until its end
+ *
+ * reads io to its end and returns the parsed document, as #finish does
+ * for the rest of the input.
+ *
+ * The input is read into a buffer kept by the parser, not into Strings:
+ * regular files with pread(2) outside the GVL, other IO-like objects
+ * with readpartial into one reused String.
+ */
+static VALUE
+jsonista_parser_parse_io(VALUE self, VALUE io)
+{
+    ruby_json_parser_t *rp;
+    VALUE acc = Qnil, argv[3];
+    int fd = -1;
+    off_t off = 0;
+    ptrdiff_t base = 0;
+
+    GetJsonistaParserVal(self, rp);
+    if (RB_TYPE_P(io, T_FILE)) {
+	struct stat st;
+	int d = io_descriptor(io);
+	if (fstat(d, &st) == 0 && S_ISREG(st.st_mode)) {
+	    fd = d;
+	    /* tell accounts for bytes buffered by the IO */
+	    off = NUM2OFFT(rb_funcall(io, id_tell, 0));
+	}
+    }
+    if (!rp->iobuf) {
+	rp->iobuf = ALLOC_N(char, IO_BUFSIZE);
+	rp->iobuf_capa = IO_BUFSIZE;
+    }
+    argv[0] = io;
+    argv[2] = Qnil;
+    for (;;) {
+	const char *s, *p;
+	size_t n;
+
+	if (fd >= 0) {
+	    n = io_pread(fd, rp->iobuf, rp->iobuf_capa, off);
+	    off += n;
+	}
+	else {
+	    if (NIL_P(argv[2])) argv[2] = rb_str_buf_new(IO_BUFSIZE);
+	    argv[1] = SIZET2NUM(rp->iobuf_capa);
+	    if (NIL_P(rb_rescue2(io_readpartial, (VALUE)argv, io_eof, Qnil,
+				 rb_eEOFError, (VALUE)0))) {
+		n = 0;
+	    }
+	    else {
+		n = RSTRING_LEN(argv[2]);
+		memcpy(rp->iobuf, RSTRING_PTR(argv[2]), n);
+	    }
+	}
+	s = p = rp->iobuf;
+	/* a token the buffer ends in is kept by the parser */
+	acc = parse_result_merge(rp, acc,
+		jsonista_parse0(self, rp, Qnil, s, &p, s + n, n == 0, base));
+	if (n == 0) break;
+	base += n;
+    }
+    if (fd >= 0) {
+	rb_funcall(io, id_seek, 1, OFFT2NUM(off));
+    }
+    RB_GC_GUARD(argv[2]);
+    return parse_result_end(rp, acc);
+}
+
+struct load_file_args {
+    VALUE parser;
+    VALUE io;
+    char *map;
+    size_t size;
+    int gzip;
+};
+
+#ifdef HAVE_LIBZ
+/* reads a compressed file into the read buffer and inflates it from there */
+static VALUE
+load_gzip(VALUE self, ruby_json_parser_t *rp, int fd)
+{
+    VALUE acc = Qnil;
+    off_t off = 0;
+    size_t n;
+
+    if (!rp->iobuf) {
+	rp->iobuf = ALLOC_N(char, IO_BUFSIZE);
+	rp->iobuf_capa = IO_BUFSIZE;
+    }
+    do {
+	n = io_pread(fd, rp->iobuf, rp->iobuf_capa, off);
+	off += n;
+	acc = parse_result_merge(rp, acc,
+		gzip_parse(self, rp, rp->iobuf, rp->iobuf + n, n == 0));
+    } while (n);
+    return parse_result_end(rp, acc);
+}
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+/* parses a mapped file in windows, dropping the pages behind */
+static VALUE
+load_mapped(VALUE self, ruby_json_parser_t *rp, const char *s, const char *e)
+{
+    static size_t pagesize;
+    const char *p = s, *dropped = s;
+    VALUE acc = Qnil;
+
+    if (!pagesize) pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    for (;;) {
+	const char *we = (size_t)(e - p) > MMAP_WINDOW ? p + MMAP_WINDOW : e;
+	acc = parse_result_merge(rp, acc,
+		jsonista_parse0(self, rp, Qnil, s, &p, we, we == e, 0));
+	if (we == e) break;
+#ifdef MADV_DONTNEED
+	{
+	    const char *d = s + ((size_t)(p - s) & ~(pagesize - 1));
+	    if (d > dropped) {
+		madvise((void *)dropped, d - dropped, MADV_DONTNEED);
+		dropped = d;
+	    }
+	}
+#endif
+    }
+    return parse_result_end(rp, acc);
+}
+#endif
+
+static VALUE
+load_file_body(VALUE ptr)
+{
+    struct load_file_args *args = (struct load_file_args *)ptr;
+#ifdef HAVE_SYS_MMAN_H
+    struct stat st;
+#endif
+    int fd = io_descriptor(args->io);
+#ifdef HAVE_LIBZ
+    if (args->gzip) {
+	ruby_json_parser_t *rp;
+	GetJsonistaParserVal(args->parser, rp);
+	return load_gzip(args->parser, rp, fd);
+    }
+#endif
+#ifdef HAVE_SYS_MMAN_H
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	(size_t)st.st_size == (uint64_t)st.st_size) {
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED) {
+	    ruby_json_parser_t *rp;
+	    args->map = map;
+	    args->size = st.st_size;
+#ifdef MADV_SEQUENTIAL
+	    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+	    GetJsonistaParserVal(args->parser, rp);
+	    return load_mapped(args->parser, rp, args->map,
+			       args->map + args->size);
+	}
+    }
+#endif
+    return jsonista_parser_parse_io(args->parser, args->io);
+}
+
+static VALUE
+load_file_ensure(VALUE ptr)
+{
+    struct load_file_args *args = (struct load_file_args *)ptr;
+#ifdef HAVE_SYS_MMAN_H
+    if (args->map) munmap(args->map, args->size);
+#endif
+    rb_io_close(args->io);
     return Qnil;
 }
 
+/*
+ * @overload load_file(path, compression: nil, **opts)
+ *   @param path [String] path of a JSON file
+ *   @param compression [Symbol, nil] :gzip for a gzip or zlib compressed
+ *     file
+ *   @param opts [Hash] options of Parser.new
+ *
+ * returns the parsed document of a file; with multi_document: true,
+ * yields or returns the documents as Parser#finish does.
+ *
+ * The file is memory-mapped and parsed in place, in sequential order;
+ * the pages parsed are dropped from the mapping as it goes, so memory
+ * use does not grow with the file size.  Where mmap is not available
+ * the file is read with Parser#parse_io.
+ *
+ * A compressed file is read in blocks and inflated in windows as with
+ * Parser#parse_gzip_chunk, also in constant memory.
+ */
+static VALUE
+jsonista_s_load_file(int argc, VALUE *argv, VALUE mod)
+{
+    VALUE path, opts;
+    struct load_file_args args;
+
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    FilePathValue(path);
+    args.gzip = 0;
+    if (!NIL_P(opts)) {
+	VALUE compression;
+	opts = rb_hash_dup(opts);
+	compression = rb_hash_delete(opts, ID2SYM(id_compression));
+	if (compression == ID2SYM(id_gzip)) {
+#ifndef HAVE_LIBZ
+	    rb_raise(rb_eNotImpError, "jsonista was built without zlib");
+#endif
+	    args.gzip = 1;
+	}
+	else if (!NIL_P(compression)) {
+	    rb_raise(rb_eArgError, "unknown compression: %+"PRIsVALUE, compression);
+	}
+    }
+    args.parser = jsonista_parser_new(opts);
+    args.io = rb_file_open_str(path, "rb");
+    args.map = NULL;
+    args.size = 0;
+    return rb_ensure(load_file_body, (VALUE)&args, load_file_ensure, (VALUE)&args);
+}
+
+/* raises ParseError for the byte at p, or for the end of input if p == e */
 static void
-parse_error_src_pos(VALUE src, ptrdiff_t pos)
+parse_error_at(VALUE src, const char *p, const char *e, ptrdiff_t pos)
 {
     VALUE exc, argv[3];
-    const char *s = RSTRING_PTR(src);
-    const char *p = s + pos;
-    argv[0] = rb_sprintf("unexpected byte '%c' at %zd", *p, p - s);
+    if (p < e) {
+	argv[0] = rb_sprintf("unexpected byte '%c' at %"PRIdPTRDIFF, *p, pos);
+    }
+    else {
+	argv[0] = rb_sprintf("unexpected end of input at %"PRIdPTRDIFF, pos);
+    }
     argv[1] = src;
-    argv[2] = pos;
+    argv[2] = LONG2NUM(pos);
     exc = rb_class_new_instance(3, argv, eParseError);
     rb_exc_raise(exc);
 }
 
+/*
+ * raises ParseError for the ERR_INVALID the parser stopped at p with, p
+ * being at pos: a literal begun in an earlier chunk is reported at its
+ * first byte, before p
+ */
+static void
+invalid_error_at(VALUE src, const parser_t *parser, const char *p, const char *e, ptrdiff_t pos)
+{
+    size_t back = parser->offset - parser->error_pos;
+    if (back) {
+	parse_error_at(src, parser->literal, parser->literal + 1, pos - (ptrdiff_t)back);
+    }
+    parse_error_at(src, p, e, pos);
+}
+
+void
+jsonista_parse_error(VALUE src, const char *p, const char *e, ptrdiff_t pos)
+{
+    parse_error_at(src, p, e, pos);
+}
+
+/* raises NestingError for the bracket at pos */
+static void
+nesting_error_at(VALUE src, long max_nesting, ptrdiff_t pos)
+{
+    VALUE exc, argv[3];
+    argv[0] = rb_sprintf("nesting of %ld is too deep at %"PRIdPTRDIFF, max_nesting + 1, pos);
+    argv[1] = src;
+    argv[2] = LONG2NUM(pos);
+    exc = rb_class_new_instance(3, argv, eNestingError);
+    rb_exc_raise(exc);
+}
+
+void
+jsonista_nesting_error(VALUE src, long max_nesting, ptrdiff_t pos)
+{
+    nesting_error_at(src, max_nesting, pos);
+}
+
+long
+jsonista_parser_max_nesting(VALUE self)
+{
+    ruby_json_parser_t *rp;
+    GetJsonistaParserVal(self, rp);
+    return rp->parser->max_nesting;
+}
+
 /*
  * call-seq:
  *   Jsonista::ParseError.new(msg, src, pos)  -> parse_error
@@ -188,15 +1910,68 @@ parse_err_pos(VALUE self)
 void
 Init_jsonista(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    /* the Cache.global and the spare dump buffer are per Ractor */
+    rb_ext_ractor_safe(true);
+#endif
+    scan_init();
+
     mJsonista = rb_define_module("Jsonista");
+    rb_define_module_function(mJsonista, "load_file", jsonista_s_load_file, -1);
+    rb_define_module_function(mJsonista, "parse", jsonista_s_parse, -1);
+    rb_define_module_function(mJsonista, "valid?", jsonista_s_valid_p, -1);
     cParser = rb_define_class_under(mJsonista, "Parser", rb_cObject);
     rb_define_alloc_func(cParser, jsonista_parser_s_alloc);
-    rb_define_method(cParser, "initialize", jsonista_parser_initialize, 0);
+    rb_define_method(cParser, "initialize", jsonista_parser_initialize, -1);
     rb_define_method(cParser, "reset", jsonista_parser_reset, 0);
     rb_define_method(cParser, "parse_chunk", jsonista_parser_parse_chunk, 1);
+    rb_define_method(cParser, "finish", jsonista_parser_finish, -1);
+    rb_define_method(cParser, "parse_io", jsonista_parser_parse_io, 1);
+#ifdef HAVE_LIBZ
+    rb_define_method(cParser, "parse_gzip_chunk", jsonista_parser_parse_gzip_chunk, 1);
+#endif
+    rb_define_method(cParser, "validate_chunk", jsonista_parser_validate_chunk, 1);
+    rb_define_method(cParser, "validate_finish", jsonista_parser_validate_finish, -1);
+    rb_define_method(cParser, "cache", jsonista_parser_cache, 0);
+    rb_define_method(cParser, "stats", jsonista_parser_stats, 0);
 
     eParseError = rb_define_class_under(mJsonista, "ParseError", rb_eStandardError);
     rb_define_method(eParseError, "initialize", parse_err_initialize, -1);
     rb_define_method(eParseError, "src", parse_err_src, 0);
     rb_define_method(eParseError, "pos", parse_err_pos, 0);
+    eNestingError = rb_define_class_under(mJsonista, "NestingError", eParseError);
+
+    Init_jsonista_cache(mJsonista);
+    Init_jsonista_document(mJsonista);
+    Init_jsonista_generator(mJsonista);
+    Init_jsonista_pool(mJsonista);
+    Init_jsonista_decoder(mJsonista);
+
+    id_src = rb_intern("src");
+    id_pos = rb_intern("pos");
+    id_readpartial = rb_intern("readpartial");
+    id_seek = rb_intern("seek");
+    id_tell = rb_intern("tell");
+    id_threads = rb_intern("threads");
+    id_symbolize_names = rb_intern("symbolize_names");
+    id_cache = rb_intern("cache");
+    id_cache_values = rb_intern("cache_values");
+    id_multi_document = rb_intern("multi_document");
+    id_paths = rb_intern("paths");
+    id_max_nesting = rb_intern("max_nesting");
+    id_freeze = rb_intern("freeze");
+    id_compression = rb_intern("compression");
+    id_gzip = rb_intern("gzip");
+    id_aggregate = rb_intern("aggregate");
+    aggregate_ops[AGGREGATE_COUNT] = rb_intern("count");
+    aggregate_ops[AGGREGATE_SUM] = rb_intern("sum");
+    aggregate_ops[AGGREGATE_MIN] = rb_intern("min");
+    aggregate_ops[AGGREGATE_MAX] = rb_intern("max");
+    aggregate_ops[AGGREGATE_DISTINCT] = rb_intern("distinct");
+    {
+	int i;
+	for (i = 0; i < EV_MAX; i++) {
+	    handler_ids[i] = rb_intern(handler_method_names[i]);
+	}
+    }
 }
@@ -2,5 +2,30 @@
 #define JSONISTA_H 1
 
 #include "ruby.h"
+#include "ruby/encoding.h"
+
+struct parser_number_st;
+
+/* a Jsonista::Parser built with the options of Parser.new, or none */
+VALUE jsonista_parser_new(VALUE opts);
+/* resets the parser for another use; if it holds more than max_retained
+ * bytes besides its fixed read and gzip buffers, gives back what it
+ * allocated beyond its initial storage */
+void jsonista_parser_recycle(VALUE parser, size_t max_retained);
+/* the ParserPool the parser is checked out of, or nil */
+VALUE jsonista_parser_pool(VALUE parser);
+void jsonista_parser_set_pool(VALUE parser, VALUE pool);
+/* decodes the one value [p, e) of the String src with the parser */
+VALUE jsonista_parse_value(VALUE parser, VALUE src, const char *p, const char *e);
+/* decodes the quoted key [p, e) of src as the parser returns keys */
+VALUE jsonista_parse_key(VALUE parser, VALUE src, const char *p, const char *e);
+/* raises ParseError for the byte at p, or for the end of input if p == e */
+NORETURN(void jsonista_parse_error(VALUE src, const char *p, const char *e, ptrdiff_t pos));
+/* raises NestingError for the bracket at pos */
+NORETURN(void jsonista_nesting_error(VALUE src, long max_nesting, ptrdiff_t pos));
+/* the max_nesting of the parser, 0 for no limit */
+long jsonista_parser_max_nesting(VALUE parser);
+/* the Integer or Float of a number, as the parser returns it */
+VALUE jsonista_number_value(const struct parser_number_st *num);
 
 #endif /* JSONISTA_H */
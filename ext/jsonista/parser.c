@@ -1,8 +1,12 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "parser.h"
+#include "scan.h"
+#include "index.h"
+#include "filter.h"
 
 /* parser stack */
 enum parser_state {
@@ -16,186 +20,209 @@ enum parser_state {
     STATE_ARRAY_FIRST_VALUE,
     STATE_ARRAY_VALUE,
     STATE_ARRAY_VALUE_SEP,
+    STATE_NUMBER,
+    STATE_STRING,
+    STATE_KEY,
+    STATE_LITERAL,
+    STATE_SKIP,
+    STATE_DOCUMENT_END,
     STATE_FINISH,
     STATE_BUG,
 };
 
+/* 512 levels in a cache line */
+#define STACK_INITIAL_WORDS 8
+#define STACK_WORD_BITS 64
+
+/*
+ * Only the value being scanned is in a state of its own; every container
+ * it is in waits for the separator after its current value, and the
+ * document below them for its end.  So the stack is the state of the top
+ * in a register, the state below the outermost value, and a bit per level
+ * in between: set for an object, clear for an array.
+ */
 typedef struct stack_st {
-    enum parser_state *head;
-    enum parser_state *current;
-    enum parser_state *end;
+    enum parser_state state;  /* of the value at depth */
+    enum parser_state bottom; /* below the outermost value */
+    size_t depth;             /* values open */
+    uint64_t *bits;           /* level i+1 is an object if bit i is set */
+    size_t capa;              /* words */
+    uint64_t *init;           /* the storage in the parser arena */
+    size_t grows;
 } parser_state_stack_t;
 
-static parser_state_stack_t*
-stack_new() {
-    size_t size = 1024;
-    parser_state_stack_t *p = malloc(sizeof(parser_state_stack_t));
-    if (!p) abort();
-    p->head = malloc(sizeof(enum parser_state) * size);
-    if (!p->head) abort();
-    p->current = p->head;
-    p->end = p->head + size;
-    *p->current = STATE_INIT;
-    return p;
+static void
+stack_init(parser_state_stack_t *p, uint64_t *storage, size_t words) {
+    p->bits = p->init = storage;
+    p->capa = words;
+    p->depth = 0;
+    p->state = p->bottom = STATE_INIT;
+    p->grows = 0;
 }
 
+/* frees the storage allocated by the stack */
 static void
-stack_free(parser_state_stack_t *stack) {
-    free(stack->head);
-    free(stack);
+stack_release(parser_state_stack_t *stack) {
+    if (stack->bits != stack->init) free(stack->bits);
 }
 
 static size_t
 stack_memsize(parser_state_stack_t *stack) {
-    return sizeof(parser_state_stack_t) + stack->end - stack->head;
+    if (stack->bits == stack->init) return 0;
+    return stack->capa * sizeof(uint64_t);
+}
+
+/* doubles the levels; moves the stack out of the arena the first time */
+static void
+stack_grow(parser_state_stack_t *p) {
+    size_t capa = p->capa * 2;
+    uint64_t *ptr;
+    if (p->bits == p->init) {
+	ptr = malloc(capa * sizeof(uint64_t));
+	if (ptr) memcpy(ptr, p->bits, p->capa * sizeof(uint64_t));
+    }
+    else {
+	ptr = realloc(p->bits, capa * sizeof(uint64_t));
+    }
+    if (!ptr) abort();
+    p->bits = ptr;
+    p->capa = capa;
+    p->grows++;
 }
 
+/* the state at the top becomes a level below state: the bottom, or one
+ * of the separator states */
 static void
 stack_push(parser_state_stack_t *p, enum parser_state state) {
-    if (++p->current > p->end) {
-	enum parser_state *ptr = realloc(p->head, (p->end - p->head) * 2);
-	if (!ptr) abort();
-	p->current = ptr - p->head + p->current;
-	p->end = ptr - p->head + p->end;
-	p->head = ptr;
+    size_t i = p->depth;
+    if (i == 0) {
+	p->bottom = p->state;
+    }
+    else {
+	uint64_t bit = (uint64_t)1 << ((i - 1) % STACK_WORD_BITS);
+	if ((i - 1) / STACK_WORD_BITS == p->capa) stack_grow(p);
+	if (p->state == STATE_OBJECT_VALUE_SEP) p->bits[(i - 1) / STACK_WORD_BITS] |= bit;
+	else p->bits[(i - 1) / STACK_WORD_BITS] &= ~bit;
     }
-    *p->current = state;
+    p->depth = i + 1;
+    p->state = state;
 }
 
 static enum parser_state
 stack_pop(parser_state_stack_t *p) {
-    if (p->current == p->head) {
+    enum parser_state state = p->state;
+    size_t i;
+    if (p->depth == 0) {
 	return STATE_BUG;
     }
-    return *p->current--;
+    i = --p->depth;
+    if (i == 0) {
+	p->state = p->bottom;
+    }
+    else {
+	uint64_t bit = (uint64_t)1 << ((i - 1) % STACK_WORD_BITS);
+	p->state = (p->bits[(i - 1) / STACK_WORD_BITS] & bit) ?
+	    STATE_OBJECT_VALUE_SEP : STATE_ARRAY_VALUE_SEP;
+    }
+    return state;
 }
 
 static void
 stack_set(parser_state_stack_t *p, enum parser_state state) {
-    *p->current = state;
+    p->state = state;
 }
 
 static enum parser_state
 stack_peek(parser_state_stack_t *p) {
-    return *p->current;
+    return p->state;
 }
 
 static void
 stack_clear(parser_state_stack_t *p) {
-    p->current = p->head;
-    *p->current = STATE_INIT;
-}
-
-/* buffer */
-typedef struct parser_buffer_st {
-    char *buf;
-    char *p;
-    char *e;
-} buffer_t;
-
-static buffer_t *
-buffer_new() {
-    const size_t size = 4096;
-    buffer_t *buf = malloc(sizeof(buffer_t));
-    if (!buf) abort();
-    buf->buf = malloc(size);
-    if (!buf->buf) abort();
-    buf->p = buf->buf;
-    buf->e = buf->buf + size;
-    return buf;
-}
-
-static void
-buffer_free(buffer_t *buf) {
-    free(buf->buf);
-    free(buf);
-}
-
-static void
-buffer_clear(buffer_t *buf) {
-    buf->p = buf->buf;
-}
-
-static size_t
-buffer_memsize(buffer_t *buf) {
-    return sizeof(buffer_t) + buf->e - buf->buf;
+    p->depth = 0;
+    p->state = p->bottom = STATE_INIT;
 }
 
-static void
-buffer_ensure_writable(buffer_t *buf, size_t len) {
-    if (buf->p + len > buf->e) {
-	char *r = realloc(buf->buf, (buf->e - buf->buf) * 2);
-	if (!r) abort();
-	buf->buf = r;
-    }
-}
-
-static void
-buffer_write(buffer_t *buf, const char *p, size_t len) {
-    buffer_ensure_writable(buf, len);
-    memcpy(buf->p, p, len);
-    buf->p += len;
-}
+/* parser */
 
-static void
-buffer_write_char(buffer_t *buf, int c) {
-    if (c <= 0x7F) {
-	buffer_ensure_writable(buf, 1);
-	buf->p[0] = c;
-	buf->p++;
-    } else if (c <= 0x7FF) {
-	buffer_ensure_writable(buf, 2);
-	buf->p[0] = 0xC0 | ((c >>  6) & 0x1F);
-	buf->p[1] = 0x80 | ((c      ) & 0x3F);
-	buf->p += 2;
-    } else if (c <= 0xFFFF) {
-	buffer_ensure_writable(buf, 3);
-	buf->p[0] = 0xE0 | ((c >> 12) & 0x0F);
-	buf->p[1] = 0x80 | ((c >>  6) & 0x3F);
-	buf->p[2] = 0x80 | ( c        & 0x3F);
-	buf->p += 3;
-    } else if (c <= 0x10FFFF) {
-	buffer_ensure_writable(buf, 4);
-	buf->p[0] = 0xF0 | ((c >> 18) & 0x0F);
-	buf->p[1] = 0x80 | ((c >> 12) & 0x3F);
-	buf->p[2] = 0x80 | ((c >>  6) & 0x3F);
-	buf->p[3] = 0x80 | ( c        & 0x3F);
-	buf->p += 4;
-    }
-}
+/* a parser with its stack and buffer and their initial storage: one
+ * allocation per parser */
+typedef struct parser_arena_st {
+    parser_t parser;
+    parser_state_stack_t stack;
+    buffer_t buffer;
+    uint64_t levels[STACK_INITIAL_WORDS];
+    char chars[BUFFER_INITIAL_SIZE];
+} parser_arena_t;
 
-/* parser */
 parser_t *
-parser_new() {
-    parser_t *parser = malloc(sizeof(parser_t));
-    if (!parser) abort();
+parser_new(void) {
+    parser_arena_t *arena = calloc(1, sizeof(parser_arena_t));
+    parser_t *parser;
+    if (!arena) abort();
+    parser = &arena->parser;
+    parser->stack = &arena->stack;
+    stack_init(parser->stack, arena->levels, STACK_INITIAL_WORDS);
+    parser->buffer = &arena->buffer;
+    buffer_init(parser->buffer, arena->chars, BUFFER_INITIAL_SIZE);
+    parser->max_nesting = PARSER_MAX_NESTING;
+    parser_init(parser);
     return parser;
 }
 
 void
 parser_init(parser_t *parser) {
-    if (parser->stack) {
-	stack_clear(parser->stack);
-    } else {
-	parser->stack = stack_new();
-    }
-    if (parser->buffer) {
-	buffer_clear(parser->buffer);
-    } else {
-	parser->buffer = buffer_new();
-    }
+    stack_clear(parser->stack);
+    buffer_clear(parser->buffer);
     parser->p = NULL;
+    parser->eof = 0;
+    parser->offset = 0;
+    parser->string_split = 0;
+    parser->tmp_len = 0;
+    if (parser->filter) {
+	/* a partial match ends here */
+	filter_reset(parser->filter);
+	parser->events = NULL;
+    }
+}
+
+void
+parser_set_filter(parser_t *parser, filter_t *filter) {
+    filter_free(parser->filter);
+    filter->events = parser->events;
+    parser->filter = filter;
+    parser_init(parser);
 }
 
 void
 parser_free(parser_t *parser) {
-    stack_free(parser->stack);
-    free(parser);
+    stack_release(parser->stack);
+    buffer_release(parser->buffer);
+    filter_free(parser->filter);
+    free(parser); /* the arena */
+}
+
+void
+parser_trim(parser_t *parser) {
+    size_t grows = parser->stack->grows;
+    stack_release(parser->stack);
+    stack_init(parser->stack, parser->stack->init, STACK_INITIAL_WORDS);
+    parser->stack->grows = grows;
+    buffer_trim(parser->buffer);
+    parser_init(parser);
 }
 
 size_t
 parser_memsize(parser_t *parser) {
-    return sizeof(parser_t) + stack_memsize(parser->stack) + buffer_memsize(parser->buffer);
+    return sizeof(parser_arena_t) + stack_memsize(parser->stack) + buffer_memsize(parser->buffer) +
+	(parser->filter ? filter_memsize(parser->filter) : 0);
+}
+
+void
+parser_stats(parser_t *parser, parser_stats_t *stats) {
+    *stats = parser->stats;
+    stats->stack_grows = parser->stack->grows;
+    stats->buffer_grows = parser->buffer->grows;
 }
 
 static void
@@ -228,30 +255,14 @@ parser_buffer_write(parser_t *parser, const char *p, size_t len) {
     buffer_write(parser->buffer, p, len);
 }
 
-static void
-parser_tmp_replace(parser_t *parser, const char *p, const char *e) {
-    size_t len = e - p;
-    memcpy(parser->tmp, p, len);
-    parser->tmp[len] = 0;
+static size_t
+parser_buffer_len(parser_t *parser) {
+    return parser->buffer->p - parser->buffer->buf;
 }
 
 static void
 skip_ws(const char **pp, const char *e) {
-    const char *p = *pp;
-    while (p < e) {
-	switch(*p) {
-	  case ' ':
-	  case '\t':
-	  case '\r':
-	  case '\n':
-	    p++;
-	    break;
-	  default:
-	    *pp = p;
-	    return;
-	}
-    }
-    *pp = p;
+    *pp = scan_skip_ws(*pp, e);
 }
 
 static int
@@ -265,8 +276,54 @@ istrail(char c) {
     return 0x80 <= u && u <= 0xBF;
 }
 
-#define POP_STACK() do { state = stack_pop(stack); goto resume; } while (0)
-#define SKIP_WS(state) skip_ws(&p, e)
+#ifdef __GNUC__
+# define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+# define ALWAYS_INLINE inline
+#endif
+
+/* traces of the scan to stderr, with extconf.rb --enable-trace */
+#ifdef JSONISTA_TRACE
+# define TRACE(...) fprintf(stderr, __VA_ARGS__)
+#else
+# define TRACE(...) ((void)0)
+#endif
+
+/*
+ * USDT probes of provider jsonista, for bpftrace and the like:
+ *   chunk_begin(parser, length)
+ *   chunk_end(parser, bytes consumed, enum parse_error)
+ *   document_end(parser, documents so far)
+ * With <sys/sdt.h> each is a nop instruction until a tracer attaches;
+ * without it, or with extconf.rb --disable-probes, they are nothing.
+ */
+#if defined(HAVE_SYS_SDT_H) && !defined(JSONISTA_NO_PROBES)
+# include <sys/sdt.h>
+# define PROBE_CHUNK_BEGIN(parser, len) DTRACE_PROBE2(jsonista, chunk_begin, parser, len)
+# define PROBE_CHUNK_END(parser, len, err) DTRACE_PROBE3(jsonista, chunk_end, parser, len, err)
+# define PROBE_DOCUMENT_END(parser) DTRACE_PROBE2(jsonista, document_end, parser, (parser)->stats.documents)
+#else
+# define PROBE_CHUNK_BEGIN(parser, len) ((void)0)
+# define PROBE_CHUNK_END(parser, len, err) ((void)0)
+# define PROBE_DOCUMENT_END(parser) ((void)0)
+#endif
+
+#define COUNT(counter) (parser->stats.counter++)
+
+/*
+ * With computed goto, each site that moves on to the state at the top of
+ * the stack jumps through the table of its label itself, so that each
+ * indirect jump is predicted on its own: after a value in an array, the
+ * next state is nearly always the separator of the array.  Otherwise the
+ * sites share the switch at next_state.
+ */
+#if defined(__GNUC__) && !defined(JSONISTA_NO_COMPUTED_GOTO)
+# define USE_COMPUTED_GOTO 1
+# define NEXT_STATE() goto *state_labels[parser_state_get(parser)]
+#else
+# define NEXT_STATE() goto next_state
+#endif
+#define SKIP_WS() skip_ws(&p, e)
 #define ENSURE_READABLE(n) do { \
     if (e - p < n) { \
 	goto needmore; \
@@ -280,6 +337,15 @@ istrail(char c) {
     } \
 } while (0)
 #define ISDIGIT(c) js_isdigit(c)
+/* the container opening at `at` is nested n deep */
+#define CHECK_NESTING(n, at) do { \
+    size_t depth_ = (n); \
+    if (parser->max_nesting && depth_ > (size_t)parser->max_nesting) { \
+	*pp = (at); \
+	return ERR_NESTING; \
+    } \
+    if (depth_ > parser->stats.max_depth) parser->stats.max_depth = depth_; \
+} while (0)
 #define PUSH_STATE(parser, state) do { \
     parser_state_push(parser, state); \
     parser->p = p; \
@@ -289,9 +355,40 @@ istrail(char c) {
     parser_state_set(parser, state); \
     parser->p = p; \
 } while (0)
+/* the scanners take a constant `validate`: validation-only copies of them
+ * emit no events and write no buffers */
+#define TOKEN_START() do { \
+    if (!validate) parser->token = p; \
+} while (0)
+#define TOKEN_END() do { \
+    if (!validate) parser->token_end = p; \
+} while (0)
+/* filtering is off in validation-only copies */
+#define FILTERING (!validate && parser->filter)
+#define FILTER_OPEN() do { \
+    if (FILTERING && parser->filter->nesting >= 0) parser->filter->nesting++; \
+} while (0)
+#define FILTER_CLOSE() do { \
+    if (FILTERING) filter_close(parser); \
+} while (0)
+#define FILTER_SCALAR() do { \
+    if (FILTERING && parser->filter->nesting == 0) filter_matched(parser); \
+} while (0)
+#define EMIT(parser, ev) do { \
+    if (!validate && (parser)->events && (parser)->events->ev) \
+	(parser)->events->ev((parser)->data); \
+} while (0)
+#define EMIT_ARG(parser, ev, arg) do { \
+    if (!validate && (parser)->events && (parser)->events->ev) \
+	(parser)->events->ev((parser)->data, (arg)); \
+} while (0)
+#define EMIT_SLICE(parser, ev, s, len) do { \
+    if (!validate && (parser)->events && (parser)->events->ev) \
+	(parser)->events->ev((parser)->data, (s), (len)); \
+} while (0)
 
 static int
-to_i(char c) {
+to_i(unsigned char c) {
     const int x = 0x10000;
     const int tbl[256] = {
 	 x,  x,  x,  x,  x,  x,  x,  x,  x,  x,  x,  x,  x,  x,  x,  x,
@@ -314,60 +411,143 @@ to_i(char c) {
     return tbl[c];
 }
 
-/* convert 4 digits to integer */
+/* convert 4 hex digits to integer; returns -(1 + offset of the bad digit) */
 static int
 digits2i(const char *p) {
     int c = (to_i(p[0]) << 12) | (to_i(p[1]) << 8) | (to_i(p[2]) << 4) | to_i(p[3]);
     if (c > 0xFFFF) {
-	if (c & 0x10000) return -1;
-	if (c & 0x100000) return -2;
-	if (c & 0x1000000) return -3;
-	if (c & 0x10000000) return -4;
+	if (c & 0x10000000) return -1;
+	if (c & 0x1000000) return -2;
+	if (c & 0x100000) return -3;
+	if (c & 0x10000) return -4;
     }
     return c;
 }
 
-static enum parse_error
-parse_escape(parser_t *parser, const char **pp, const char *e) {
+/* the lead byte of a value */
+enum value_class {
+    VALUE_INVALID,
+    VALUE_OBJECT,
+    VALUE_ARRAY,
+    VALUE_STRING,
+    VALUE_NUMBER,
+    VALUE_TRUE,
+    VALUE_FALSE,
+    VALUE_NULL,
+};
+static const unsigned char value_class[256] = {
+    ['{'] = VALUE_OBJECT, ['['] = VALUE_ARRAY, ['"'] = VALUE_STRING,
+    ['-'] = VALUE_NUMBER, ['0'] = VALUE_NUMBER, ['1'] = VALUE_NUMBER,
+    ['2'] = VALUE_NUMBER, ['3'] = VALUE_NUMBER, ['4'] = VALUE_NUMBER,
+    ['5'] = VALUE_NUMBER, ['6'] = VALUE_NUMBER, ['7'] = VALUE_NUMBER,
+    ['8'] = VALUE_NUMBER, ['9'] = VALUE_NUMBER,
+    ['t'] = VALUE_TRUE, ['f'] = VALUE_FALSE, ['n'] = VALUE_NULL,
+};
+
+/* a byte of string contents: what it ends, or the UTF-8 sequence it
+ * leads, named by the ranges its continuation bytes must be in */
+enum string_class {
+    STR_INVALID,  /* control characters, stray continuations, overlongs */
+    STR_ASCII,
+    STR_QUOTE,
+    STR_ESCAPE,
+    STR_UTF8_2,   /* C2..DF */
+    STR_UTF8_E0,  /* A0..BF, then a trail */
+    STR_UTF8_3,   /* E1..EC, EE, EF */
+    STR_UTF8_ED,  /* 80..9F, then a trail: no surrogates */
+    STR_UTF8_F0,  /* 90..BF, then two trails */
+    STR_UTF8_4,   /* F1..F3 */
+    STR_UTF8_F4,  /* 80..8F, then two trails: nothing past U+10FFFF */
+};
+#define x STR_INVALID
+#define A STR_ASCII
+#define Q STR_QUOTE
+#define B STR_ESCAPE
+#define U2 STR_UTF8_2
+#define E STR_UTF8_E0
+#define U3 STR_UTF8_3
+#define D STR_UTF8_ED
+#define F STR_UTF8_F0
+#define U4 STR_UTF8_4
+#define G STR_UTF8_F4
+static const unsigned char string_class[256] = {
+	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+	A, A, Q, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, A, B, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+	x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+	x, x, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2,
+	U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2, U2,
+	E, U3, U3, U3, U3, U3, U3, U3, U3, U3, U3, U3, U3, D, U3, U3,
+	F, U4, U4, U4, G, x, x, x, x, x, x, x, x, x, x, x,
+};
+#undef x
+#undef A
+#undef Q
+#undef B
+#undef U2
+#undef E
+#undef U3
+#undef D
+#undef F
+#undef U4
+#undef G
+
+#define WRITE_CHAR(c) do { \
+    if (!validate) parser_buffer_write_char(parser, (c)); \
+} while (0)
+
+static ALWAYS_INLINE enum parse_error
+parse_escape(parser_t *parser, const char **pp, const char *e, const int validate) {
     const char *p = *pp;
     int c;
-    //fprintf(stderr, "%d: ESCAPE: \"%s\"\n",__LINE__,p);
     switch (*p++) {
-      case '"':  parser_buffer_write_char(parser, '"');  break;
-      case '\\': parser_buffer_write_char(parser, '\\'); break;
-      case '/':  parser_buffer_write_char(parser, '/');  break;
-      case 'b':  parser_buffer_write_char(parser, '\b'); break;
-      case 'f':  parser_buffer_write_char(parser, '\f'); break;
-      case 'n':  parser_buffer_write_char(parser, '\n'); break;
-      case 'r':  parser_buffer_write_char(parser, '\r'); break;
-      case 't':  parser_buffer_write_char(parser, '\t'); break;
+      case '"':  WRITE_CHAR('"');  break;
+      case '\\': WRITE_CHAR('\\'); break;
+      case '/':  WRITE_CHAR('/');  break;
+      case 'b':  WRITE_CHAR('\b'); break;
+      case 'f':  WRITE_CHAR('\f'); break;
+      case 'n':  WRITE_CHAR('\n'); break;
+      case 'r':  WRITE_CHAR('\r'); break;
+      case 't':  WRITE_CHAR('\t'); break;
       case 'u':
 	ENSURE_READABLE(4);
 	c = digits2i(p);
 	if (c < 0) {
-	    p -= c;
+	    p += -c - 1;
 	    goto invalid;
 	} else if (0xD800 <= c && c <= 0xDBFF) {
 	    int d;
-	    ENSURE_READABLE(6);
+	    ENSURE_READABLE(10);
 	    if (p[4] != '\\') { p += 4; goto invalid; }
 	    if (p[5] != 'u') { p += 5; goto invalid; }
 	    d = digits2i(p+6);
 	    if (d < 0) {
-		p += 6 - d;
+		p += 6 + -d - 1;
+		goto invalid;
+	    }
+	    if (d < 0xDC00 || 0xDFFF < d) {
+		p += 6;
 		goto invalid;
 	    }
 	    c &= 0x3FF;
 	    c <<= 10;
 	    c += 0x10000;
 	    c |= d &0x3FF;
-	    parser_buffer_write_char(parser, c);
+	    WRITE_CHAR(c);
 	    p += 10;
-    fprintf(stderr, "%d: ESCAPE: \"%s\" %x\n",__LINE__,p, c);
+	    TRACE("%d: ESCAPE: \"%.*s\" %x\n",__LINE__,(int)(e-p),p, c);
 	} else if (0xDC00 <= c && c <= 0xDFFF) {
 	    goto invalid;
 	} else {
-	    parser_buffer_write_char(parser, c);
+	    WRITE_CHAR(c);
 	    p += 4;
 	}
 	break;
@@ -378,318 +558,924 @@ parse_escape(parser_t *parser, const char **pp, const char *e) {
     *pp = p;
     return ERR_SUCCESS;
 needmore:
-    parser_tmp_replace(parser, *pp, e);
     return ERR_NEEDMORE;
 invalid:
     *pp = p;
     return ERR_INVALID;
 }
 
-static enum parse_error
-parse_string0(parser_t *parser, const char **pp, const char *e) {
+/* the UTF-8 sequence of class cls at *pp; on success *pp points past it */
+static ALWAYS_INLINE enum parse_error
+parse_utf8(const char **pp, const char *e, int cls) {
     const char *p = *pp;
-    while (p < e) {
-	if (*p == '"') {
-	    goto success;
-	} else if (*p == '\\') {
-	    int err;
-	    if (++p >= e) goto needmore;
-	    err = parse_escape(parser, &p, e);
-	    switch (err) {
-	      case ERR_INVALID:
-		goto invalid;
-	      case ERR_NEEDMORE:
-		goto invalid;
-	      case ERR_SUCCESS:
-		break;
-	    }
-	} else if (*p < 0x20) {
+    switch (cls) {
+      case STR_UTF8_2:
+	ENSURE_READABLE(2);
+	if (!istrail(p[1])) { p += 1; goto invalid; }
+	p += 2;
+	break;
+      case STR_UTF8_E0:
+	ENSURE_READABLE(3);
+	if ((uint8_t)p[1] < 0xA0 || 0xBF < (uint8_t)p[1]) {
+	    p += 1;
 	    goto invalid;
-	} else if (*p <= 0x7F) {
-	    parser_buffer_write_char(parser, *p);
-	    p++;
-	} else if ((uint8_t)*p < 0xC2) {
+	}
+	if (!istrail(p[2])) { p += 2; goto invalid; }
+	p += 3;
+	break;
+      case STR_UTF8_ED:
+	ENSURE_READABLE(3);
+	if ((uint8_t)p[1] < 0x80 || 0x9F < (uint8_t)p[1]) {
+	    p += 1;
 	    goto invalid;
-	} else if ((uint8_t)*p < 0xE0) {
-	    ENSURE_READABLE(2);
-	    if (!istrail(p[1])) { p += 1; goto invalid; }
-	    parser_buffer_write(parser, p, 2);
-	} else if ((uint8_t)*p == 0xE0) {
-	    ENSURE_READABLE(3);
-	    if (0xA0 <= (uint8_t)p[1] && (uint8_t)p[1] <= 0xBF) {
-		p += 1;
-		goto invalid;
-	    }
-	    if (!istrail(p[2])) { p += 2; goto invalid; }
-	    parser_buffer_write(parser, p, 3);
-	} else if ((uint8_t)*p < 0xF0) {
-	    ENSURE_READABLE(3);
-	    if (!istrail(p[1])) { p += 1; goto invalid; }
-	    if (!istrail(p[2])) { p += 2; goto invalid; }
-	    parser_buffer_write(parser, p, 3);
-	} else if ((uint8_t)*p == 0xF0) {
-	    ENSURE_READABLE(4);
-	    if (0x90 <= (uint8_t)p[1] && (uint8_t)p[1] <= 0xBF) {
-		p += 1;
-		goto invalid;
+	}
+	if (!istrail(p[2])) { p += 2; goto invalid; }
+	p += 3;
+	break;
+      case STR_UTF8_3:
+	ENSURE_READABLE(3);
+	if (!istrail(p[1])) { p += 1; goto invalid; }
+	if (!istrail(p[2])) { p += 2; goto invalid; }
+	p += 3;
+	break;
+      case STR_UTF8_F0:
+	ENSURE_READABLE(4);
+	if ((uint8_t)p[1] < 0x90 || 0xBF < (uint8_t)p[1]) {
+	    p += 1;
+	    goto invalid;
+	}
+	if (!istrail(p[2])) { p += 2; goto invalid; }
+	if (!istrail(p[3])) { p += 3; goto invalid; }
+	p += 4;
+	break;
+      case STR_UTF8_4:
+	ENSURE_READABLE(4);
+	if (!istrail(p[1])) { p += 1; goto invalid; }
+	if (!istrail(p[2])) { p += 2; goto invalid; }
+	if (!istrail(p[3])) { p += 3; goto invalid; }
+	p += 4;
+	break;
+      case STR_UTF8_F4:
+	ENSURE_READABLE(4);
+	if ((uint8_t)p[1] < 0x80 || 0x8F < (uint8_t)p[1]) {
+	    p += 1;
+	    goto invalid;
+	}
+	if (!istrail(p[2])) { p += 2; goto invalid; }
+	if (!istrail(p[3])) { p += 3; goto invalid; }
+	p += 4;
+	break;
+      default:
+	goto invalid;
+    }
+    *pp = p;
+    return ERR_SUCCESS;
+needmore:
+    return ERR_NEEDMORE;
+invalid:
+    *pp = p;
+    return ERR_INVALID;
+}
+
+/*
+ * parse string contents after the opening quote, or after what the last
+ * chunk left of them if parser->string_split; on success *pp points just
+ * after the closing quote and *sp, *lenp is the string: a slice of the
+ * input when it has no escapes, or the unescaped copy in the buffer.
+ * Only the runs between escapes are copied, each in one write.  On
+ * ERR_NEEDMORE *pp is where the end of the chunk cut the string: at the
+ * end, or at an escape or UTF-8 sequence it cuts; the contents before
+ * that are in the buffer.
+ */
+static ALWAYS_INLINE enum parse_error
+parse_string0(parser_t *parser, const char **pp, const char *e, const char **sp, size_t *lenp, const int validate) {
+    const char *p = *pp;
+    const char *run = p; /* start of the bytes not copied to the buffer yet */
+    const char *rescan = p;
+    int escaped = parser->string_split;
+    if (!validate && !escaped) buffer_clear(parser->buffer);
+    while (p < e) {
+	unsigned char c;
+	if (p >= rescan) {
+	    /* skip the validated run; the ladder below handles the block
+	     * the vector scan stopped at */
+	    p = scan_string(p, e);
+	    if (p >= e) break;
+	    rescan = p + SCAN_STRING_MIN;
+	}
+	c = (unsigned char)*p;
+	if (string_class[c] == STR_ASCII) {
+	    /* most of what is left after the vector scan */
+	    p++;
+	    continue;
+	}
+	switch (string_class[c]) {
+	  case STR_QUOTE:
+	    goto success;
+	  case STR_ESCAPE:
+	    {
+		enum parse_error err;
+		if (!validate) parser_buffer_write(parser, run, p - run);
+		escaped = 1;
+		run = p;
+		if (p + 1 >= e) goto needmore;
+		p++;
+		err = parse_escape(parser, &p, e, validate);
+		if (err == ERR_INVALID) goto invalid;
+		if (err == ERR_NEEDMORE) {
+		    p = run;
+		    goto needmore;
+		}
+		run = p;
 	    }
-	    if (!istrail(p[2])) { p += 2; goto invalid; }
-	    if (!istrail(p[3])) { p += 3; goto invalid; }
-	    parser_buffer_write(parser, p, 4);
-	} else if ((uint8_t)*p < 0xF4) {
-	    ENSURE_READABLE(4);
-	    if (!istrail(p[1])) { p += 1; goto invalid; }
-	    if (!istrail(p[2])) { p += 2; goto invalid; }
-	    if (!istrail(p[3])) { p += 3; goto invalid; }
-	    parser_buffer_write(parser, p, 4);
-	} else if ((uint8_t)*p == 0xF4) {
-	    ENSURE_READABLE(4);
-	    if (0x80 <= (uint8_t)p[1] && (uint8_t)p[1] <= 0x8F) {
-		p += 1;
-		goto invalid;
+	    break;
+	  default:
+	    {
+		enum parse_error err = parse_utf8(&p, e, string_class[c]);
+		if (err == ERR_INVALID) goto invalid;
+		if (err == ERR_NEEDMORE) goto needmore;
 	    }
-	    if (!istrail(p[2])) { p += 2; goto invalid; }
-	    if (!istrail(p[3])) { p += 3; goto invalid; }
-	    parser_buffer_write(parser, p, 4);
-	} else {
-	    goto invalid;
+	    break;
 	}
     }
 needmore:
-    fprintf(stderr, "%d: STRING:NEEDMORE \"%s\"\n",__LINE__,p);
+    TRACE("%d: STRING:NEEDMORE \"%.*s\"\n",__LINE__,(int)(e-*pp),*pp);
+    if (!validate) parser_buffer_write(parser, run, p - run);
+    *pp = p;
     return ERR_NEEDMORE;
 invalid:
     *pp = p;
-    fprintf(stderr, "%d: STRING:INVALID \"%s\"\n",__LINE__,p);
+    TRACE("%d: STRING:INVALID \"%.*s\"\n",__LINE__,(int)(e-p),p);
     return ERR_INVALID;
 success:
-    parser_buffer_write_char(parser, 0);
-    fprintf(stderr, "%d: STRING: \"%s\"\n",__LINE__,parser->buffer->buf);
+    if (escaped) parser->string_split = 0;
+    if (validate) {
+	*pp = p + 1;
+	return ERR_SUCCESS;
+    }
+    if (escaped) {
+	parser_buffer_write(parser, run, p - run);
+	*sp = parser->buffer->buf;
+	*lenp = parser_buffer_len(parser);
+    } else {
+	*sp = *pp;
+	*lenp = p - *pp;
+    }
+    TRACE("%d: STRING: \"%.*s\"\n",__LINE__,(int)*lenp,*sp);
+    *pp = p + 1;
+    return ERR_SUCCESS;
+}
+
+/* the escape or UTF-8 sequence at *pp, which may end past e */
+static ALWAYS_INLINE enum parse_error
+parse_sequence(parser_t *parser, const char **pp, const char *e, const int validate) {
+    const char *p = *pp;
+    enum parse_error err;
+    if (*p != '\\') return parse_utf8(pp, e, string_class[(unsigned char)*p]);
+    if (++p == e) return ERR_NEEDMORE;
+    err = parse_escape(parser, &p, e, validate);
+    if (err != ERR_NEEDMORE) *pp = p;
+    return err;
+}
+
+/*
+ * the start [s, s+n) of an escape or UTF-8 sequence: returns the offset of
+ * its first byte that no continuation makes valid, or -1.  The sequence
+ * is completed with the bytes valid wherever it was cut: the lowest trail
+ * byte its lead allows, or the digits of "\u0000\uDC00".
+ */
+static long
+sequence_check(parser_t *parser, const char *s, size_t n) {
+    static const char escape[] = "\\u0000\\uDC00";
+    char seq[sizeof(escape) - 1];
+    const char *q = seq;
+    size_t i;
+    memcpy(seq, s, n);
+    for (i = n; i < sizeof(seq); i++) {
+	if (s[0] == '\\') seq[i] = escape[i];
+	else if (i == 1 && (unsigned char)s[0] == 0xE0) seq[i] = (char)0xA0;
+	else if (i == 1 && (unsigned char)s[0] == 0xF0) seq[i] = (char)0x90;
+	else seq[i] = (char)0x80;
+    }
+    if (parse_sequence(parser, &q, seq + sizeof(seq), 1) == ERR_INVALID &&
+	(size_t)(q - seq) < n) {
+	return q - seq;
+    }
+    return -1;
+}
+
+/* the string was cut at *pp, by e: keeps the sequence of [*pp, e) that
+ * is cut too for string_resume, and consumes the chunk */
+static enum parse_error
+string_split(parser_t *parser, const char **pp, const char *e) {
+    size_t n = e - *pp;
+    long bad = n ? sequence_check(parser, *pp, n) : -1;
+    if (bad >= 0) {
+	*pp += bad;
+	return ERR_INVALID;
+    }
+    memcpy(parser->tmp, *pp, n);
+    parser->tmp_len = n;
+    parser->string_split = 1;
+    *pp = e;
+    return ERR_NEEDMORE;
+}
+
+/* completes the sequence kept by string_split with the first bytes of
+ * [*pp, e); the string goes on from *pp with parse_string0 */
+static ALWAYS_INLINE enum parse_error
+string_resume(parser_t *parser, const char **pp, const char *e, const int validate) {
+    size_t old = parser->tmp_len, n = e - *pp;
+    const char *q = parser->tmp;
+    enum parse_error err;
+    long bad;
+    if (!old) return ERR_SUCCESS;
+    if (n > sizeof(parser->tmp) - old) n = sizeof(parser->tmp) - old;
+    memcpy(parser->tmp + old, *pp, n);
+    err = parse_sequence(parser, &q, parser->tmp + old + n, validate);
+    switch (err) {
+      case ERR_NEEDMORE:
+	/* the chunk ends before the sequence does */
+	bad = sequence_check(parser, parser->tmp, old + n);
+	if (bad >= 0) {
+	    *pp += bad - old;
+	    return ERR_INVALID;
+	}
+	parser->tmp_len = old + n;
+	*pp = e;
+	return ERR_NEEDMORE;
+      default:
+	/* an error in the bytes kept is reported at the start of the chunk */
+	if ((size_t)(q - parser->tmp) > old) *pp += (q - parser->tmp) - old;
+	parser->tmp_len = 0;
+	if (!validate && !err && parser->tmp[0] != '\\') {
+	    /* escapes are written decoded by parse_escape */
+	    parser_buffer_write(parser, parser->tmp, q - parser->tmp);
+	}
+	return err;
+    }
+}
+
+/* where parse_number resumes in the next chunk */
+enum number_phase {
+    NUM_START,
+    NUM_INT_FIRST,
+    NUM_INT,
+    NUM_FRAC_OR_EXP,
+    NUM_FRAC_FIRST,
+    NUM_FRAC,
+    NUM_EXP_SIGN,
+    NUM_EXP_FIRST,
+    NUM_EXP,
+};
+
+static void
+number_init(parser_number_t *num) {
+    memset(num, 0, sizeof(*num));
+}
+
+/* accumulate significant digits; the exponent keeps track of the decimal
+ * point and of digits dropped after the 19th */
+static const char *
+number_digits(parser_number_t *num, const char *p, const char *e, int frac) {
+    uint64_t mantissa = num->mantissa;
+    int digits = num->digits;
+    int64_t exponent = num->exponent;
+    if (digits == 0) {
+	/* leading zeros of the fraction */
+	while (p < e && *p == '0') {
+	    exponent -= frac;
+	    p++;
+	}
+    }
+    while (p < e && ISDIGIT(*p) && digits < 19) {
+	mantissa = mantissa * 10 + (*p - '0');
+	digits++;
+	exponent -= frac;
+	p++;
+    }
+    while (p < e && ISDIGIT(*p)) {
+	if (*p != '0') num->truncated = 1;
+	exponent += !frac;
+	p++;
+    }
+    num->mantissa = mantissa;
+    num->digits = digits;
+    num->exponent = exponent;
+    return p;
+}
+
+/*
+ * scan a number and accumulate its value; the scan can stop at the end of
+ * any chunk and resume in the next.  On success *pp points just after the
+ * number.
+ */
+static const char *
+skip_digits(const char *p, const char *e) {
+    while (p < e && ISDIGIT(*p)) p++;
+    return p;
+}
+
+static ALWAYS_INLINE enum parse_error
+parse_number(parser_t *parser, const char **pp, const char *e, const int validate) {
+    parser_number_t *num = &parser->number;
+    const char *s = *pp;
+    const char *p = s;
+
+    switch (num->phase) {
+      case NUM_START: goto start;
+      case NUM_INT_FIRST: goto int_first;
+      case NUM_INT: goto int_digits;
+      case NUM_FRAC_OR_EXP: goto frac_or_exp;
+      case NUM_FRAC_FIRST: goto frac_first;
+      case NUM_FRAC: goto frac_digits;
+      case NUM_EXP_SIGN: goto exp_sign;
+      case NUM_EXP_FIRST: goto exp_first;
+      case NUM_EXP: goto exp_digits;
+    }
+
+start:
+    if (*p == '-') {
+	num->negative = 1;
+	p++;
+    }
+int_first:
+    if (p == e) {
+	num->phase = NUM_INT_FIRST;
+	goto needmore;
+    }
+    if (*p == '0') {
+	p++;
+	goto frac_or_exp;
+    }
+    if (!ISDIGIT(*p)) goto invalid;
+int_digits:
+    p = validate ? skip_digits(p, e) : number_digits(num, p, e, 0);
+    if (p == e) {
+	num->phase = NUM_INT;
+	goto end_or_needmore;
+    }
+frac_or_exp:
+    if (p == e) {
+	num->phase = NUM_FRAC_OR_EXP;
+	goto end_or_needmore;
+    }
+    if (*p != '.') goto exp_mark;
+    p++;
+    num->is_float = 1;
+frac_first:
+    if (p == e) {
+	num->phase = NUM_FRAC_FIRST;
+	goto needmore;
+    }
+    if (!ISDIGIT(*p)) goto invalid;
+frac_digits:
+    p = validate ? skip_digits(p, e) : number_digits(num, p, e, 1);
+    if (p == e) {
+	num->phase = NUM_FRAC;
+	goto end_or_needmore;
+    }
+exp_mark:
+    if (*p != 'e' && *p != 'E') goto success;
+    p++;
+    num->is_float = 1;
+exp_sign:
+    if (p == e) {
+	num->phase = NUM_EXP_SIGN;
+	goto needmore;
+    }
+    if (*p == '+' || *p == '-') {
+	num->exp_negative = *p == '-';
+	p++;
+    }
+exp_first:
+    if (p == e) {
+	num->phase = NUM_EXP_FIRST;
+	goto needmore;
+    }
+    if (!ISDIGIT(*p)) goto invalid;
+exp_digits:
+    while (p < e && ISDIGIT(*p)) {
+	if (num->exp_value < 100000000) {
+	    num->exp_value = num->exp_value * 10 + (*p - '0');
+	}
+	p++;
+    }
+    if (p == e) {
+	num->phase = NUM_EXP;
+	goto end_or_needmore;
+    }
+
+success:
+    if (validate) {
+	*pp = p;
+	return ERR_SUCCESS;
+    }
+    num->exponent += num->exp_negative ? -num->exp_value : num->exp_value;
+    if (num->split) {
+	parser_buffer_write(parser, s, p - s);
+	num->p = parser->buffer->buf;
+	num->len = parser_buffer_len(parser);
+    }
+    else {
+	num->p = s;
+	num->len = p - s;
+    }
     *pp = p;
     return ERR_SUCCESS;
+end_or_needmore:
+    /* a number may continue in the next chunk unless this is the last one */
+    if (parser->eof) goto success;
+needmore:
+    /* keep the text so far for conversions that need every digit */
+    if (!validate) {
+	if (!num->split) {
+	    buffer_clear(parser->buffer);
+	    num->split = 1;
+	}
+	parser_buffer_write(parser, s, p - s);
+    }
+    *pp = p;
+    return ERR_NEEDMORE;
+invalid:
+    *pp = p;
+    return ERR_INVALID;
+}
+
+/*
+ * path filtering: outside the values matched, events are off
+ * (parser->events is NULL) and values off the paths are skipped
+ */
+enum filter_action {
+    FILTER_MATCH,
+    FILTER_DESCEND,
+    FILTER_SKIP,
+};
+
+/* calls match for the value being matched */
+static void
+filter_report(parser_t *parser) {
+    filter_t *f = parser->filter;
+    uint64_t mask;
+    if (!f->events || !f->events->match) return;
+    if (!f->nested) {
+	f->events->match(parser->data, f->path);
+	return;
+    }
+    for (mask = f->matched; mask; mask &= mask - 1) {
+	int path = f->nodes[filter_lowest(mask)].path;
+	if (path >= 0) f->events->match(parser->data, path);
+    }
+}
+
+/* what to do with the value starting with c, outside matched values */
+static enum filter_action
+filter_value(parser_t *parser, int c) {
+    filter_t *f = parser->filter;
+    int path = filter_path(f, f->next);
+    if (path >= 0 && f->nested && (c == '{' || c == '[')) {
+	/* reported now, then searched for deeper paths */
+	const parser_events_t *ev = f->events;
+	void (*start)(void *) = c == '{' ? ev->start_object : ev->start_array;
+	if (start) start(parser->data);
+	f->matched = f->next;
+	filter_report(parser);
+    }
+    else if (path >= 0) {
+	f->matched = f->next;
+	f->path = path;
+	f->nesting = 0;
+	parser->events = f->events;
+	return FILTER_MATCH;
+    }
+    if ((f->next & f->parents) && (c == '{' || c == '[')) {
+	filter_push(f, f->next);
+	return FILTER_DESCEND;
+    }
+    f->skip_depth = 0;
+    f->skip_string = f->skip_escaped = 0;
+    return FILTER_SKIP;
 }
 
+/* the value being matched is complete */
+static void
+filter_matched(parser_t *parser) {
+    filter_t *f = parser->filter;
+    filter_report(parser);
+    parser->events = NULL;
+    f->nesting = -1;
+}
+
+static void
+filter_close(parser_t *parser) {
+    filter_t *f = parser->filter;
+    if (f->nesting < 0) {
+	filter_pop(f);
+    }
+    else if (--f->nesting == 0) {
+	filter_matched(parser);
+    }
+}
+
+/* bytes that matter when skipping a value, outside strings */
+enum skip_class {
+    SKIP_OTHER,
+    SKIP_OPEN,
+    SKIP_CLOSE,
+    SKIP_QUOTE,
+    SKIP_DELIM,
+};
+static const unsigned char skip_class[256] = {
+    ['\t'] = SKIP_DELIM, ['\n'] = SKIP_DELIM, ['\r'] = SKIP_DELIM, [' '] = SKIP_DELIM,
+    [','] = SKIP_DELIM, [':'] = SKIP_DELIM,
+    ['['] = SKIP_OPEN, ['{'] = SKIP_OPEN,
+    [']'] = SKIP_CLOSE, ['}'] = SKIP_CLOSE,
+    ['"'] = SKIP_QUOTE,
+};
+
+/*
+ * skip the value at *pp without decoding it: only brackets and string
+ * boundaries are tracked, so skipped values are not validated, and
+ * nothing is written to the buffer.  On ERR_NEEDMORE all of [*pp, e) is
+ * consumed and the state is kept in the filter.
+ */
 static enum parse_error
-parse_string(parser_t *parser, const char **pp, const char *e) {
+skip_value(parser_t *parser, const char **pp, const char *e) {
+    filter_t *f = parser->filter;
     const char *p = *pp;
-    skip_ws(&p, e);
-    if (p < e) {
-	if (*p == '"') {
-	    *pp = ++p;
-	    return parse_string0(parser, pp, e);
+    long depth = f->skip_depth;
+
+    for (;;) {
+	if (f->skip_string) {
+	    const char *q = NULL; /* the next quote, searched for lazily */
+	    if (f->skip_escaped) {
+		if (p == e) goto needmore;
+		p++;
+		f->skip_escaped = 0;
+	    }
+	    for (;;) {
+		const char *b;
+		if (!q || q < p) {
+		    q = memchr(p, '"', e - p);
+		    if (!q) q = e;
+		}
+		b = memchr(p, '\\', q - p);
+		if (!b) break;
+		if (b + 1 == e) {
+		    f->skip_escaped = 1;
+		    p = e;
+		    goto needmore;
+		}
+		p = b + 2;
+	    }
+	    if (q == e) {
+		p = e;
+		goto needmore;
+	    }
+	    p = q + 1;
+	    f->skip_string = 0;
+	    if (depth == 0) goto done;
 	}
-	*pp = p;
-	return ERR_INVALID;
+	for (; p < e; p++) {
+	    switch (skip_class[(unsigned char)*p]) {
+	      case SKIP_OPEN:
+		depth++;
+		continue;
+	      case SKIP_CLOSE:
+		if (depth == 0) goto done; /* after a scalar */
+		if (--depth == 0) {
+		    p++;
+		    goto done;
+		}
+		continue;
+	      case SKIP_DELIM:
+		if (depth == 0) goto done;
+		continue;
+	      case SKIP_QUOTE:
+		break;
+	      default:
+		continue;
+	    }
+	    break;
+	}
+	if (p == e) {
+	    /* a scalar ends with the input */
+	    if (depth == 0 && parser->eof) goto done;
+	    goto needmore;
+	}
+	p++;
+	f->skip_string = 1;
     }
+needmore:
+    f->skip_depth = depth;
     *pp = p;
     return ERR_NEEDMORE;
+done:
+    *pp = p;
+    return ERR_SUCCESS;
+}
+
+/* the state machine with events, and its validation-only copy */
+#define PARSER_MACHINE parser_parse0
+#define PARSER_MACHINE_VALIDATE 0
+#include "parser_machine.h"
+
+#define PARSER_MACHINE parser_validate0
+#define PARSER_MACHINE_VALIDATE 1
+#include "parser_machine.h"
+
+/* counts the run over [s, e) that stopped at p */
+static enum parse_error
+chunk_end(parser_t *parser, const char *s, const char *p, enum parse_error err) {
+    parser->stats.bytes += p - s;
+    parser->offset += p - s;
+    if (err == ERR_NEEDMORE) parser->stats.resumes++;
+    PROBE_CHUNK_END(parser, p - s, err);
+    return err;
 }
 
 enum parse_error
 parser_parse_chunk(parser_t *parser, const char **pp, const char *e) {
-    const char *p = *pp;
-    unsigned char c;
+    const char *s = *pp;
+    enum parse_error err;
+    PROBE_CHUNK_BEGIN(parser, e - s);
+    err = parser_parse0(parser, pp, e);
+    return chunk_end(parser, s, *pp, err);
+}
 
-next_state:
-    switch (parser_state_get(parser)) {
-      case STATE_INIT:
-	fprintf(stderr, "state: STATE_INIT\n");
-	SET_STATE(parser, STATE_FINISH);
-	PUSH_STATE(parser, STATE_VALUE);
-      case STATE_VALUE:
-	fprintf(stderr, "state: STATE_VALUE\n");
-	goto value;
-      case STATE_FINISH:
-	fprintf(stderr, "state: STATE_FINISH\n");
-	goto finish;
-      case STATE_OBJECT_FIRST_NAME:
-	goto object_first_name;
-      case STATE_OBJECT_NAME:
-	goto object_name;
-      case STATE_OBJECT_NAME_SEP:
-	goto object_name_sep;
-      case STATE_OBJECT_VALUE:
-	goto object_value;
-      case STATE_OBJECT_VALUE_SEP:
-	fprintf(stderr, "state: STATE_OBJECT_VALUE_SEP\n");
-	goto object_value_sep;
-      case STATE_ARRAY_FIRST_VALUE:
-	fprintf(stderr, "state: STATE_ARRAY_FIRST_VALUE\n");
-	goto array_first_value;
-      case STATE_ARRAY_VALUE_SEP:
-	fprintf(stderr, "state: STATE_ARRAY_VALUE_SEP\n");
-	goto array_value_sep;
-      default:
-	fprintf(stderr, "unknown state: %d\n", parser_state_get(parser));
-	abort();
-    }
+/* parse the last chunk of the input; a trailing number is complete */
+enum parse_error
+parser_parse_end(parser_t *parser, const char **pp, const char *e) {
+    enum parse_error err;
+    parser->eof = 1;
+    err = parser_parse_chunk(parser, pp, e);
+    parser->eof = 0;
+    return err;
+}
 
-value:
-    SKIP_WS();
-    ENSURE_READABLE(1);
-    switch (*p++) {
-      case '{':
-	goto object_first_name;
-      case '[':
-	goto array_first_value;
-      case '"':
-	if (parse_string0(parser, &p, e)) {
-	    // error
+/*
+ * check the syntax only: a copy of parser_parse_chunk specialized to fire
+ * no events and write no buffers.  It calls no callbacks, so it can run
+ * without the GVL.
+ */
+enum parse_error
+parser_validate_chunk(parser_t *parser, const char **pp, const char *e) {
+    const char *s = *pp;
+    enum parse_error err;
+    PROBE_CHUNK_BEGIN(parser, e - s);
+    err = parser_validate0(parser, pp, e);
+    return chunk_end(parser, s, *pp, err);
+}
+
+enum parse_error
+parser_validate_end(parser_t *parser, const char **pp, const char *e) {
+    enum parse_error err;
+    parser->eof = 1;
+    err = parser_validate_chunk(parser, pp, e);
+    parser->eof = 0;
+    return err;
+}
+
+/*
+ * Two-stage mode, stage 2: walk the structural index of a whole document
+ * (see index.h) and fire the same events as parser_parse_chunk.  Stage 1
+ * has checked the contents of strings already, so strings without escapes
+ * are handed out as they are.
+ */
+
+/* the string opening at *pp, which ends at the next indexed quote; on
+ * error *pp is left at the byte the streaming parser would report, and
+ * ERR_NEEDMORE stands for the end of the input [*pp, e) */
+static ALWAYS_INLINE enum parse_error
+index_string(parser_t *parser, index_iter_t *it, const char **pp, const char *e, const char **sp, size_t *lenp, const int validate) {
+    const char *p = *pp + 1;
+    const char *q = index_next(it);
+    if (q) {
+	enum parse_error err;
+	if (!memchr(p, '\\', q - p)) {
+	    *sp = p;
+	    *lenp = q - p;
+	    return ERR_SUCCESS;
 	}
-	break;
-      case '-':
-	ENSURE_READABLE(1);
-	switch (*p++) {
-	  case '0':
-	    goto frac;
-	  case '1':case'2':case'3':case'4':case'5':case'6':case'7':case'8':case'9':
-	    goto nonzero;
-	  default:
-	    RAISE(ERR_INVALID);
+	err = parse_string0(parser, &p, q + 1, sp, lenp, validate);
+	if (err != ERR_NEEDMORE) {
+	    *pp = p;
+	    return err;
 	}
-	// int = zero / ( digit1-9 *DIGIT )
-      case '0':
-	goto frac;
-      case '1':case'2':case'3':case'4':case'5':case'6':case'7':case'8':case'9':
-nonzero:
-	while (p < e && ISDIGIT(*p)) {
-	    p++;
+	/* an escape cut off by the quote: the streaming parser reads on */
+	p = *pp + 1;
+    }
+    /* the string runs to where the index stops, at the end of input or
+     * at the error stage 1 found; an escape may be invalid before that */
+    {
+	const char *end = it->idx->error ? it->idx->error : e;
+	enum parse_error err = parse_string0(parser, &p, end, sp, lenp, 1);
+	if (err == ERR_NEEDMORE && p < end) {
+	    /* a sequence cut off by the end, checked as string_split does */
+	    long bad = sequence_check(parser, p, end - p);
+	    if (bad >= 0) {
+		p += bad;
+		err = ERR_INVALID;
+	    }
 	}
-frac:
-	if (p < e && *p == '.') {
-	    p++;
-	    ENSURE_READABLE(1);
-	    if (!ISDIGIT(*p)) RAISE(ERR_INVALID);
-	    p++;
-	    while (p < e && ISDIGIT(*p)) p++;
+	if (err == ERR_INVALID) {
+	    *pp = p;
+	    return ERR_INVALID;
 	}
-	if (p < e && *p == 'e') {
-	    p++;
-	    if (p < e && (*p == '+' || *p == '-')) p++;
-	    ENSURE_READABLE(1);
-	    if (!ISDIGIT(*p)) RAISE(ERR_INVALID);
-	    while (p < e && ISDIGIT(*p)) p++;
+    }
+    return ERR_NEEDMORE;
+}
+
+/* the literal lit at *pp doesn't match the scalar [*pp, end): it is
+ * reported at its first byte, or at the end of input e if that cuts it
+ * short, as the streaming parser does */
+static enum parse_error
+index_literal_error(const char **pp, const char *end, const char *e, const char *lit) {
+    size_t n = end - *pp;
+    if (end == e && n < strlen(lit) && !memcmp(*pp, lit, n)) *pp = e;
+    return ERR_INVALID;
+}
+
+/* a number or a literal starting at *pp, which ends at the next indexed
+ * position; on error *pp is left at the byte the streaming parser would
+ * report, e for the end of input */
+static ALWAYS_INLINE enum parse_error
+index_scalar(parser_t *parser, const char **pp, const char *end, const char *e, const int validate) {
+    const char *p = *pp, *q = p;
+    enum parse_error err;
+    switch (*p) {
+      case '-':
+      case '0':case '1':case'2':case'3':case'4':case'5':case'6':case'7':case'8':case'9':
+	number_init(&parser->number);
+	parser->eof = 1;
+	err = parse_number(parser, &q, end, validate);
+	parser->eof = 0;
+	if (err) {
+	    *pp = err == ERR_INVALID ? q : end;
+	    return ERR_INVALID;
 	}
-	ENSURE_READABLE(1);
+	COUNT(numbers);
+	EMIT_ARG(parser, number, &parser->number);
 	break;
       case 't':
-	ENSURE_READABLE(3);
-	if (memcmp(p, "rue", 3)) {
-	    RAISE(ERR_INVALID);
-	}
-	p += 3;
+	if (end - p < 4 || memcmp(p, "true", 4)) return index_literal_error(pp, end, e, "true");
+	q += 4;
+	COUNT(literals);
+	EMIT(parser, true_value);
 	break;
       case 'f':
-	ENSURE_READABLE(4);
-	if (memcmp(p, "alse", 4)) {
-	    RAISE(ERR_INVALID);
-	}
-	p += 4;
+	if (end - p < 5 || memcmp(p, "false", 5)) return index_literal_error(pp, end, e, "false");
+	q += 5;
+	COUNT(literals);
+	EMIT(parser, false_value);
 	break;
       case 'n':
-	ENSURE_READABLE(3);
-	if (memcmp(p, "ull", 3)) {
-	    RAISE(ERR_INVALID);
-	}
-	p += 3;
+	if (end - p < 4 || memcmp(p, "null", 4)) return index_literal_error(pp, end, e, "null");
+	q += 4;
+	COUNT(literals);
+	EMIT(parser, null_value);
 	break;
       default:
-	RAISE(ERR_INVALID);
-    }
-    POP_STATE(parser);
-    goto next_state;
-
-object_first_name:
-    SET_STATE(parser, STATE_OBJECT_FIRST_NAME);
-    SKIP_WS();
-    ENSURE_READABLE(1);
-    switch (*p) {
-      case '"':
-	goto object_name;
-      case '}':
-	p++;
-	POP_STATE(parser);
-	goto next_state;
-      default:
-	RAISE(ERR_INVALID);
+	return ERR_INVALID;
     }
-
-object_name:
-    SET_STATE(parser, STATE_OBJECT_NAME);
-    {
-	enum parse_error ret = parse_string(parser, &p, e);
-	if (ret) RAISE(ret);
+    skip_ws(&q, end);
+    if (q < end) {
+	*pp = q;
+	return ERR_INVALID;
     }
+    return ERR_SUCCESS;
+}
 
-object_name_sep:
-    SET_STATE(parser, STATE_OBJECT_NAME_SEP);
-    SKIP_WS();
-    ENSURE_READABLE(1);
-    switch (*p++) {
-      case ':':
-	goto object_value;
-      default:
-	RAISE(ERR_INVALID);
-    }
+static ALWAYS_INLINE enum parse_error
+parser_parse_index0(parser_t *parser, const index_t *idx, const char **pp, const char *e, const int validate) {
+    index_iter_t it;
+    const char *p = *pp, *q;
 
-object_value:
-    SET_STATE(parser, STATE_OBJECT_VALUE_SEP);
-    PUSH_STATE(parser, STATE_VALUE);
-    goto value;
+    index_iter_init(&it, idx);
+    stack_clear(parser->stack);
+    parser_state_set(parser, STATE_DOCUMENT_END);
 
-object_value_sep:
-    SET_STATE(parser, STATE_OBJECT_VALUE_SEP);
-    SKIP_WS();
-    ENSURE_READABLE(1);
-    switch (*p++) {
-      case ',':
+value:
+    p = index_next(&it);
+    if (!p) goto needmore;
+    switch (*p) {
+      case '{':
+	CHECK_NESTING(parser->stack->depth + 1, p);
+	COUNT(objects);
+	EMIT(parser, start_object);
+	p = index_next(&it);
+	if (!p) goto needmore;
+	if (*p == '}') {
+	    EMIT(parser, end_object);
+	    goto value_end;
+	}
+	parser_state_push(parser, STATE_OBJECT_VALUE_SEP);
 	goto object_name;
-      case '}':
-	POP_STATE(parser);
-	goto next_state;
+      case '[':
+	CHECK_NESTING(parser->stack->depth + 1, p);
+	COUNT(arrays);
+	EMIT(parser, start_array);
+	q = index_peek(&it);
+	if (!q) goto needmore;
+	if (*q == ']') {
+	    index_next(&it);
+	    EMIT(parser, end_array);
+	    goto value_end;
+	}
+	parser_state_push(parser, STATE_ARRAY_VALUE_SEP);
+	goto value;
+      case '"':
+	{
+	    const char *s;
+	    size_t len;
+	    enum parse_error ret = index_string(parser, &it, &p, e, &s, &len, validate);
+	    if (ret) RAISE(ret);
+	    COUNT(strings);
+	    EMIT_SLICE(parser, string, s, len);
+	}
+	goto value_end;
       default:
-	RAISE(ERR_INVALID);
-    }
-
-array_first_value:
-    SET_STATE(parser, STATE_ARRAY_FIRST_VALUE);
-    SKIP_WS();
-    ENSURE_READABLE(1);
-    if (*p == ']') {
-	p++;
-	POP_STATE(parser);
-	goto next_state;
+	q = index_peek(&it);
+	if (!q) q = idx->error ? idx->error : e;
+	if (index_scalar(parser, &p, q, e, validate)) goto invalid;
+	goto value_end;
     }
-    goto array_value;
-
-array_value:
-    SET_STATE(parser, STATE_ARRAY_VALUE_SEP);
-    PUSH_STATE(parser, STATE_VALUE);
-    goto value;
 
-array_value_sep:
-    SKIP_WS();
-    ENSURE_READABLE(1);
-    switch (*p++) {
-      case ',':
-	goto array_value;
-      case ']':
-	POP_STATE(parser);
-	goto next_state;
+value_end:
+    switch (parser_state_get(parser)) {
+      case STATE_OBJECT_VALUE_SEP:
+	p = index_next(&it);
+	if (!p) goto needmore;
+	if (*p == ',') {
+	    p = index_next(&it);
+	    if (!p) goto needmore;
+	    goto object_name;
+	}
+	if (*p != '}') goto invalid;
+	EMIT(parser, end_object);
+	parser_state_pop(parser);
+	goto value_end;
+      case STATE_ARRAY_VALUE_SEP:
+	p = index_next(&it);
+	if (!p) goto needmore;
+	if (*p == ',') goto value;
+	if (*p != ']') goto invalid;
+	EMIT(parser, end_array);
+	parser_state_pop(parser);
+	goto value_end;
       default:
-	RAISE(ERR_INVALID);
+	COUNT(documents);
+	PROBE_DOCUMENT_END(parser);
+	EMIT(parser, end_document);
+	parser_state_set(parser, STATE_FINISH);
+	p = index_next(&it);
+	if (p) {
+	    *pp = p;
+	    return ERR_EXTRABYTE;
+	}
+	*pp = e;
+	return ERR_SUCCESS;
     }
 
-finish:
-    SKIP_WS();
-    *pp = p;
-    if (p < e) {
-	return ERR_EXTRABYTE;
+object_name:
+    if (*p != '"') goto invalid;
+    {
+	const char *s;
+	size_t len;
+	enum parse_error ret = index_string(parser, &it, &p, e, &s, &len, validate);
+	if (ret) RAISE(ret);
+	COUNT(keys);
+	EMIT_SLICE(parser, key, s, len);
     }
-    return ERR_SUCCESS;
+    p = index_next(&it);
+    if (!p) goto needmore;
+    if (*p != ':') goto invalid;
+    goto value;
 
 needmore:
+    /* the index ended early: at the end of input or at a stage 1 error */
+    *pp = e;
     return ERR_NEEDMORE;
 invalid:
+    *pp = p;
     return ERR_INVALID;
 }
+
+/* the input is the whole document, [*pp, e), indexed by idx */
+enum parse_error
+parser_parse_index(parser_t *parser, const index_t *idx, const char **pp, const char *e) {
+    const char *s = *pp;
+    enum parse_error err;
+    PROBE_CHUNK_BEGIN(parser, e - s);
+    err = parser_parse_index0(parser, idx, pp, e, 0);
+    return chunk_end(parser, s, *pp, err);
+}
+
+enum parse_error
+parser_validate_index(parser_t *parser, const index_t *idx, const char **pp, const char *e) {
+    const char *s = *pp;
+    enum parse_error err;
+    PROBE_CHUNK_BEGIN(parser, e - s);
+    err = parser_parse_index0(parser, idx, pp, e, 1);
+    return chunk_end(parser, s, *pp, err);
+}
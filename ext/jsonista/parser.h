@@ -1,27 +1,157 @@
 #ifndef JSONISTA_PARSER_H
 #define JSONISTA_PARSER_H
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/*
+ * The streaming parser has no Ruby dependency: `rake lib` builds it with
+ * number.c, filter.c, scan.c and index.c into libjsonista.a and
+ * libjsonista.so for C programs, whose API is this header and filter.h.
+ * JSONISTA_PARSER_API is raised by changes to them, or to the layout of
+ * parser_t, that break such programs.
+ */
+#define JSONISTA_PARSER_API 2
+
 typedef struct stack_st parser_state_stack_t;
-typedef struct parser_buffer_st buffer_t;
-typedef struct {
+typedef struct index_st index_t;
+typedef struct filter_st filter_t;
+
+/*
+ * A number as accumulated while scanning:
+ * value = mantissa * 10^exponent, where mantissa holds the first 19
+ * significant digits; `truncated` is set when nonzero digits were dropped.
+ * p, len is the number text, for conversions that need every digit.
+ */
+typedef struct parser_number_st {
+    uint64_t mantissa;
+    int64_t exponent;
+    int digits;
+    int truncated;
+    int negative;
+    int is_float; /* has a fraction or an exponent */
+    const char *p;
+    size_t len;
+    /* scanner state, kept across chunks */
+    int phase;
+    int split;
+    int exp_negative;
+    int64_t exp_value;
+} parser_number_t;
+
+/* returns 0 if the number is not an integer in int64_t range */
+int parser_number_int64(const parser_number_t *num, int64_t *v);
+/* correctly rounded nearest double */
+double parser_number_double(const parser_number_t *num);
+
+/*
+ * Events fired by parser_parse_chunk while it scans, in document order.
+ * `data` is parser_t#data.  Any of them may be NULL.
+ * key/string slices are unescaped UTF-8; they and the number are only
+ * valid during the call.
+ * end_document fires once the top-level value is complete; in multi mode
+ * it fires for each document of the stream.
+ * With a filter, only the values at its paths are reported, each followed
+ * by match with the number of its path.  In nested mode a container is
+ * reported by its start event and match alone, and match fires once for
+ * each of the paths of a value.
+ */
+typedef struct parser_events_st {
+    void (*start_object)(void *data);
+    void (*end_object)(void *data);
+    void (*start_array)(void *data);
+    void (*end_array)(void *data);
+    void (*key)(void *data, const char *p, size_t len);
+    void (*string)(void *data, const char *p, size_t len);
+    void (*number)(void *data, const parser_number_t *num);
+    void (*true_value)(void *data);
+    void (*false_value)(void *data);
+    void (*null_value)(void *data);
+    void (*end_document)(void *data);
+    void (*match)(void *data, int path);
+} parser_events_t;
+
+/*
+ * Counters kept by every parse, since the parser was made.  Skipped
+ * values are counted as bytes only.
+ */
+typedef struct parser_stats_st {
+    size_t bytes;      /* consumed */
+    size_t objects, arrays, keys, strings, numbers, literals;
+    size_t documents;
+    size_t resumes;    /* chunks that ended in a token or a document */
+    size_t stack_grows, buffer_grows;
+    size_t max_depth;  /* of nested objects and arrays */
+} parser_stats_t;
+
+typedef struct parser_st {
     parser_state_stack_t *stack;
     buffer_t *buffer;
     const char *p;
+    parser_number_t number;
+    /* a string or a literal cut by the end of a chunk, resumed from here
+     * by the next: the string so far is in the buffer, and an escape or
+     * UTF-8 sequence it ends in is in tmp */
+    int string_split;
     char tmp[16];
-    void(*emit_number)(const char *p, const char *e);
+    size_t tmp_len;
+    const char *literal; /* "true", "false" or "null" */
+    size_t literal_len;  /* bytes of it matched */
+    size_t literal_pos;  /* input offset of its first byte */
+    const parser_events_t *events;
+    void *data;
+    int eof;
+    int multi; /* a stream of documents, e.g. newline-delimited JSON */
+    /* input bytes consumed since parser_init, and the input offset of the
+     * last ERR_INVALID: that of the byte *pp stopped at, or that of the
+     * first byte of a literal which began in an earlier chunk */
+    size_t offset, error_pos;
+    /* source bytes of the value or key being reported by
+     * parser_parse_chunk: start_object and start_array only set token,
+     * end_object and end_array only token_end (one past the bracket).
+     * Tokens continued from an earlier chunk start in that chunk. */
+    const char *token, *token_end;
+    filter_t *filter; /* paths to extract, see parser_set_filter */
+    /* containers nested deeper fail with ERR_NESTING; 0 for no limit.
+     * The stack takes a bit per level. */
+    long max_nesting;
+    parser_stats_t stats;
 } parser_t;
 
+#define PARSER_MAX_NESTING 100
+
 
-parser_t *parser_new();
+/* the parser, its state stack and its buffer come in one allocation,
+ * which holds their first 512 levels and 4KB; max_nesting is
+ * PARSER_MAX_NESTING */
+parser_t *parser_new(void);
 void parser_init(parser_t *parser);
 void parser_free(parser_t *parser);
+/* parser_init, and gives back the memory the stack and the buffer
+ * allocated beyond their initial storage */
+void parser_trim(parser_t *parser);
+/* report only the values at the paths of filter, which the parser owns
+ * from now on; set the events first */
+void parser_set_filter(parser_t *parser, filter_t *filter);
 size_t parser_memsize(parser_t *parser);
+/* the counters, with the growths of the stack and the buffer */
+void parser_stats(parser_t *parser, parser_stats_t *stats);
 
 enum parse_error {
     ERR_SUCCESS = 0,
     ERR_NEEDMORE,
     ERR_INVALID,
     ERR_EXTRABYTE,
+    ERR_NESTING, /* *pp is the bracket past max_nesting */
 };
+/* on ERR_NEEDMORE all of [*pp, e) is consumed: the next chunk goes on
+ * from where this one ends, whatever token it ends in */
 enum parse_error parser_parse_chunk(parser_t *parser, const char **pp, const char *e);
+enum parse_error parser_parse_end(parser_t *parser, const char **pp, const char *e);
+enum parse_error parser_validate_chunk(parser_t *parser, const char **pp, const char *e);
+enum parse_error parser_validate_end(parser_t *parser, const char **pp, const char *e);
+/* stage 2 of the two-stage mode; on ERR_NEEDMORE the index ended early */
+enum parse_error parser_parse_index(parser_t *parser, const index_t *idx, const char **pp, const char *e);
+enum parse_error parser_validate_index(parser_t *parser, const index_t *idx, const char **pp, const char *e);
 
 #endif
@@ -0,0 +1,420 @@
+/*
+ * The streaming state machine of parser.c, which includes this once for
+ * each of its copies: PARSER_MACHINE names the function and
+ * PARSER_MACHINE_VALIDATE is 1 for the validation-only copy.  A function
+ * with computed goto is never inlined, so the copies can't come from
+ * inlining one function with a constant argument as the scanners do.
+ */
+
+static enum parse_error
+PARSER_MACHINE(parser_t *parser, const char **pp, const char *e) {
+    const int validate = PARSER_MACHINE_VALIDATE;
+    const char *p = *pp;
+#ifdef USE_COMPUTED_GOTO
+    static const void *const state_labels[] = {
+	[STATE_INIT] = &&state_init,
+	[STATE_VALUE] = &&state_value,
+	[STATE_OBJECT_FIRST_NAME] = &&object_first_name,
+	[STATE_OBJECT_NAME] = &&object_name,
+	[STATE_OBJECT_NAME_SEP] = &&object_name_sep,
+	[STATE_OBJECT_VALUE] = &&object_value,
+	[STATE_OBJECT_VALUE_SEP] = &&state_object_value_sep,
+	[STATE_ARRAY_FIRST_VALUE] = &&state_array_first_value,
+	[STATE_ARRAY_VALUE] = &&array_value,
+	[STATE_ARRAY_VALUE_SEP] = &&state_array_value_sep,
+	[STATE_NUMBER] = &&number,
+	[STATE_STRING] = &&state_string,
+	[STATE_KEY] = &&state_key,
+	[STATE_LITERAL] = &&state_literal,
+	[STATE_SKIP] = &&skip,
+	[STATE_DOCUMENT_END] = &&state_document_end,
+	[STATE_FINISH] = &&state_finish,
+	[STATE_BUG] = &&state_bug,
+    };
+#endif
+    parser->p = p;
+
+#ifdef USE_COMPUTED_GOTO
+    NEXT_STATE();
+#else
+next_state:
+    switch (parser_state_get(parser)) {
+      case STATE_INIT: goto state_init;
+      case STATE_VALUE: goto state_value;
+      case STATE_OBJECT_FIRST_NAME: goto object_first_name;
+      case STATE_OBJECT_NAME: goto object_name;
+      case STATE_OBJECT_NAME_SEP: goto object_name_sep;
+      case STATE_OBJECT_VALUE: goto object_value;
+      case STATE_OBJECT_VALUE_SEP: goto state_object_value_sep;
+      case STATE_ARRAY_FIRST_VALUE: goto state_array_first_value;
+      case STATE_ARRAY_VALUE: goto array_value;
+      case STATE_ARRAY_VALUE_SEP: goto state_array_value_sep;
+      case STATE_NUMBER: goto number;
+      case STATE_STRING: goto state_string;
+      case STATE_KEY: goto state_key;
+      case STATE_LITERAL: goto state_literal;
+      case STATE_SKIP: goto skip;
+      case STATE_DOCUMENT_END: goto state_document_end;
+      case STATE_FINISH: goto state_finish;
+      default: goto state_bug;
+    }
+#endif
+
+state_init:
+    TRACE("state: STATE_INIT\n");
+    goto document;
+state_value:
+    TRACE("state: STATE_VALUE\n");
+    goto value;
+state_document_end:
+    COUNT(documents);
+    PROBE_DOCUMENT_END(parser);
+    EMIT(parser, end_document);
+    if (parser->multi) {
+	/* the stack is back at its bottom; start over in place */
+	buffer_clear(parser->buffer);
+	SET_STATE(parser, STATE_INIT);
+	goto document;
+    }
+    SET_STATE(parser, STATE_FINISH);
+state_finish:
+    TRACE("state: STATE_FINISH\n");
+    goto finish;
+state_object_value_sep:
+    TRACE("state: STATE_OBJECT_VALUE_SEP\n");
+    goto object_value_sep;
+state_array_first_value:
+    TRACE("state: STATE_ARRAY_FIRST_VALUE\n");
+    goto array_first_value;
+state_array_value_sep:
+    TRACE("state: STATE_ARRAY_VALUE_SEP\n");
+    goto array_value_sep;
+state_string:
+    TRACE("state: STATE_STRING\n");
+    {
+	enum parse_error ret = string_resume(parser, &p, e, validate);
+	if (ret == ERR_NEEDMORE) SET_STATE(parser, STATE_STRING);
+	if (ret) RAISE(ret);
+    }
+    goto string;
+state_key:
+    TRACE("state: STATE_KEY\n");
+    {
+	enum parse_error ret = string_resume(parser, &p, e, validate);
+	if (ret == ERR_NEEDMORE) SET_STATE(parser, STATE_KEY);
+	if (ret) RAISE(ret);
+    }
+    goto key;
+state_literal:
+    TRACE("state: STATE_LITERAL\n");
+    {
+	const char *lit = parser->literal;
+	size_t i = parser->literal_len;
+	for (; lit[i]; i++, p++) {
+	    if (p == e) {
+		parser->literal_len = i;
+		SET_STATE(parser, STATE_LITERAL);
+		goto needmore;
+	    }
+	    if (*p != lit[i]) {
+		/* reported where the literal begins, as in a single chunk */
+		parser->error_pos = parser->literal_pos;
+		goto invalid_at;
+	    }
+	}
+	switch (lit[0]) {
+	  case 't': goto literal_true;
+	  case 'f': goto literal_false;
+	  default: goto literal_null;
+	}
+    }
+state_bug:
+    fprintf(stderr, "unknown state: %d\n", parser_state_get(parser));
+    abort();
+
+document:
+    if (parser->multi) {
+	SKIP_WS();
+	if (p == e) {
+	    /* between documents: everything is consumed */
+	    *pp = parser->p = p;
+	    return ERR_SUCCESS;
+	}
+    }
+    SET_STATE(parser, STATE_DOCUMENT_END);
+    PUSH_STATE(parser, STATE_VALUE);
+    if (FILTERING) parser->filter->next = 1; /* the root */
+
+value:
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    TOKEN_START();
+    if (FILTERING && parser->filter->nesting < 0 &&
+	filter_value(parser, *p) == FILTER_SKIP) {
+	SET_STATE(parser, STATE_SKIP);
+	goto skip;
+    }
+    switch (value_class[(unsigned char)*p++]) {
+      case VALUE_OBJECT:
+	CHECK_NESTING(parser->stack->depth, p - 1);
+	FILTER_OPEN();
+	COUNT(objects);
+	EMIT(parser, start_object);
+	goto object_first_name;
+      case VALUE_ARRAY:
+	CHECK_NESTING(parser->stack->depth, p - 1);
+	FILTER_OPEN();
+	COUNT(arrays);
+	EMIT(parser, start_array);
+	goto array_first_value;
+      case VALUE_STRING:
+	goto string;
+      case VALUE_NUMBER:
+	p--;
+	number_init(&parser->number);
+	goto number;
+      case VALUE_TRUE:
+	if (e - p < 3) goto literal_split;
+	if (memcmp(p, "rue", 3)) {
+	    p--;
+	    RAISE(ERR_INVALID);
+	}
+	p += 3;
+      literal_true:
+	TOKEN_END();
+	COUNT(literals);
+	EMIT(parser, true_value);
+	FILTER_SCALAR();
+	break;
+      case VALUE_FALSE:
+	if (e - p < 4) goto literal_split;
+	if (memcmp(p, "alse", 4)) {
+	    p--;
+	    RAISE(ERR_INVALID);
+	}
+	p += 4;
+      literal_false:
+	TOKEN_END();
+	COUNT(literals);
+	EMIT(parser, false_value);
+	FILTER_SCALAR();
+	break;
+      case VALUE_NULL:
+	if (e - p < 3) goto literal_split;
+	if (memcmp(p, "ull", 3)) {
+	    p--;
+	    RAISE(ERR_INVALID);
+	}
+	p += 3;
+      literal_null:
+	TOKEN_END();
+	COUNT(literals);
+	EMIT(parser, null_value);
+	FILTER_SCALAR();
+	break;
+      default:
+	p--;
+	RAISE(ERR_INVALID);
+    }
+    POP_STATE(parser);
+    NEXT_STATE();
+
+literal_split:
+    /* the chunk ends in the literal led by p[-1]: match what it has */
+    {
+	const char *lit = p[-1] == 't' ? "true" : p[-1] == 'f' ? "false" : "null";
+	if (memcmp(p, lit + 1, e - p)) {
+	    p--;
+	    RAISE(ERR_INVALID);
+	}
+	parser->literal = lit;
+	parser->literal_len = 1 + (e - p);
+	parser->literal_pos = parser->offset + (p - 1 - *pp);
+	p = e;
+	SET_STATE(parser, STATE_LITERAL);
+	goto needmore;
+    }
+
+string:
+    {
+	const char *s;
+	size_t len;
+	enum parse_error ret = parse_string0(parser, &p, e, &s, &len, validate);
+	if (ret == ERR_NEEDMORE) {
+	    ret = string_split(parser, &p, e);
+	    SET_STATE(parser, STATE_STRING);
+	}
+	if (ret) RAISE(ret);
+	TOKEN_END();
+	COUNT(strings);
+	EMIT_SLICE(parser, string, s, len);
+	FILTER_SCALAR();
+    }
+    POP_STATE(parser);
+    NEXT_STATE();
+
+number:
+    {
+	enum parse_error ret = parse_number(parser, &p, e, validate);
+	if (ret == ERR_NEEDMORE) {
+	    /* the number so far is consumed */
+	    SET_STATE(parser, STATE_NUMBER);
+	}
+	if (ret) RAISE(ret);
+    }
+    TOKEN_END();
+    COUNT(numbers);
+    EMIT_ARG(parser, number, &parser->number);
+    FILTER_SCALAR();
+    POP_STATE(parser);
+    NEXT_STATE();
+
+skip:
+    {
+	enum parse_error ret = skip_value(parser, &p, e);
+	if (ret == ERR_NEEDMORE) {
+	    /* nothing to keep for the next chunk */
+	    parser->p = p;
+	}
+	if (ret) RAISE(ret);
+    }
+    POP_STATE(parser);
+    NEXT_STATE();
+
+object_first_name:
+    SET_STATE(parser, STATE_OBJECT_FIRST_NAME);
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    switch (*p) {
+      case '"':
+	goto object_name;
+      case '}':
+	p++;
+	goto object_end;
+      default:
+	RAISE(ERR_INVALID);
+    }
+
+object_name:
+    SET_STATE(parser, STATE_OBJECT_NAME);
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    if (*p != '"') RAISE(ERR_INVALID);
+    TOKEN_START();
+    p++;
+key:
+    {
+	const char *s;
+	size_t len;
+	enum parse_error ret = parse_string0(parser, &p, e, &s, &len, validate);
+	if (ret == ERR_NEEDMORE) {
+	    ret = string_split(parser, &p, e);
+	    SET_STATE(parser, STATE_KEY);
+	}
+	if (ret) RAISE(ret);
+	TOKEN_END();
+	if (FILTERING && parser->filter->nesting < 0) {
+	    parser->filter->next = filter_key(parser->filter, s, len);
+	}
+	COUNT(keys);
+	EMIT_SLICE(parser, key, s, len);
+    }
+
+object_name_sep:
+    SET_STATE(parser, STATE_OBJECT_NAME_SEP);
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    switch (*p++) {
+      case ':':
+	goto object_value;
+      default:
+	p--;
+	RAISE(ERR_INVALID);
+    }
+
+object_value:
+    SET_STATE(parser, STATE_OBJECT_VALUE_SEP);
+    PUSH_STATE(parser, STATE_VALUE);
+    goto value;
+
+object_value_sep:
+    SET_STATE(parser, STATE_OBJECT_VALUE_SEP);
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    switch (*p++) {
+      case ',':
+	goto object_name;
+      case '}':
+	goto object_end;
+      default:
+	p--;
+	RAISE(ERR_INVALID);
+    }
+
+object_end:
+    TOKEN_END();
+    EMIT(parser, end_object);
+    FILTER_CLOSE();
+    POP_STATE(parser);
+    NEXT_STATE();
+
+array_first_value:
+    SET_STATE(parser, STATE_ARRAY_FIRST_VALUE);
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    if (*p == ']') {
+	p++;
+	goto array_end;
+    }
+    goto array_value;
+
+array_value:
+    SET_STATE(parser, STATE_ARRAY_VALUE_SEP);
+    PUSH_STATE(parser, STATE_VALUE);
+    if (FILTERING && parser->filter->nesting < 0) {
+	parser->filter->next = filter_index(parser->filter);
+    }
+    goto value;
+
+array_value_sep:
+    SET_STATE(parser, STATE_ARRAY_VALUE_SEP);
+    SKIP_WS();
+    ENSURE_READABLE(1);
+    switch (*p++) {
+      case ',':
+	goto array_value;
+      case ']':
+	goto array_end;
+      default:
+	p--;
+	RAISE(ERR_INVALID);
+    }
+
+array_end:
+    TOKEN_END();
+    EMIT(parser, end_array);
+    FILTER_CLOSE();
+    POP_STATE(parser);
+    NEXT_STATE();
+
+finish:
+    SKIP_WS();
+    *pp = parser->p = p;
+    if (p < e) {
+	return ERR_EXTRABYTE;
+    }
+    return ERR_SUCCESS;
+
+needmore:
+    /* the state holds what is left of the token the chunk ends in */
+    *pp = parser->p = p;
+    return ERR_NEEDMORE;
+invalid:
+    parser->error_pos = parser->offset + (p - *pp);
+invalid_at:
+    *pp = p;
+    return ERR_INVALID;
+}
+
+#undef PARSER_MACHINE
+#undef PARSER_MACHINE_VALIDATE
@@ -0,0 +1,227 @@
+#include "pool.h"
+
+VALUE cParserPool;
+static ID id_size, id_max_retained, id_finish;
+
+#define POOL_DEFAULT_SIZE 8
+#define POOL_DEFAULT_MAX_RETAINED (64 * 1024)
+
+/*
+ * Parsers checked in are reset and kept for the next checkout.  The
+ * checks and the Array operations run without calling Ruby code, so the
+ * GVL makes them atomic.
+ */
+typedef struct {
+    VALUE opts;  /* options of the parsers, frozen, or nil */
+    VALUE idle;  /* parsers ready for checkout */
+    long size;   /* at most this many are kept */
+    size_t max_retained; /* bytes an idle parser may hold */
+} pool_t;
+
+static void
+pool_mark(void *ptr) {
+    pool_t *pool = ptr;
+    rb_gc_mark(pool->opts);
+    rb_gc_mark(pool->idle);
+}
+
+static size_t
+pool_memsize(const void *ptr) {
+    return sizeof(pool_t);
+}
+
+static const rb_data_type_t pool_data_type = {
+    "jsonista_parser_pool",
+    {
+	pool_mark, RUBY_TYPED_DEFAULT_FREE, pool_memsize,
+    },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+    0,
+    0,
+    RUBY_TYPED_FREE_IMMEDIATELY|RUBY_TYPED_WB_PROTECTED
+#endif
+};
+
+static VALUE
+pool_s_alloc(VALUE klass)
+{
+    pool_t *pool;
+    VALUE obj = TypedData_Make_Struct(klass, pool_t, &pool_data_type, pool);
+    pool->opts = Qnil;
+    pool->idle = Qnil;
+    return obj;
+}
+
+static pool_t *
+pool_get(VALUE self)
+{
+    pool_t *pool = rb_check_typeddata(self, &pool_data_type);
+    if (NIL_P(pool->idle)) {
+	rb_raise(rb_eTypeError, "uninitialized %" PRIsVALUE, rb_obj_class(self));
+    }
+    return pool;
+}
+
+/*
+ * @overload new(size: 8, max_retained: 65536, **opts)
+ *   @param size [Integer] the number of idle parsers kept
+ *   @param max_retained [Integer] the bytes an idle parser may hold
+ *   @param opts [Hash] options of Parser.new for the parsers
+ *
+ * returns a pool of parsers created with opts
+ *
+ * A parser checked in is reset.  If it holds more than max_retained
+ * bytes, say after a large document, the stack and buffer memory it
+ * allocated beyond its initial arena is freed; parsers beyond size are
+ * left to the GC.  The read buffer of Parser#parse_io (128KB) and the
+ * window of Parser#parse_gzip_chunk (64KB) have a fixed size; they are
+ * not counted and are kept once used.
+ */
+static VALUE
+pool_initialize(int argc, VALUE *argv, VALUE self)
+{
+    pool_t *pool = rb_check_typeddata(self, &pool_data_type);
+    VALUE opts, v;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(pool->idle)) {
+	rb_raise(rb_eTypeError, "already initialized %" PRIsVALUE, rb_obj_class(self));
+    }
+    pool->size = POOL_DEFAULT_SIZE;
+    pool->max_retained = POOL_DEFAULT_MAX_RETAINED;
+    if (!NIL_P(opts)) {
+	opts = rb_hash_dup(opts);
+	v = rb_hash_delete(opts, ID2SYM(id_size));
+	if (!NIL_P(v)) pool->size = NUM2LONG(v);
+	v = rb_hash_delete(opts, ID2SYM(id_max_retained));
+	if (!NIL_P(v)) pool->max_retained = NUM2SIZET(v);
+	if (pool->size < 0) rb_raise(rb_eArgError, "negative size");
+	RB_OBJ_WRITE(self, &pool->opts, rb_hash_freeze(opts));
+    }
+    RB_OBJ_WRITE(self, &pool->idle, rb_ary_new_capa(pool->size));
+    /* checks the options */
+    rb_ary_push(pool->idle, jsonista_parser_new(pool->opts));
+    return self;
+}
+
+/*
+ * @overload checkout()
+ *
+ * returns an idle parser, or a new one
+ */
+static VALUE
+pool_checkout(VALUE self)
+{
+    pool_t *pool = pool_get(self);
+    VALUE parser = RARRAY_LEN(pool->idle) ? rb_ary_pop(pool->idle)
+					  : jsonista_parser_new(pool->opts);
+    jsonista_parser_set_pool(parser, self);
+    return parser;
+}
+
+/*
+ * @overload checkin(parser)
+ *   @param parser [Jsonista::Parser] a parser from #checkout
+ *
+ * resets the parser and keeps it for the next checkout; returns nil.
+ * Raises ArgumentError for a parser not checked out of this pool, or
+ * checked in already.
+ */
+static VALUE
+pool_checkin(VALUE self, VALUE parser)
+{
+    pool_t *pool = pool_get(self);
+    if (jsonista_parser_pool(parser) != self) {
+	rb_raise(rb_eArgError, "parser not checked out of this pool");
+    }
+    jsonista_parser_set_pool(parser, Qnil);
+    jsonista_parser_recycle(parser, pool->max_retained);
+    if (RARRAY_LEN(pool->idle) < pool->size) rb_ary_push(pool->idle, parser);
+    return Qnil;
+}
+
+/* a parser checked out for a block or a parse */
+struct pool_use {
+    VALUE self;
+    VALUE parser;
+    VALUE str;
+};
+
+static VALUE
+pool_use_end(VALUE ptr)
+{
+    struct pool_use *u = (struct pool_use *)ptr;
+    return pool_checkin(u->self, u->parser);
+}
+
+static VALUE
+pool_with_i(VALUE ptr)
+{
+    return rb_yield(((struct pool_use *)ptr)->parser);
+}
+
+/*
+ * @overload with { |parser| ... }
+ *
+ * yields a parser checked out for the block and returns the block value
+ */
+static VALUE
+pool_with(VALUE self)
+{
+    struct pool_use u;
+    u.self = self;
+    u.parser = pool_checkout(self);
+    u.str = Qnil;
+    return rb_ensure(pool_with_i, (VALUE)&u, pool_use_end, (VALUE)&u);
+}
+
+static VALUE
+pool_parse_i(VALUE ptr)
+{
+    struct pool_use *u = (struct pool_use *)ptr;
+    return rb_funcallv(u->parser, id_finish, 1, &u->str);
+}
+
+/*
+ * @overload parse(str)
+ *   @param str [String] one JSON document
+ *
+ * returns the document parsed by a parser of the pool
+ */
+static VALUE
+pool_parse(VALUE self, VALUE str)
+{
+    struct pool_use u;
+    u.self = self;
+    u.parser = pool_checkout(self);
+    u.str = str;
+    return rb_ensure(pool_parse_i, (VALUE)&u, pool_use_end, (VALUE)&u);
+}
+
+/*
+ * @overload idle()
+ *
+ * returns the number of parsers ready for checkout
+ */
+static VALUE
+pool_idle(VALUE self)
+{
+    return LONG2NUM(RARRAY_LEN(pool_get(self)->idle));
+}
+
+void
+Init_jsonista_pool(VALUE mJsonista)
+{
+    cParserPool = rb_define_class_under(mJsonista, "ParserPool", rb_cObject);
+    rb_define_alloc_func(cParserPool, pool_s_alloc);
+    rb_define_method(cParserPool, "initialize", pool_initialize, -1);
+    rb_define_method(cParserPool, "checkout", pool_checkout, 0);
+    rb_define_method(cParserPool, "checkin", pool_checkin, 1);
+    rb_define_method(cParserPool, "with", pool_with, 0);
+    rb_define_method(cParserPool, "parse", pool_parse, 1);
+    rb_define_method(cParserPool, "idle", pool_idle, 0);
+
+    id_size = rb_intern("size");
+    id_max_retained = rb_intern("max_retained");
+    id_finish = rb_intern("finish");
+}
@@ -0,0 +1,10 @@
+#ifndef JSONISTA_POOL_H
+#define JSONISTA_POOL_H 1
+
+#include "jsonista.h"
+
+extern VALUE cParserPool;
+
+void Init_jsonista_pool(VALUE mJsonista);
+
+#endif /* JSONISTA_POOL_H */
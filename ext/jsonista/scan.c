@@ -0,0 +1,307 @@
+#include "scan.h"
+
+#ifdef SCAN_X86
+#include <immintrin.h>
+#endif
+
+static const char *scan_skip_ws_resolve(const char *p, const char *e);
+static const char *scan_string_resolve(const char *p, const char *e);
+static const char *scan_escape_resolve(const char *p, const char *e);
+
+scan_func_t scan_skip_ws_impl = scan_skip_ws_resolve;
+scan_func_t scan_string_impl = scan_string_resolve;
+scan_func_t scan_escape_impl = scan_escape_resolve;
+static const char *scan_name = "scalar";
+
+static int
+scan_isws(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+const char *
+scan_skip_ws_scalar(const char *p, const char *e) {
+    while (p < e && scan_isws(*p)) p++;
+    return p;
+}
+
+/* the per-character ladder in parse_string0 is the scalar path */
+const char *
+scan_string_scalar(const char *p, const char *e) {
+    (void)e;
+    return p;
+}
+
+const char *
+scan_escape_scalar(const char *p, const char *e) {
+    while (p < e && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+    return p;
+}
+
+/* back up from a block boundary to the start of the character there */
+static const char *
+scan_char_boundary(const char *start, const char *p) {
+    const char *q = p;
+    while (q > start && ((unsigned char)q[-1] & 0xC0) == 0x80) q--;
+    if (q > start && (unsigned char)q[-1] >= 0xC0) q--;
+    return q < p ? q : p;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+const char *
+scan_skip_ws_sse2(const char *p, const char *e) {
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i ht = _mm_set1_epi8('\t');
+    while (e - p >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, nl)),
+				  _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, ht)));
+	unsigned int m = ~(unsigned int)_mm_movemask_epi8(ws) & 0xFFFF;
+	if (m) return p + __builtin_ctz(m);
+	p += 16;
+    }
+    return scan_skip_ws_scalar(p, e);
+}
+
+__attribute__((target("avx2")))
+const char *
+scan_skip_ws_avx2(const char *p, const char *e) {
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i ht = _mm256_set1_epi8('\t');
+    while (e - p >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, nl)),
+				     _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, ht)));
+	unsigned int m = ~(unsigned int)_mm256_movemask_epi8(ws);
+	if (m) return p + __builtin_ctz(m);
+	p += 32;
+    }
+    return scan_skip_ws_sse2(p, e);
+}
+
+/* ASCII runs only; any non-ASCII byte goes to the scalar ladder */
+__attribute__((target("sse2")))
+const char *
+scan_string_sse2(const char *p, const char *e) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    while (e - p >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+				       _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+	unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_or_si128(special, v));
+	if (m) return p + __builtin_ctz(m);
+	p += 16;
+    }
+    return p;
+}
+
+__attribute__((target("sse2")))
+const char *
+scan_escape_sse2(const char *p, const char *e) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    while (e - p >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+				       _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+	unsigned int m = (unsigned int)_mm_movemask_epi8(special);
+	if (m) return p + __builtin_ctz(m);
+	p += 16;
+    }
+    return scan_escape_scalar(p, e);
+}
+
+__attribute__((target("avx2")))
+const char *
+scan_escape_avx2(const char *p, const char *e) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1F);
+    while (e - p >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+					  _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v));
+	unsigned int m = (unsigned int)_mm256_movemask_epi8(special);
+	if (m) return p + __builtin_ctz(m);
+	p += 32;
+    }
+    return scan_escape_sse2(p, e);
+}
+
+/*
+ * UTF-8 validation by table lookup (Keiser and Lemire, "Validating UTF-8
+ * In Less Than One Instruction Per Byte"): each byte pair is classified
+ * by the high and low nibble of the first byte and the high nibble of the
+ * second; the three class sets have a common bit only for invalid pairs.
+ */
+#define U8_TOO_SHORT   (1<<0)
+#define U8_TOO_LONG    (1<<1)
+#define U8_OVERLONG_3  (1<<2)
+#define U8_TOO_LARGE   (1<<3)
+#define U8_SURROGATE   (1<<4)
+#define U8_OVERLONG_2  (1<<5)
+#define U8_TOO_LARGE_1000 (1<<6)
+#define U8_OVERLONG_4  (1<<6)
+#define U8_TWO_CONTS   (1<<7)
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+    _mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, \
+		     a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+__attribute__((target("avx2")))
+static __m256i
+u8_prev(__m256i input, __m256i prev_input, int n) {
+    __m256i t = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    switch (n) {
+      case 1: return _mm256_alignr_epi8(input, t, 15);
+      case 2: return _mm256_alignr_epi8(input, t, 14);
+      default: return _mm256_alignr_epi8(input, t, 13);
+    }
+}
+
+__attribute__((target("avx2")))
+static __m256i
+u8_errors(__m256i input, __m256i prev_input) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_tbl = U8_TABLE(
+	U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+	U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+	U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+	U8_TOO_SHORT | U8_OVERLONG_2,
+	U8_TOO_SHORT,
+	U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+	U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+    const __m256i byte_1_low_tbl = U8_TABLE(
+	U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+	U8_CARRY | U8_OVERLONG_2,
+	U8_CARRY,
+	U8_CARRY,
+	U8_CARRY | U8_TOO_LARGE,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+    const __m256i byte_2_high_tbl = U8_TABLE(
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+    __m256i prev1 = u8_prev(input, prev_input, 1);
+    __m256i prev2 = u8_prev(input, prev_input, 2);
+    __m256i prev3 = u8_prev(input, prev_input, 3);
+    __m256i sc = _mm256_and_si256(
+	_mm256_and_si256(
+	    _mm256_shuffle_epi8(byte_1_high_tbl, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+	    _mm256_shuffle_epi8(byte_1_low_tbl, _mm256_and_si256(prev1, nibble))),
+	_mm256_shuffle_epi8(byte_2_high_tbl, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+    /* the third and fourth bytes of 3/4-byte characters must be continuations */
+    __m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23_80, sc);
+}
+
+__attribute__((target("avx2")))
+const char *
+scan_string_avx2(const char *p, const char *e) {
+    const char *start = p;
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1F);
+    /* last bytes of an unfinished character at the end of the block */
+    const __m256i incomplete_max = _mm256_setr_epi8(
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	(char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    while (e - p >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+					  _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v));
+	__m256i error;
+	if (!_mm256_testz_si256(special, special)) break;
+	if (_mm256_movemask_epi8(v) == 0) {
+	    /* ASCII block: only an unfinished character before it can fail */
+	    if (!_mm256_testz_si256(prev_incomplete, prev_incomplete)) break;
+	}
+	else {
+	    error = u8_errors(v, prev_input);
+	    if (!_mm256_testz_si256(error, error)) break;
+	}
+	prev_incomplete = _mm256_subs_epu8(v, incomplete_max);
+	prev_input = v;
+	p += 32;
+    }
+    return scan_char_boundary(start, p);
+}
+#endif
+
+void
+scan_init(void) {
+    scan_func_t skip_ws = scan_skip_ws_scalar;
+    scan_func_t string = scan_string_scalar;
+    scan_func_t escape = scan_escape_scalar;
+    const char *name = "scalar";
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	skip_ws = scan_skip_ws_avx2;
+	string = scan_string_avx2;
+	escape = scan_escape_avx2;
+	name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+	skip_ws = scan_skip_ws_sse2;
+	string = scan_string_sse2;
+	escape = scan_escape_sse2;
+	name = "sse2";
+    }
+#endif
+    scan_name = name;
+    scan_skip_ws_impl = skip_ws;
+    scan_string_impl = string;
+    scan_escape_impl = escape;
+}
+
+const char *
+scan_impl_name(void) {
+    if (scan_skip_ws_impl == scan_skip_ws_resolve) scan_init();
+    return scan_name;
+}
+
+static const char *
+scan_skip_ws_resolve(const char *p, const char *e) {
+    scan_init();
+    return scan_skip_ws_impl(p, e);
+}
+
+static const char *
+scan_string_resolve(const char *p, const char *e) {
+    scan_init();
+    return scan_string_impl(p, e);
+}
+
+static const char *
+scan_escape_resolve(const char *p, const char *e) {
+    scan_init();
+    return scan_escape_impl(p, e);
+}
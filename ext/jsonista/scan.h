@@ -0,0 +1,59 @@
+#ifndef JSONISTA_SCAN_H
+#define JSONISTA_SCAN_H
+#include <stddef.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define SCAN_X86 1
+#endif
+
+typedef const char *(*scan_func_t)(const char *p, const char *e);
+
+/* returns the first byte in [p, e) which is not JSON whitespace, or e */
+extern scan_func_t scan_skip_ws_impl;
+
+/*
+ * returns the end of the longest prefix of [p, e) found to be complete,
+ * valid UTF-8 without '"', '\\' or control characters; [p, e) must start
+ * at a character boundary.  It may stop early (it works in blocks and
+ * leaves tails to the caller), but never splits a character.
+ */
+extern scan_func_t scan_string_impl;
+
+/* returns the first byte in [p, e) which must be escaped in a JSON
+ * string ('"', '\\' or a control character), or e */
+extern scan_func_t scan_escape_impl;
+
+const char *scan_skip_ws_scalar(const char *p, const char *e);
+const char *scan_string_scalar(const char *p, const char *e);
+const char *scan_escape_scalar(const char *p, const char *e);
+#ifdef SCAN_X86
+const char *scan_skip_ws_sse2(const char *p, const char *e);
+const char *scan_skip_ws_avx2(const char *p, const char *e);
+const char *scan_string_sse2(const char *p, const char *e);
+const char *scan_string_avx2(const char *p, const char *e);
+const char *scan_escape_sse2(const char *p, const char *e);
+const char *scan_escape_avx2(const char *p, const char *e);
+#endif
+
+/* select kernels for the running CPU; called lazily on first use */
+void scan_init(void);
+const char *scan_impl_name(void);
+
+static inline const char *
+scan_skip_ws(const char *p, const char *e) {
+    /* compact JSON: no whitespace, or a single space after ':' or ',' */
+    if (p < e && (unsigned char)*p > ' ') return p;
+    if (e - p > 1 && *p == ' ' && (unsigned char)p[1] > ' ') return p + 1;
+    return scan_skip_ws_impl(p, e);
+}
+
+/* only worth a call when there is at least one block to check */
+#define SCAN_STRING_MIN 32
+
+static inline const char *
+scan_string(const char *p, const char *e) {
+    if (e - p < SCAN_STRING_MIN) return p;
+    return scan_string_impl(p, e);
+}
+
+#endif
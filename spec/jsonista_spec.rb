@@ -1,4 +1,8 @@
 require "spec_helper"
+require "stringio"
+require "tmpdir"
+require "objspace"
+require "zlib"
 
 RSpec.describe Jsonista do
   it "has a version number" do
@@ -13,26 +17,58 @@ RSpec.describe Jsonista do
 
   describe "#parse_chunk" do
     let(:parser){ Jsonista::Parser.new }
-    it "returns nil" do
-      expect(parser.parse_chunk("[]")).to be_nil
+    it "returns parsed value" do
+      expect(parser.parse_chunk("[]")).to eq([])
       parser.reset
-      expect(parser.parse_chunk("{}")).to be_nil
+      expect(parser.parse_chunk("{}")).to eq({})
       parser.reset
-      expect(parser.parse_chunk("1")).to be_nil
+      expect(parser.finish("1")).to eq(1)
       parser.reset
-      expect(parser.parse_chunk("true")).to be_nil
+      expect(parser.parse_chunk("true")).to eq(true)
       parser.reset
-      expect(parser.parse_chunk("false")).to be_nil
+      expect(parser.parse_chunk("false")).to eq(false)
       parser.reset
       expect(parser.parse_chunk("null")).to be_nil
       parser.reset
-      expect(parser.parse_chunk("\"foo\"")).to be_nil
+      expect(parser.parse_chunk("\"foo\"")).to eq("foo")
+      parser.reset
+      expect(parser.parse_chunk('"foo\b\/\"\\\\z"')).to eq("foo\b/\"\\z")
+      parser.reset
+      expect(parser.parse_chunk('"\u3042\u3044\u3046"')).to eq("\u3042\u3044\u3046")
       parser.reset
-      expect(parser.parse_chunk('"foo\b\/\"\\\\z"')).to be_nil
+      expect(parser.parse_chunk('"\uD842\uDFB7\u91CE\u5BB6"')).to eq("\u{20BB7}\u91CE\u5BB6")
+      parser.reset
+      expect(parser.parse_chunk("\"\u3042\u{1F600}\"")).to eq("\u3042\u{1F600}")
+    end
+    it "builds nested containers" do
+      expect(parser.parse_chunk('{"a": [1, -2.5, 1e3, "x", {"b": null}], "c": true}')).to eq(
+        {"a" => [1, -2.5, 1000.0, "x", {"b" => nil}], "c" => true})
       parser.reset
-      expect(parser.parse_chunk('"\u3042\u3044\u3046"')).to be_nil
+      expect(parser.parse_chunk('[123456789012345678901234567890, -0, 0.1E-1]')).to eq(
+        [123456789012345678901234567890, 0, 0.01])
+    end
+    it "parses deep nesting" do
+      depth = 5000
+      parser = Jsonista::Parser.new(max_nesting: false)
+      expect(parser.finish("[" * depth + "1" + "]" * depth).flatten).to eq([1])
       parser.reset
-      expect(parser.parse_chunk('"\uD842\uDFB7\u91CE\u5BB6"')).to be_nil
+      expect(parser.finish('{"a":' * depth + "1" + "}" * depth)).to be_a(Hash)
+    end
+    it "counts what it parsed" do
+      parser.parse_chunk('{"a": [1, 2.5, "x", tr')
+      parser.parse_chunk('ue, null, {"b": []}]}')
+      stats = parser.stats
+      expect(stats.values_at(:objects, :arrays, :keys, :strings, :numbers, :literals)).to eq([2, 2, 2, 1, 2, 2])
+      expect(stats.values_at(:bytes, :documents, :resumes, :max_depth)).to eq([43, 1, 1, 4])
+    end
+    it "limits nesting" do
+      expect(Jsonista.parse("[" * 100 + "]" * 100)).to be_a(Array)
+      expect{ Jsonista.parse("[" * 101 + "]" * 101) }.to raise_error(Jsonista::NestingError)
+      expect{ Jsonista.parse('{"a":[{}]}', max_nesting: 2) }.to raise_error { |e| expect(e.pos).to eq(6) }
+      expect{ Jsonista.parse('[[1]]', max_nesting: 1, threads: 2) }.to raise_error(Jsonista::NestingError)
+      expect(Jsonista.valid?('[[[]]]', max_nesting: 2)).to be false
+      expect(parser.parse_chunk('[' * 100)).to be_nil
+      expect{ parser.parse_chunk("[") }.to raise_error(Jsonista::NestingError)
     end
     it "raises error" do
       expect{ parser.parse_chunk("}") }.to raise_error(Jsonista::ParseError)
@@ -43,15 +79,743 @@ RSpec.describe Jsonista do
       parser.reset
       expect{ parser.parse_chunk("truthy") }.to raise_error(Jsonista::ParseError)
     end
+    it "raises error at the offending byte" do
+      expect{ parser.parse_chunk('[1, 2,, 3]') }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(6) }
+      parser.reset
+      expect{ parser.parse_chunk('"\xC3\x28"') }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(2) }
+      parser.reset
+      expect{ parser.parse_chunk('[] x') }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(3) }
+      parser.reset
+      expect{ parser.finish('[1') }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(2) }
+    end
     it "continues parsing" do
       expect(parser.parse_chunk("[")).to be_nil
-      expect(parser.parse_chunk("]")).to be_nil
+      expect(parser.parse_chunk("]")).to eq([])
+      parser.reset
       expect(parser.parse_chunk("{")).to be_nil
-      expect(parser.parse_chunk("}")).to be_nil
+      expect(parser.parse_chunk("}")).to eq({})
+      parser.reset
       expect(parser.parse_chunk('"foo')).to be_nil
-      expect(parser.parse_chunk('bar"')).to be_nil
+      expect(parser.parse_chunk('bar"')).to eq("foobar")
+      parser.reset
       expect(parser.parse_chunk('[123')).to be_nil
-      expect(parser.parse_chunk('456]')).to be_nil
+      expect(parser.parse_chunk('456]')).to eq([123456])
+      parser.reset
+      expect(parser.parse_chunk('{"ke')).to be_nil
+      expect(parser.parse_chunk('y": [tr')).to be_nil
+      expect(parser.parse_chunk('ue, "\\u30')).to be_nil
+      expect(parser.parse_chunk('42"]}')).to eq({"key" => [true, "\u3042"]})
+    end
+    it "skips long whitespace runs" do
+      (0..70).each do |n|
+        ws = (" \t\r\n" * 20)[0, n]
+        parser.reset
+        expect(parser.parse_chunk("#{ws}[#{ws}1#{ws},#{ws}{#{ws}\"a\"#{ws}:#{ws}2#{ws}}#{ws}]#{ws}")).to eq([1, {"a" => 2}])
+      end
+    end
+    it "validates long UTF-8 strings" do
+      text = "ascii \u3042\u3044\u3046 \u00e9\u{1F600}\u{10FFFF}\uD7FF\uFFFF" * 20
+      expect(parser.parse_chunk("[\"#{text}\", \"#{text}\\n#{text}\"]")).to eq([text, "#{text}\n#{text}"])
+      [0, 5, 31, 32, 33, 100].each do |n|
+        ["\xC0\x80", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\x80", "\xF5", "\x01"].each do |bad|
+          src = "\"#{"\u3042" * n}#{bad}#{"x" * 40}\"".b
+          parser.reset
+          expect{ parser.parse_chunk(src) }.to raise_error(Jsonista::ParseError) { |e|
+            expect(e.pos).to eq(1 + 3 * n + (bad.start_with?("\xED", "\xF4") ? 1 : 0))
+          }
+        end
+      end
+    end
+    it "returns UTF-8 strings from binary input" do
+      long = "x" * 100
+      src = "[\"#{long}\", \"a\\tb#{long}\", \"\u3042\"]".b
+      expect(src.encoding).to eq(Encoding::BINARY)
+      result = parser.parse_chunk(src)
+      expect(result).to eq([long, "a\tb#{long}", "\u3042"])
+      expect(result.map(&:encoding).uniq).to eq([Encoding::UTF_8])
+      src.replace("garbage")
+      expect(result[0]).to eq(long)
+    end
+    it "converts numbers exactly" do
+      {
+        "9223372036854775807" => 9223372036854775807,
+        "-9223372036854775808" => -9223372036854775808,
+        "9223372036854775808" => 9223372036854775808,
+        "-123456789012345678901234567890" => -123456789012345678901234567890,
+        "100000000000000000000000" => 100000000000000000000000,
+        "-0" => 0,
+        "-0.0" => -0.0,
+        "0.1" => 0.1,
+        "1.7976931348623157e308" => 1.7976931348623157e308,
+        "1e400" => Float::INFINITY,
+        "-1e400" => -Float::INFINITY,
+        "4.9e-324" => 5.0e-324,
+        "1e-400" => 0.0,
+        "2.2250738585072011e-308" => 2.225073858507201e-308,
+        "9007199254740993" => 9007199254740993,
+        "9007199254740993.0" => 9007199254740992.0,
+        "9007199254740993.000000000000000000001" => 9007199254740994.0,
+        "0.#{"0" * 400}1e401" => 1.0,
+      }.each do |src, expected|
+        parser.reset
+        expect(parser.finish(src)).to eql(expected)
+      end
+    end
+    it "continues numbers across chunks" do
+      src = "[-12.5e-1, 123456789012345678901234567890, 0.1]"
+      src.each_char { |c| parser.parse_chunk(c) } rescue nil
+      parser.reset
+      result = nil
+      src.each_char { |c| result ||= parser.parse_chunk(c) }
+      expect(result).to eql([-1.25, 123456789012345678901234567890, 0.1])
+      parser.reset
+      expect(parser.parse_chunk("-")).to be_nil
+      expect(parser.parse_chunk("1")).to be_nil
+      expect(parser.finish("0")).to eql(-10)
+    end
+    it "rejects malformed numbers" do
+      ["-", "01", "1.", "1.e1", "1e", "1e+", "-a", ".5", "+1"].each do |src|
+        parser.reset
+        expect{ parser.finish(src) }.to raise_error(Jsonista::ParseError)
+      end
+    end
+    it "parses any chunk split" do
+      json = '{"a": [1, 2.5e1, "b\\n\u3042"], "c": {"d": false, "e": null}}'
+      expected = {"a" => [1, 25.0, "b\n\u3042"], "c" => {"d" => false, "e" => nil}}
+      json.bytesize.times do |i|
+        parser.reset
+        expect(parser.parse_chunk(json.byteslice(0, i))).to be_nil
+        expect(parser.parse_chunk(json.byteslice(i..-1))).to eq(expected)
+      end
+    end
+    it "resumes every token a byte at a time" do
+      json = '{"k\\u00e9y": ["\\uD842\\uDFB7\\téあ' "\u{1F600}" '", true, false, null, -1.5]}'
+      result = nil
+      json.b.each_char do |c|
+        expect(result).to be_nil
+        result = parser.parse_chunk(c)
+      end
+      expect(result).to eq({"kéy" => ["\u{20BB7}\téあ\u{1F600}", true, false, nil, -1.5]})
+      expect(parser.stats[:bytes]).to eq(json.bytesize)
+      ['["\\u12', "[\"\xE3\x81", '[nu'].each do |head|
+        parser.reset
+        expect(parser.parse_chunk(head.b)).to be_nil
+      end
+      expect{ parser.parse_chunk("x]") }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(1) }
+    end
+    it "reports an invalid literal at its start in any split" do
+      ["nul]", "[tru]", "tru}", "[1, fals]"].each do |json|
+        pos = json.index(/[tnf]/)
+        splits = (1...json.size).map { |i| [json[0, i], json[i..-1]] } << json.chars
+        splits.each do |chunks|
+          parser.reset
+          expect{ chunks.each { |c| parser.parse_chunk(c) } }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(pos) }
+        end
+      end
+    end
+  end
+
+  describe "key cache" do
+    it "returns frozen deduplicated keys" do
+      parser = Jsonista::Parser.new
+      a = parser.parse_chunk('[{"status":"ok"},{"status":"ok"}]')
+      expect(a[0].keys[0]).to be_frozen
+      expect(a[0].keys[0]).to equal(a[1].keys[0])
+      expect(a[0]["status"]).not_to be_frozen
+      expect(parser.cache.stats).to eq(hits: 1, misses: 1, size: 1024)
+    end
+    it "returns symbols with symbolize_names" do
+      parser = Jsonista::Parser.new(symbolize_names: true)
+      expect(parser.parse_chunk('{"a":{"a":1,"b\\u00e9":[]}}')).to eq(a: {a: 1, "bé": []})
+      long = "k" * 100
+      parser.reset
+      expect(parser.parse_chunk(%Q({"#{long}":1}))).to eq(long.to_sym => 1)
+    end
+    it "caches short string values with cache_values" do
+      parser = Jsonista::Parser.new(cache_values: true)
+      a = parser.parse_chunk(%Q(["ok","ok","#{"x" * 100}"]))
+      expect(a[0]).to be_frozen
+      expect(a[0]).to equal(a[1])
+      expect(a[2]).not_to be_frozen
+    end
+    it "can share a cache or work without one" do
+      cache = Jsonista::Cache.new(10)
+      expect(cache.size).to eq(16)
+      p1 = Jsonista::Parser.new(cache: cache)
+      p2 = Jsonista::Parser.new(cache: cache)
+      expect(p1.parse_chunk('{"k":1}').keys[0]).to equal(p2.parse_chunk('{"k":2}').keys[0])
+      expect(cache.stats[:hits]).to eq(1)
+      expect(cache.clear.stats[:hits]).to eq(0)
+      expect(Jsonista::Parser.new(cache: Jsonista::Cache.global).cache).to equal(Jsonista::Cache.global)
+      parser = Jsonista::Parser.new(cache: false)
+      expect(parser.cache).to be_nil
+      expect(parser.parse_chunk('{"k":1}').keys[0]).to be_frozen
+      expect{ Jsonista::Parser.new(cache: 1) }.to raise_error(TypeError)
+    end
+  end
+
+  describe "Ractors" do
+    around do |example|
+      experimental, Warning[:experimental] = Warning[:experimental], false
+      example.run
+      Warning[:experimental] = experimental
+    end
+    it "returns shareable values with freeze" do
+      v = Jsonista.parse(%Q({"a":[1,"x",2.5,{"b":null}],"c":"#{"y" * 100}"}), freeze: true)
+      expect(v).to be_frozen
+      expect(v["a"][3]).to be_frozen
+      expect(v["c"]).to be_frozen
+      expect(Ractor.shareable?(v)).to be true
+      expect(Ractor.shareable?(Jsonista.parse('{"a":[1]}'))).to be false
+    end
+    it "marks only deeply frozen values shareable" do
+      deep_frozen = lambda do |v|
+        v.frozen? && v.instance_variables.empty? &&
+          case v
+          when Array then v.all?(&deep_frozen)
+          when Hash then v.all? { |k, x| deep_frozen.(k) && deep_frozen.(x) } && v.default_proc.nil?
+          else true
+          end
+      end
+      src = %Q({"a":[1,"x\\n",2.5,{"b":null,"k#{"z" * 40}":#{2**70}}],"c":"#{"y" * 100}","d":[[true,false]]})
+      [{}, {cache: false}, {symbolize_names: true}, {symbolize_names: true, cache: false}, {cache_values: true}].each do |opts|
+        v = Jsonista.parse(src, freeze: true, **opts)
+        expect(deep_frozen.(v)).to be true
+        expect(Ractor.shareable?(v)).to be true
+      end
+      path = "/c".dup.tap { |s| s.instance_variable_set(:@x, Object.new) }.freeze
+      pairs = Jsonista.parse(src, paths: ["/a/*", path], freeze: true)
+      expect(pairs.size).to eq(5)
+      expect(pairs.all?(&deep_frozen)).to be true
+    end
+    it "parses in Ractors, each with its own global cache" do
+      rs = 4.times.map do |i|
+        Ractor.new(i) do |n|
+          parser = Jsonista::Parser.new(cache: Jsonista::Cache.global, freeze: true)
+          [Jsonista.dump(parser.parse_chunk(%Q({"n":#{n}}))), Jsonista::Cache.global.stats[:misses]]
+        end
+      end
+      expect(rs.map(&:take)).to eq(4.times.map { |i| [%Q({"n":#{i}}), 1] })
+    end
+  end
+
+  describe "multi-document mode" do
+    let(:parser){ Jsonista::Parser.new(multi_document: true) }
+    it "yields every document of a chunk" do
+      docs = []
+      expect(parser.parse_chunk(%Q({"a":1}\n[2]\n"x" true\n)) { |d| docs << d }).to be_nil
+      expect(docs).to eq([{"a"=>1}, [2], "x", true])
+      expect(parser.parse_chunk("[1][2]{}")).to eq([[1], [2], {}])
+      expect(parser.finish("  \n")).to eq([])
+    end
+    it "carries a partial document over" do
+      expect(parser.parse_chunk('{"a":1}' "\n" '{"b":[1,')).to eq([{"a"=>1}])
+      expect(parser.parse_chunk("2]}\n12")).to eq([{"b"=>[1, 2]}])
+      expect(parser.parse_chunk("3\n4")).to eq([123])
+      expect(parser.finish).to eq([4])
+    end
+    it "parses a stream split at every byte" do
+      src = %Q({"a":[1,"\\u00e9"]}\n-1.5e3\n"str"\n[true,false,null]\n)
+      expected = [{"a"=>[1, "é"]}, -1500.0, "str", [true, false, nil]]
+      docs = []
+      src.each_char { |c| parser.parse_chunk(c) { |d| docs << d } }
+      parser.finish { |d| docs << d }
+      expect(docs).to eq(expected)
+    end
+    it "yields the documents before an error" do
+      docs = []
+      expect{ parser.parse_chunk("[1]\n[2]\n[3,") { |d| docs << d } }.not_to raise_error
+      expect{ parser.parse_chunk("]\n[4]") { |d| docs << d } }.to raise_error(Jsonista::ParseError)
+      expect(docs).to eq([[1], [2]])
+    end
+    it "calls end_document for each document with a handler" do
+      handler = Class.new { attr_reader :n; def initialize; @n = 0; end; def end_document; @n += 1; end }.new
+      parser = Jsonista::Parser.new(handler, multi_document: true)
+      expect(parser.parse_chunk("1 2 3 [")).to be_nil
+      expect(parser.finish("]")).to be_nil
+      expect(handler.n).to eq(4)
+    end
+  end
+
+  describe "file and IO input" do
+    around do |example|
+      Dir.mktmpdir { |dir| @dir = dir; example.run }
+    end
+    def write(name, data)
+      path = File.join(@dir, name)
+      File.binwrite(path, data)
+      path
+    end
+
+    it "loads a file" do
+      path = write("a.json", %Q({"a":[1,2.5,"\\u00e9",true]}\n))
+      expect(Jsonista.load_file(path)).to eq("a" => [1, 2.5, "é", true])
+      expect(Jsonista.load_file(path, symbolize_names: true)).to eq(a: [1, 2.5, "é", true])
+      expect(Jsonista.load_file(write("n.json", "12"))).to eq(12)
+    end
+    it "loads files larger than the mapping window" do
+      big = "a" * 9_000_000
+      expect(Jsonista.load_file(write("big.json", %Q(["#{big}", 1])))).to eq([big, 1])
+      lines = (0...100_000).map { |i| %Q({"i":#{i},"pad":"#{"x" * 80}"}\n) }
+      path = write("big.ndjson", lines.join)
+      n = 0
+      Jsonista.load_file(path, multi_document: true) { |d| n += 1 if d["i"] == n }
+      expect(n).to eq(100_000)
+    end
+    it "reports errors of a file" do
+      expect{ Jsonista.load_file(write("e.json", "[1,]")) }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(3) }
+      expect{ Jsonista.load_file(write("empty.json", "")) }.to raise_error(Jsonista::ParseError)
+      expect{ Jsonista.load_file(File.join(@dir, "none.json")) }.to raise_error(Errno::ENOENT)
+    end
+    it "inflates gzip input as it parses" do
+      lines = (0...20_000).map { |i| %Q({"i":#{i},"s":"#{"é" * (i % 5)}"}\n) }
+      gz = lines.each_slice(5000).map { |s| Zlib.gzip(s.join) }.join
+      [7, 4096, gz.bytesize].each do |size|
+        parser = Jsonista::Parser.new(multi_document: true)
+        n = 0
+        (0...gz.bytesize).step(size) { |o| parser.parse_gzip_chunk(gz.byteslice(o, size)) { |d| n += 1 if d["i"] == n } }
+        parser.finish { |d| n += 1 }
+        expect(n).to eq(20_000)
+      end
+      path = write("a.json.gz", Zlib.gzip(%Q({"a":[1,"x"]})))
+      expect(Jsonista.load_file(path, compression: :gzip)).to eq("a" => [1, "x"])
+      expect{ Jsonista.load_file(path, compression: :xz) }.to raise_error(ArgumentError)
+    end
+    it "reports errors of gzip input" do
+      parser = Jsonista::Parser.new
+      parser.parse_gzip_chunk(Zlib.gzip("[1,2]")[0...-4])
+      expect{ parser.finish }.to raise_error(Jsonista::ParseError, /unexpected end/)
+      expect{ Jsonista::Parser.new.parse_gzip_chunk("[1,2]") }.to raise_error(Jsonista::ParseError)
+      expect{ Jsonista.load_file(write("e.json.gz", Zlib.gzip("[1,]")), compression: :gzip) }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(3) }
+    end
+    it "parses an IO to its end" do
+      path = write("a.json", "# header\n" + %Q({"a":["#{"b" * 300_000}", 1]}))
+      File.open(path) do |f|
+        f.gets
+        expect(Jsonista::Parser.new.parse_io(f)).to eq("a" => ["b" * 300_000, 1])
+        expect(f.eof?).to be true
+      end
+      expect(Jsonista::Parser.new.parse_io(StringIO.new("[1, 2]"))).to eq([1, 2])
+      r, w = IO.pipe
+      w.write("1\n[2]\n{")
+      w.write("}")
+      w.close
+      expect(Jsonista::Parser.new(multi_document: true).parse_io(r)).to eq([1, [2], {}])
+    end
+    it "continues a partial document from parse_chunk" do
+      parser = Jsonista::Parser.new
+      parser.parse_chunk('{"ab')
+      expect(parser.parse_io(StringIO.new('c":1}'))).to eq("abc" => 1)
+      parser.reset
+      expect{ parser.parse_io(StringIO.new("[1] 2")) }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(4) }
+    end
+  end
+
+  describe "validation" do
+    it "tells whether a string is one JSON document" do
+      ['{"a":[1,-2.5e3,"\\u00e9\\n",true,false,null]}', "12", ' "x" ', "[]"].each do |src|
+        expect(Jsonista.valid?(src)).to be(true)
+      end
+      ["", "[", "[1,]", "[1] 2", "01", '"\\x"', "\"\xff\"".b, "tru", "{1:2}"].each do |src|
+        expect(Jsonista.valid?(src)).to be(false)
+      end
+    end
+    it "validates long inputs" do
+      doc = "[" + (['{"k":"v","n":[1,2.5]}'] * 100_000).join(",") + "]"
+      expect(Jsonista.valid?(doc)).to be(true)
+      expect(Jsonista.valid?(doc.chop)).to be(false)
+      long = %Q(["#{"a" * 3_000_000}"])
+      expect(Jsonista.valid?(long)).to be(true)
+      expect(Jsonista.valid?(long.sub('a"]', "\x01\"]"))).to be(false)
+    end
+    it "validates chunks" do
+      parser = Jsonista::Parser.new
+      expect(parser.validate_chunk('{"a":[1')).to be(false)
+      expect(parser.validate_chunk('2,"b')).to be(false)
+      expect(parser.validate_chunk('c"]}')).to be(true)
+      parser.reset
+      expect(parser.validate_chunk("12")).to be(false)
+      expect(parser.validate_finish).to be(true)
+      parser.reset
+      expect(parser.validate_chunk("[1,")).to be(false)
+      expect{ parser.validate_chunk(" x]") }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(4) }
+      parser.reset
+      expect{ parser.validate_finish("[1") }.to raise_error(Jsonista::ParseError)
+    end
+    it "lets other threads run while validating" do
+      doc = "[" + (["1"] * 2_000_000).join(",") + "]"
+      ticks = 0
+      t = Thread.new { loop { ticks += 1; Thread.pass } }
+      5.times { Jsonista.valid?(doc) }
+      t.kill
+      expect(ticks).not_to eq(0)
+    end
+  end
+
+  describe "two-stage mode" do
+    let(:doc) do
+      "[" + Array.new(40_000) { |i| %Q({"id":#{i},"s":"a\\"b\\\\ [,:{} \\u00e9 日本","f":-#{i}.5e-3,"t":[true,false,null]}) }.join(",\n") + "]"
+    end
+
+    it "parses like the streaming parser" do
+      expect(Jsonista.parse('{"a":[1,"x"]}')).to eq({"a" => [1, "x"]})
+      expected = Jsonista.parse(doc)
+      [1, 2, 4].each do |t|
+        expect(Jsonista.parse(doc, threads: t)).to eq(expected)
+      end
+      expect(Jsonista.parse(doc, threads: 4, symbolize_names: true).first[:s]).to eq(expected.first["s"])
+    end
+
+    it "reports the first error" do
+      bad = doc.b
+      pos = bad.rindex('"s":"a') + 5
+      bad.setbyte(pos, 1)
+      expect{ Jsonista.parse(bad, threads: 4) }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(pos) }
+      expect{ Jsonista.parse(doc.chop, threads: 4) }.to raise_error(Jsonista::ParseError)
+      expect{ Jsonista.parse("[1,2]", threads: 2, multi_document: true) }.to raise_error(ArgumentError)
+    end
+
+    it "reports errors where the streaming parser does" do
+      ['tru', '[tru]', '{"a":nul', '[fals', '["\\u12', '["\\u12"]', '["\\uD800"]', '["\\uD800\\"]',
+       '["\\uD800\\uDB', '{"\\uD800\\u":1}', '["\\'].each do |bad|
+        pos = (Jsonista.parse(bad) rescue $!.pos)
+        expect{ Jsonista.parse(bad, threads: 2) }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(pos) }
+      end
+    end
+
+    it "validates" do
+      expect(Jsonista.valid?(doc, threads: 4)).to be(true)
+      expect(Jsonista.valid?(doc.b.sub("日".b, "\xff".b), threads: 4)).to be(false)
+      expect(Jsonista.valid?('["a\\"]', threads: 2)).to be(false)
+    end
+  end
+
+  describe "path filtering" do
+    let(:src) { '{"user": {"id": 7, "name": "a\\"}b"}, "junk": [1, {"x": "]]"}, "\\\\"], "items": [{"price": 1.5}, {"price": [3]}, {"q": 1}]}' }
+
+    it "extracts the values at the paths" do
+      expect(Jsonista.parse(src, paths: ["/user/id", "/items/*/price"])).to eq(
+        [["/user/id", 7], ["/items/*/price", 1.5], ["/items/*/price", [3]]])
+      expect(Jsonista.parse(src, paths: ["/items/1", "/junk/1/x"])).to eq([["/junk/1/x", "]]"], ["/items/1", {"price" => [3]}]])
+      expect(Jsonista.parse(src, paths: ["/user", "/user/id"])).to eq([["/user", {"id" => 7, "name" => 'a"}b'}]])
+      expect(Jsonista.parse(src, paths: [""])).to eq([["", Jsonista.parse(src)]])
+      expect(Jsonista.parse('{"a/b~": 1}', paths: ["/a~1b~0"])).to eq([["/a~1b~0", 1]])
+      expect(Jsonista.parse("12", paths: ["/0"])).to eq([])
+    end
+
+    it "skips values across any chunk split" do
+      expected = [["/items/*/price", 1.5], ["/items/*/price", [3]]]
+      src.length.times do |i|
+        parser = Jsonista::Parser.new(paths: ["/items/*/price"])
+        pairs = parser.parse_chunk(src[0, i])
+        parser.finish(src[i..]) { |path, value| pairs << [path, value] }
+        expect(pairs).to eq(expected)
+      end
+    end
+
+    it "works with multi_document" do
+      parser = Jsonista::Parser.new(paths: ["/id"], multi_document: true)
+      expect(parser.parse_chunk(%Q({"id": 1, "x": "}"}\n{"y": [1], "id": "two"}\n{"id"))).to eq([["/id", 1], ["/id", "two"]])
+      expect(parser.finish(": 3}")).to eq([["/id", 3]])
+    end
+
+    it "rejects invalid paths and truncated input" do
+      expect{ Jsonista::Parser.new(paths: ["a"]) }.to raise_error(ArgumentError)
+      expect{ Jsonista::Parser.new(paths: ["/~2"]) }.to raise_error(ArgumentError)
+      expect{ Jsonista::Parser.new(Object.new, paths: ["/a"]) }.to raise_error(ArgumentError)
+      expect{ Jsonista.parse('{"a": ["]"}', paths: ["/b"]) }.to raise_error(Jsonista::ParseError)
+    end
+  end
+
+  describe "aggregation" do
+    let(:src) { '{"events": [{"ms": 12, "kind": "a"}, {"ms": 3.5, "kind": "b", "x": {"ms": 999}}, {"kind": "a", "ms": "n/a"}, {"ms": 1}], "ms": 5}' }
+    let(:spec) { {events: [:count, "/events/*"], total: [:sum, "/events/*/ms"], lo: [:min, "/events/*/ms"],
+                  hi: [:max, "/events/*/ms"], kinds: [:distinct, "/events/*/kind"], ms: [:count, "/events/*/ms"]} }
+    let(:expected) { {events: 4, total: 16.5, lo: 1, hi: 12, kinds: 2, ms: 4} }
+
+    it "computes aggregates over nested paths" do
+      expect(Jsonista.parse(src, aggregate: spec)).to eq(expected)
+      expect(Jsonista.parse("[]", aggregate: spec.merge(events: [:count, "/*"]))).to eq(
+        {events: 0, total: 0, lo: nil, hi: nil, kinds: 0, ms: 0})
+      expect(Jsonista.parse("[9007199254740993, 1]", aggregate: {s: [:sum, "/*"]})).to eq({s: 9007199254740994})
+    end
+
+    it "compares distinct numbers by value" do
+      src = '[1, 1.0, 1e0, 10e-1, -0, 0.0, -0.0, 0.5, 5e-1, 9007199254740993, 9007199254740992.0, ' \
+            '100000000000000000000, 100000000000000000000, "1", true, null]'
+      expect(Jsonista.parse(src, aggregate: {d: [:distinct, "/*"], n: [:sum, "/*"]})).to eq(
+        {d: 9, n: 1.0 * 4 + 0.5 * 2 + 9007199254740993 + 9007199254740992 + 2e20})
+    end
+
+    it "aggregates across chunks and documents" do
+      parser = Jsonista::Parser.new(aggregate: spec)
+      src.each_char { |c| expect(parser.parse_chunk(c)).to be_nil }
+      expect(parser.finish).to eq(expected)
+      parser = Jsonista::Parser.new(aggregate: {n: [:count, ""], sum: [:sum, "/v"], k: [:distinct, "/k"]}, multi_document: true)
+      expect(parser.parse_chunk(%Q({"v": 1, "k": "x"}\n{"v": 2, "k": "y"}\n{"v": 3, "k": "x"}\n))).to be_nil
+      expect(parser.finish).to eq({n: 3, sum: 6, k: 2})
+      parser.reset
+      expect(parser.finish('{"v": 5, "k": 1}')).to eq({n: 1, sum: 5, k: 1})
+    end
+
+    it "rejects unknown aggregates" do
+      expect{ Jsonista::Parser.new(aggregate: {a: [:avg, "/x"]}) }.to raise_error(ArgumentError)
+      expect{ Jsonista::Parser.new(aggregate: {a: [:sum, "x"]}) }.to raise_error(ArgumentError)
+      expect{ Jsonista::Parser.new(aggregate: {a: :sum}) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe ".dump" do
+    it "generates JSON that parses back" do
+      obj = {"a" => [1, -2, 3.5, 1e20, 0.1, 1.0 / 3, 2**70, nil, true, false], "s" => "q\"\\\n\t\u0001é日本" * 3, "l" => "x" * 100 + "\"" + "y" * 50}
+      expect(Jsonista.parse(Jsonista.dump(obj))).to eq(obj)
+      expect(Jsonista.dump({a: :b, 1 => 100.0})).to eq('{"a":"b","1":100.0}')
+      expect(Jsonista.dump("\u0000\u001f\b")).to eq('"\\u0000\\u001f\\b"')
+      expect(Jsonista.dump("caf\xC3\xA9".b)).to eq('"café"')
+    end
+
+    it "writes floats with the shortest digits that read back" do
+      {
+        5e-324 => "5e-324",
+        1e-323 => "1e-323",
+        2.2250738585072014e-308 => "2.2250738585072014e-308",
+        2.225073858507201e-308 => "2.225073858507201e-308",
+        1e20 => "1e+20",
+        -1.5e300 => "-1.5e+300",
+        1e-5 => "1e-05",
+        1e-4 => "0.0001",
+        0.1 => "0.1",
+        1.0 / 3 => "0.3333333333333333",
+        -0.0 => "-0.0",
+        2.0**53 => "9007199254740992.0",
+        1.7976931348623157e308 => "1.7976931348623157e+308",
+      }.each do |d, s|
+        expect(Jsonista.dump(d)).to eq(s)
+        expect(Jsonista.parse(s)).to eq(d)
+      end
+    end
+
+    it "rejects what JSON can't represent" do
+      expect{ Jsonista.dump(Float::NAN) }.to raise_error(Jsonista::GeneratorError)
+      expect{ Jsonista.dump("\xFF") }.to raise_error(Jsonista::GeneratorError)
+      a = []
+      a << a
+      expect{ Jsonista.dump(a) }.to raise_error(Jsonista::GeneratorError)
+      expect(Jsonista.dump([[[1]]], max_nesting: 3)).to eq("[[[1]]]")
+      expect{ Jsonista.dump([[[1]]], max_nesting: 2) }.to raise_error(Jsonista::GeneratorError)
+    end
+  end
+
+  describe Jsonista::Writer do
+    let(:io) { StringIO.new }
+
+    it "writes to the IO in blocks" do
+      writes = []
+      io.define_singleton_method(:write) { |str| writes << str.bytesize; super(str) }
+      w = Jsonista::Writer.new(io, buffer_size: 100)
+      w.start_object.key("items").start_array
+      500.times { |i| w.value({"id" => i}) }
+      w.end_array.key(:n) << 500
+      w.end_object
+      w << "x" * 1000
+      w.finish
+      expect(writes[0..-2].uniq).to eq([100])
+      first, second = io.string.split("\n")
+      expect(Jsonista.parse(first)).to eq({"items" => (0...500).map { |i| {"id" => i} }, "n" => 500})
+      expect(Jsonista.parse(second)).to eq("x" * 1000)
+    end
+
+    it "writes full blocks while a large value is still open" do
+      writes = []
+      io.define_singleton_method(:write) { |str| writes << str.bytesize; super(str) }
+      w = Jsonista::Writer.new(io, buffer_size: 4096)
+      w.value((1..200_000).to_a)
+      expect(writes.size).to be > 100
+      expect(writes.uniq).to eq([4096])
+      w.finish
+      expect(Jsonista.parse(io.string)).to eq((1..200_000).to_a)
+    end
+
+    it "checks the structure" do
+      w = Jsonista::Writer.new(io)
+      expect{ w.key("a") }.to raise_error(Jsonista::GeneratorError)
+      w.start_object
+      expect{ w.value(1) }.to raise_error(Jsonista::GeneratorError)
+      expect{ w.end_array }.to raise_error(Jsonista::GeneratorError)
+      expect{ w.finish }.to raise_error(Jsonista::GeneratorError)
+      w.end_object.finish
+      expect(io.string).to eq("{}")
+    end
+
+    it "is left as it was by a value that raises" do
+      w = Jsonista::Writer.new(io)
+      w.start_array
+      expect{ w.value([1, Float::NAN]) }.to raise_error(Jsonista::GeneratorError)
+      w.value(2)
+      w.start_object
+      expect{ w.key("\xFF") }.to raise_error(Jsonista::GeneratorError)
+      w.key("a").value(3).end_object
+      expect{ w.end_object }.to raise_error(Jsonista::GeneratorError)
+      w.end_array.finish
+      expect(io.string).to eq('[2,{"a":3}]')
+
+      w = Jsonista::Writer.new(StringIO.new, buffer_size: 16)
+      expect{ w.value(Array.new(100, 1) + [Float::NAN]) }.to raise_error(Jsonista::GeneratorError)
+      expect{ w.value(2) }.to raise_error(Jsonista::GeneratorError)
+    end
+  end
+
+  describe Jsonista::ParserPool do
+    let(:pool) { Jsonista::ParserPool.new(size: 2, max_retained: 16 * 1024, symbolize_names: true, max_nesting: false) }
+
+    it "reuses reset parsers" do
+      expect(pool.parse('{"a": 1}')).to eq({a: 1})
+      parser = pool.checkout
+      expect(parser.parse_chunk('[1, ')).to be_nil
+      pool.checkin(parser)
+      expect(pool.checkout).to be(parser)
+      expect(parser.finish("[2]")).to eq([2])
+      expect{ pool.with { |p| p.parse_chunk("[1"); raise "boom" } }.to raise_error("boom")
+      expect(pool.with { |p| p.finish("3") }).to eq(3)
+    end
+
+    it "caps what idle parsers keep" do
+      parsers = 3.times.map { pool.checkout }
+      parsers[0].finish("[" * 3000 + '"' + "x\\n" * 10000 + '"' + "]" * 3000)
+      held = ObjectSpace.memsize_of(parsers[0])
+      parsers.each { |p| pool.checkin(p) }
+      expect(pool.idle).to eq(2)
+      expect(ObjectSpace.memsize_of(parsers[0])).to be < held / 4
+      expect{ pool.checkin(Object.new) }.to raise_error(TypeError)
+    end
+
+    it "keeps the fixed gzip window" do
+      parser = pool.checkout
+      expect(parser.parse_gzip_chunk(Zlib.gzip("[2]"))).to eq([2])
+      used = ObjectSpace.memsize_of(parser)
+      expect(used).to be > 64 * 1024
+      pool.checkin(parser)
+      expect(ObjectSpace.memsize_of(parser)).to eq(used)
+    end
+
+    it "rejects parsers it did not hand out" do
+      parser = pool.checkout
+      pool.checkin(parser)
+      expect{ pool.checkin(parser) }.to raise_error(ArgumentError)
+      expect{ pool.checkin(Jsonista::Parser.new) }.to raise_error(ArgumentError)
+      expect(pool.idle).to eq(1)
+      expect(pool.checkout).not_to be(pool.checkout)
+      expect{ Jsonista::ParserPool.new.checkin(parser) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe Jsonista::Decoder do
+    point = Struct.new(:x, :y)
+    user = Data.define(:id, :name, :admin, :tags, :home, :extra)
+    let(:points){ Jsonista.compile(point, x: Float, y: Float) }
+    let(:users){ Jsonista.compile(user, id: Integer, name: String, admin: :boolean, tags: [String], home: points, extra: :any) }
+
+    it "decodes objects into Structs and Data" do
+      u = users.decode(%Q({"id":7,"skip":{"a":[1,{"b":2}]},"name":"\\u00e9","admin":true,"tags":["a"],"home":{"y":1e2,"x":-1,"z":0},"extra":{"k":[null]}}))
+      expect(u).to eq(user.new(7, "é", true, ["a"], point.new(-1.0, 100.0), {"k" => [nil]}))
+      expect(u).to be_frozen
+      expect(users.decode('[{"id":1},{"id":2,"tags":null}]')).to eq([user.new(1, nil, nil, nil, nil, nil), user.new(2, nil, nil, nil, nil, nil)])
+      s = %Q({"x":1,"y":2,"other":"zz","more":{"a":[1]}}).freeze
+      d = points
+      d.decode(s)
+      n = GC.stat(:total_allocated_objects)
+      1000.times { d.decode(s) }
+      # the Structs alone
+      expect(GC.stat(:total_allocated_objects) - n).to be < 1010
+    end
+    it "rejects values of other types and bad schemas" do
+      expect{ users.decode('{"id":1.5}') }.to raise_error(Jsonista::ParseError, /integer for id/) { |e| expect(e.pos).to eq(6) }
+      expect{ users.decode('{"tags":[1]}') }.to raise_error(Jsonista::ParseError)
+      expect{ users.decode('"x"') }.to raise_error(Jsonista::ParseError)
+      expect{ users.decode('{"id":1') }.to raise_error(Jsonista::ParseError)
+      expect{ Jsonista.compile(point, z: Integer) }.to raise_error(ArgumentError)
+      expect{ Jsonista.compile(point, x: Hash) }.to raise_error(ArgumentError)
+      expect{ Jsonista.compile(Struct.new(:a, keyword_init: true), a: Integer) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe Jsonista::Document do
+    let(:src) { '{"a": {"b": [1, 2.5, "x\\ny", {"c": null}], "k\\u00e9y": true}, "n": [' + (1..100).to_a.join(",") + '], "s": "str"}' }
+    let(:doc) { Jsonista::Document.new(src) }
+
+    it "decodes the values accessed" do
+      expect(doc["a"]["b"][2]).to eq("x\ny")
+      expect(doc["a"]["b"][-1]["c"]).to be_nil
+      expect(doc["a"]["kéy"]).to be(true)
+      expect(doc[:s]).to eq("str")
+      expect(doc["n"][99]).to eq(100)
+      expect(doc["n"][100]).to be_nil
+      expect(doc["missing"]).to be_nil
+    end
+
+    it "enumerates members" do
+      expect(doc.keys).to eq(["a", "n", "s"])
+      expect(doc.size).to eq(3)
+      expect(doc["n"].each.to_a).to eq((1..100).to_a)
+      expect(doc.map(&:first)).to eq(["a", "n", "s"])
+    end
+
+    it "converts to Ruby values" do
+      expect(doc.to_ruby).to eq(Jsonista::Parser.new.finish(src))
+      expect(doc["a"]["b"][3].to_ruby).to eq({"c" => nil})
+      expect(Jsonista::Document.new('{"a":[]}', symbolize_names: true).to_ruby).to eq({a: []})
+      expect(Jsonista::Document.new(" 12 ").to_ruby).to eq(12)
+    end
+
+    it "rejects invalid documents" do
+      expect{ Jsonista::Document.new('{"a":}') }.to raise_error(Jsonista::ParseError) { |e| expect(e.pos).to eq(5) }
+      expect{ Jsonista::Document.new("[1") }.to raise_error(Jsonista::ParseError)
+      expect{ Jsonista::Document.new("1")[0] }.to raise_error(TypeError)
+    end
+  end
+
+  describe "event handler" do
+    let(:handler) do
+      Class.new do
+        attr_reader :events
+        def initialize; @events = []; end
+        def start_object; @events << :start_object; end
+        def end_object; @events << :end_object; end
+        def start_array; @events << :start_array; end
+        def end_array; @events << :end_array; end
+        def key(k); @events << [:key, k]; end
+        def string(s); @events << [:string, s]; end
+        def number(n); @events << [:number, n]; end
+        def true_value; @events << true; end
+        def false_value; @events << false; end
+        def null_value; @events << nil; end
+        def end_document; @events << :end_document; end
+      end.new
+    end
+    let(:parser){ Jsonista::Parser.new(handler) }
+
+    it "calls handler methods in document order" do
+      expect(parser.parse_chunk('{"a": [1, "x", true, false, null], "b": {}}')).to be_nil
+      expect(handler.events).to eq([
+        :start_object, [:key, "a"], :start_array, [:number, 1], [:string, "x"],
+        true, false, nil, :end_array, [:key, "b"], :start_object, :end_object,
+        :end_object, :end_document])
+    end
+
+    it "calls handler methods across chunks" do
+      expect(parser.parse_chunk('[1.5, "fo')).to be_nil
+      expect(parser.parse_chunk('o"]')).to be_nil
+      expect(handler.events).to eq([:start_array, [:number, 1.5], [:string, "foo"], :end_array, :end_document])
+    end
+
+    it "skips methods the handler does not define" do
+      strings = Class.new do
+        attr_reader :strings
+        def initialize; @strings = []; end
+        def string(s); @strings << s; end
+      end.new
+      Jsonista::Parser.new(strings).parse_chunk('{"k": ["v", 1, {"w": "x"}]}')
+      expect(strings.strings).to eq(["v", "x"])
     end
   end
 end